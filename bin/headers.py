@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+
+''' Generate perfect hash table for well-known HTTP header names.
+
+Finds a seed for 32-bit FNV-1a over the lowercase name such that the top
+HEADER_BITS bits of the hash are unique for every header, and prints the slot
+table used by src/headers.c.  The header list must stay in the same order as
+the HeaderId enum in include/spidey.h.
+'''
+
+import sys
+
+# Constants
+
+HEADER_BITS = 6
+
+HEADERS = [
+    'Accept',
+    'Accept-Charset',
+    'Accept-Encoding',
+    'Accept-Language',
+    'Authorization',
+    'Cache-Control',
+    'Connection',
+    'Content-Length',
+    'Content-Type',
+    'Cookie',
+    'Expect',
+    'Host',
+    'HTTP2-Settings',
+    'If-Modified-Since',
+    'If-None-Match',
+    'If-Range',
+    'Keep-Alive',
+    'Origin',
+    'Pragma',
+    'Range',
+    'Referer',
+    'TE',
+    'Transfer-Encoding',
+    'Upgrade',
+    'User-Agent',
+    'X-Forwarded-For',
+]
+
+# Functions
+
+def fnv1a(seed, name):
+    ''' Return 32-bit FNV-1a hash of lowercase name starting from seed. '''
+    value = seed
+    for c in name.lower().encode():
+        value = ((value ^ c) * 16777619) & 0xFFFFFFFF
+    return value
+
+def slot(seed, name):
+    ''' Return table slot of name for seed. '''
+    return fnv1a(seed, name) >> (32 - HEADER_BITS)
+
+def find_seed():
+    ''' Return first seed that maps every header to a distinct slot. '''
+    seed = 1
+    while len(set(slot(seed, name) for name in HEADERS)) != len(HEADERS):
+        seed += 1
+    return seed
+
+def enum_name(name):
+    ''' Return HeaderId enumerator for header name. '''
+    return 'HEADER_' + name.upper().replace('-', '_')
+
+# Main Execution
+
+def main():
+    seed = find_seed()
+    print(f'#define HEADER_SEED\t{seed}')
+    print()
+    print('static const HeaderId HeaderSlots[1 << HEADER_BITS] = {')
+    for index in range(1 << HEADER_BITS):
+        matches = [name for name in HEADERS if slot(seed, name) == index]
+        value   = enum_name(matches[0]) if matches else 'HEADER_UNKNOWN'
+        print(f'    [{index:2}] = {value},')
+    print('};')
+
+if __name__ == '__main__':
+    main()
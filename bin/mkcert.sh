@@ -0,0 +1,15 @@
+#!/bin/sh
+
+# Create self-signed certificate and key for spidey -S (testing only).
+
+OUTPUT=${1:-spidey.pem}
+NAME=${2:-localhost}
+
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes \
+    -days 365 -subj "/CN=$NAME" -addext "subjectAltName=DNS:$NAME,IP:127.0.0.1" \
+    -keyout "$OUTPUT" -out "$OUTPUT" 2> /dev/null || exit 1
+
+chmod 600 "$OUTPUT"
+echo "$OUTPUT: self-signed certificate for $NAME"
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=sh:
@@ -0,0 +1,207 @@
+#!/usr/bin/env python3
+
+''' Build memory-mapped site pack for spidey -P.
+
+Walks a document root and writes every readable, non-executable regular file
+into a single pack: a hash-and-displace perfect hash index from URI to entry,
+followed by each entry's precomputed response headers (Content-Type,
+Content-Length, ETag) and body, plus an optional gzip variant.  spidey writes
+the status line itself since it depends on the request's version.  Directories
+and CGI scripts are left out so spidey falls back to the filesystem for them.
+The binary layout must match the Site Pack structures in include/spidey.h.
+'''
+
+import getopt
+import gzip
+import hashlib
+import os
+import struct
+import sys
+
+# Constants
+
+PACK_MAGIC   = b'SPDYPACK'
+PACK_VERSION = 2
+PACK_BASIS   = 2166136261
+PACK_NONE    = 0xFFFFFFFF
+
+HEADER_FORMAT  = '<8sIIIIQ'             # PackHeader
+VARIANT_FORMAT = 'QIIQ'                 # PackVariant
+ENTRY_FORMAT   = '<QII' + VARIANT_FORMAT * 2  # PackEntry
+
+COMPRESSIBLE   = ('text/', 'application/javascript', 'application/json', 'application/xml', 'image/svg+xml')
+
+MIMETYPES_PATH   = '/etc/mime.types'
+DEFAULT_MIMETYPE = 'text/plain'
+ROOT_PATH        = 'www'
+GZIP             = False
+
+# Functions
+
+def usage(status=0):
+    ''' Display usage message and exit with status. '''
+    progname = os.path.basename(sys.argv[0])
+    print(f'''Usage: {progname} [-r root -m mimetypes -M mimetype -z] output
+
+Options:
+    -r path       Root directory (default: {ROOT_PATH})
+    -m path       Path to mimetypes file (default: {MIMETYPES_PATH})
+    -M mimetype   Default mimetype (default: {DEFAULT_MIMETYPE})
+    -z            Add gzip variants of compressible files''')
+    sys.exit(status)
+
+def fnv1a(seed, data):
+    ''' Return 32-bit FNV-1a hash of data starting from seed. '''
+    value = seed
+    for c in data:
+        value = ((value ^ c) * 16777619) & 0xFFFFFFFF
+    return value
+
+def load_mimetypes(path):
+    ''' Return mapping from extension to mimetype. '''
+    mimetypes = {}
+    try:
+        for line in open(path):
+            fields = line.split()
+            if not fields or fields[0].startswith('#'):
+                continue
+            for extension in fields[1:]:
+                mimetypes.setdefault(extension, fields[0])
+    except OSError:
+        pass
+    return mimetypes
+
+def collect_files(root):
+    ''' Yield (uri, path) of every file that spidey would serve as a file. '''
+    for dirpath, dirnames, filenames in os.walk(root):
+        dirnames.sort()
+        for filename in sorted(filenames):
+            path = os.path.join(dirpath, filename)
+            if not os.path.isfile(path) or not os.access(path, os.R_OK) or os.access(path, os.X_OK):
+                continue
+            yield '/' + os.path.relpath(path, root).replace(os.sep, '/'), path
+
+def build_head(mimetype, body, etag, vary, encoding=None):
+    ''' Return precomputed response headers. '''
+    head  = f'Content-Type: {mimetype}\r\n'
+    head += f'Content-Length: {len(body)}\r\n'
+    head += f'ETag: "{etag}"\r\n'
+    if encoding:
+        head += f'Content-Encoding: {encoding}\r\n'
+    if vary:
+        head += 'Vary: Accept-Encoding\r\n'
+    head += '\r\n'
+    return head.encode()
+
+def build_index(uris):
+    ''' Return (displacements, slots) of perfect hash over uris. '''
+    nbuckets = max(1, len(uris) // 2)
+    nslots   = max(1, len(uris) + len(uris) // 4)
+    buckets  = [[] for _ in range(nbuckets)]
+    for index, uri in enumerate(uris):
+        buckets[fnv1a(PACK_BASIS, uri) % nbuckets].append(index)
+
+    displacements = [0] * nbuckets
+    slots         = [PACK_NONE] * nslots
+    for bucket in sorted(range(nbuckets), key=lambda b: -len(buckets[b])):
+        if not buckets[bucket]:
+            continue
+
+        seed = 1
+        while True:
+            candidates = [fnv1a(seed, uris[i]) % nslots for i in buckets[bucket]]
+            if len(set(candidates)) == len(candidates) and all(slots[c] == PACK_NONE for c in candidates):
+                break
+            seed += 1
+
+        displacements[bucket] = seed
+        for index, slot in zip(buckets[bucket], candidates):
+            slots[slot] = index
+
+    return displacements, slots
+
+def build_pack(root, mimetypes, default, compress):
+    ''' Return contents of site pack for root. '''
+    files = list(collect_files(root))
+    uris  = [uri.encode() for uri, _ in files]
+    displacements, slots = build_index(uris)
+
+    tables  = struct.calcsize(HEADER_FORMAT) + 4 * (len(displacements) + len(slots))
+    tables  = (tables + 7) & ~7
+    offset  = tables + struct.calcsize(ENTRY_FORMAT) * len(files)
+    entries = []
+    data    = bytearray()
+
+    for (uri, path), uri_bytes in zip(files, uris):
+        body      = open(path, 'rb').read()
+        extension = os.path.splitext(path)[1][1:]
+        mimetype  = mimetypes.get(extension, default)
+        etag      = hashlib.sha1(body).hexdigest()[:16]
+        variants  = [(0, 0, 0), (0, 0, 0)]
+
+        uri_offset = offset + len(data)
+        data += uri_bytes
+
+        compressed = None
+        if compress and mimetype.startswith(COMPRESSIBLE):
+            compressed = gzip.compress(body, mtime=0)
+            if len(compressed) >= len(body) * 9 // 10:
+                compressed = None
+
+        head = build_head(mimetype, body, etag, compressed is not None)
+        variants[0] = (offset + len(data), len(head), len(body))
+        data += head + body
+
+        if compressed is not None:
+            head = build_head(mimetype, compressed, etag + '-gzip', True, 'gzip')
+            variants[1] = (offset + len(data), len(head), len(compressed))
+            data += head + compressed
+
+        entries.append((uri_offset, len(uri_bytes), 0,
+                        variants[0][0], variants[0][1], 0, variants[0][2],
+                        variants[1][0], variants[1][1], 0, variants[1][2]))
+
+    size = offset + len(data)
+    pack = bytearray(struct.pack(HEADER_FORMAT, PACK_MAGIC, PACK_VERSION, len(files), len(displacements), len(slots), size))
+    pack += struct.pack(f'<{len(displacements)}I', *displacements)
+    pack += struct.pack(f'<{len(slots)}I', *slots)
+    pack += b'\0' * (tables - len(pack))
+    for entry in entries:
+        pack += struct.pack(ENTRY_FORMAT, *entry)
+    pack += data
+    return bytes(pack), len(files)
+
+# Main Execution
+
+def main():
+    global ROOT_PATH, MIMETYPES_PATH, DEFAULT_MIMETYPE, GZIP
+
+    try:
+        options, arguments = getopt.getopt(sys.argv[1:], 'hr:m:M:z')
+    except getopt.GetoptError as e:
+        print(e)
+        usage(1)
+
+    for option, value in options:
+        if option == '-r':
+            ROOT_PATH = value
+        elif option == '-m':
+            MIMETYPES_PATH = value
+        elif option == '-M':
+            DEFAULT_MIMETYPE = value
+        elif option == '-z':
+            GZIP = True
+        else:
+            usage(0)
+
+    if len(arguments) != 1:
+        usage(1)
+
+    pack, count = build_pack(ROOT_PATH, load_mimetypes(MIMETYPES_PATH), DEFAULT_MIMETYPE, GZIP)
+    with open(arguments[0], 'wb') as stream:
+        stream.write(pack)
+
+    print(f'{arguments[0]}: {count} entries, {len(pack)} bytes')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+
+''' Benchmark handler plugins against CGI scripts on a running server.
+
+Requests each URL (by default the sample plugin www/scripts/env.so, built by
+make, and the CGI script www/scripts/env.sh it mirrors) from several
+persistent connections at once, and reports throughput and latency
+percentiles of each.
+'''
+
+import concurrent.futures
+import getopt
+import http.client
+import os
+import socket
+import subprocess
+import sys
+import time
+
+# Constants
+
+HOST     = 'localhost'
+PORT     = 9898
+REQUESTS = 1000
+WORKERS  = 8
+URLS     = ['/scripts/env.so', '/scripts/env.sh']
+
+# Functions
+
+def usage(status=0):
+    ''' Display usage message and exit with status. '''
+    progname = os.path.basename(sys.argv[0])
+    print(f'''Usage: {progname} [options] [url ...]
+
+Options:
+    -H host       Server host (default: {HOST})
+    -p port       Server port (default: {PORT})
+    -n requests   Requests per URL (default: {REQUESTS})
+    -w workers    Connections per URL (default: {WORKERS})
+    -m mode       Start bin/spidey in mode (single, forking, sharded, ...) for the benchmark
+    -a arguments  Extra arguments for the started server
+
+URLs default to {' '.join(URLS)}.''')
+    sys.exit(status)
+
+def hammer(host, port, url, requests):
+    ''' Make requests over one persistent connection and return latencies. '''
+    latencies  = []
+    connection = http.client.HTTPConnection(host, port, timeout=30)
+    for _ in range(requests):
+        begin = time.monotonic()
+        try:
+            connection.request('GET', url)
+            response = connection.getresponse()
+            response.read()
+            if response.status != 200:
+                raise http.client.HTTPException(f'{url}: {response.status}')
+            if response.will_close:
+                connection.close()
+        except (OSError, http.client.HTTPException):
+            connection.close()
+            latencies.append(None)
+            continue
+        latencies.append(time.monotonic() - begin)
+    connection.close()
+    return latencies
+
+def benchmark(host, port, url, requests, workers):
+    ''' Return (elapsed, errors, sorted latencies) of requests to url. '''
+    shares  = [requests // workers + (i < requests % workers) for i in range(workers)]
+    results = []
+    started = time.monotonic()
+    with concurrent.futures.ThreadPoolExecutor(workers) as executor:
+        for latencies in executor.map(lambda n: hammer(host, port, url, n), shares):
+            results.extend(latencies)
+    elapsed = time.monotonic() - started
+    errors  = sum(1 for latency in results if latency is None)
+    return elapsed, errors, sorted(latency for latency in results if latency is not None)
+
+def percentile(values, fraction):
+    ''' Return fraction percentile of sorted values (in milliseconds). '''
+    if not values:
+        return 0.0
+    return values[min(len(values) - 1, int(fraction * len(values)))] * 1000
+
+def start_server(mode, arguments, port):
+    ''' Start bin/spidey in mode and wait until it accepts connections. '''
+    spidey  = os.path.join(os.path.dirname(os.path.abspath(sys.argv[0])), 'spidey')
+    command = [spidey, '-c', mode, '-p', str(port)] + arguments.split()
+    server  = subprocess.Popen(command, stderr=subprocess.DEVNULL)
+    for _ in range(100):
+        try:
+            socket.create_connection((HOST, port), timeout=1).close()
+            return server
+        except OSError:
+            time.sleep(0.05)
+    server.terminate()
+    raise RuntimeError(f'{" ".join(command)} did not start')
+
+# Main Execution
+
+def main():
+    global HOST, PORT, REQUESTS, WORKERS
+
+    mode      = None
+    arguments = ''
+
+    try:
+        options, urls = getopt.getopt(sys.argv[1:], 'hH:p:n:w:m:a:')
+    except getopt.GetoptError as e:
+        print(e)
+        usage(1)
+
+    for option, value in options:
+        if option == '-H':
+            HOST = value
+        elif option == '-p':
+            PORT = int(value)
+        elif option == '-n':
+            REQUESTS = int(value)
+        elif option == '-w':
+            WORKERS = int(value)
+        elif option == '-m':
+            mode = value
+        elif option == '-a':
+            arguments = value
+        else:
+            usage(0)
+
+    server = start_server(mode, arguments, PORT) if mode else None
+    try:
+        for url in urls or URLS:
+            elapsed, errors, latencies = benchmark(HOST, PORT, url, REQUESTS, WORKERS)
+            print(f'{url:<24} {len(latencies) / elapsed:9.1f} req/s  ({errors} errors)  '
+                  f'p50 {percentile(latencies, 0.50):.2f} ms  p99 {percentile(latencies, 0.99):.2f} ms')
+    finally:
+        if server:
+            server.terminate()
+            server.wait()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,307 @@
+#!/usr/bin/env python3
+
+''' Replay request capture from spidey -C against a running server.
+
+Reads a capture log (the Request Capture structures in include/spidey.h) and
+replays its requests over loopback, reusing connections the way the original
+clients did, at the original pace, scaled by a speed factor, or as fast as
+possible.  Reports throughput and latency percentiles, and compares them with
+a stored baseline to flag regressions.
+
+Only request heads are captured, so bodies are replayed as zero bytes of the
+declared Content-Length (or an empty chunked body).  HTTP/2 connections are
+skipped.
+'''
+
+import concurrent.futures
+import getopt
+import json
+import os
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+# Constants
+
+CAPTURE_MAGIC   = b'SPDYCAPT'
+CAPTURE_VERSION = 1
+
+HEADER_FORMAT = '<8sIIQ'                # CaptureHeader
+RECORD_FORMAT = '<QIII'                 # CaptureRecord
+
+HOST      = 'localhost'
+PORT      = 9898
+SPEED     = 1.0
+WORKERS   = 64
+TOLERANCE = 0.10
+TIMEOUT   = 30.0
+
+# Functions
+
+def usage(status=0):
+    ''' Display usage message and exit with status. '''
+    progname = os.path.basename(sys.argv[0])
+    print(f'''Usage: {progname} [options] capture
+
+Options:
+    -H host       Server host (default: {HOST})
+    -p port       Server port (default: {PORT})
+    -s speed      Speed factor: 1 original pace, 2 twice as fast, 0 maximum (default: {SPEED:g})
+    -w workers    Connections replayed at once (default: {WORKERS})
+    -m mode       Start bin/spidey in mode (single, forking, sharded, ...) for the replay
+    -a arguments  Extra arguments for the started server
+    -b path       Compare with baseline and exit 1 on regression
+    -o path       Save results as baseline
+    -t tolerance  Allowed relative regression (default: {TOLERANCE:g})''')
+    sys.exit(status)
+
+def load_capture(path):
+    ''' Return list of (offset, pid, served, head) records of capture. '''
+    data = open(path, 'rb').read()
+    magic, version, _, _ = struct.unpack_from(HEADER_FORMAT, data)
+    if magic != CAPTURE_MAGIC or version != CAPTURE_VERSION:
+        raise ValueError(f'{path}: not a version {CAPTURE_VERSION} capture')
+
+    records = []
+    offset  = struct.calcsize(HEADER_FORMAT)
+    size    = struct.calcsize(RECORD_FORMAT)
+    while offset + size <= len(data):
+        nanoseconds, pid, served, length = struct.unpack_from(RECORD_FORMAT, data, offset)
+        offset += size
+        records.append((nanoseconds / 1e9, pid, served, data[offset:offset + length]))
+        offset += length
+    return records
+
+def build_connections(records):
+    ''' Return list of connections, each a list of (offset, request) in order.
+
+    A record with served == 0 starts a new connection; later ones continue the
+    open connection of the same process.
+    '''
+    connections = []
+    open_connections = {}
+    for offset, pid, served, head in records:
+        if head.startswith(b'PRI * HTTP/2') or b'\nupgrade: h2c' in head.lower():
+            continue
+
+        if served == 0 or pid not in open_connections:
+            open_connections[pid] = []
+            connections.append(open_connections[pid])
+        open_connections[pid].append((offset, head + request_body(head)))
+    return connections
+
+def request_body(head):
+    ''' Return placeholder body matching framing declared by head. '''
+    for line in head.split(b'\n')[1:]:
+        name, _, value = line.partition(b':')
+        name = name.strip().lower()
+        if name == b'content-length':
+            return b'\0' * int(value.strip() or 0)
+        if name == b'transfer-encoding':
+            return b'0\r\n\r\n'
+    return b''
+
+def read_response(stream):
+    ''' Read one response from stream and return (status, keepalive). '''
+    while True:
+        line = stream.readline()
+        if not line:
+            raise ConnectionError('connection closed')
+        version, status = line.split()[:2]
+        status  = int(status)
+        headers = {}
+        while True:
+            line = stream.readline()
+            if line in (b'\r\n', b'\n', b''):
+                break
+            name, _, value = line.partition(b':')
+            headers[name.strip().lower()] = value.strip().lower()
+
+        if status >= 200:
+            break
+
+    keepalive = version == b'HTTP/1.1'
+    if b'connection' in headers:
+        keepalive = b'keep-alive' in headers[b'connection']
+
+    if headers.get(b'transfer-encoding') == b'chunked':
+        while True:
+            size = int(stream.readline().split(b';')[0], 16)
+            stream.read(size + 2)
+            if size == 0:
+                break
+    elif b'content-length' in headers:
+        stream.read(int(headers[b'content-length']))
+    else:
+        while stream.read(65536):
+            pass
+        keepalive = False
+    return status, keepalive
+
+def replay_connection(requests, host, port, speed, started):
+    ''' Replay requests of one connection and return list of (status, latency). '''
+    results = []
+    sock    = None
+    for offset, request in requests:
+        if speed > 0:
+            delay = started + offset / speed - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+
+        begin = time.monotonic()
+        try:
+            if sock is None:
+                sock   = socket.create_connection((host, port), timeout=TIMEOUT)
+                stream = sock.makefile('rb')
+            sock.sendall(request)
+            status, keepalive = read_response(stream)
+        except (OSError, ValueError, ConnectionError):
+            status, keepalive = 0, False
+        results.append((status, time.monotonic() - begin))
+
+        if not keepalive and sock is not None:
+            sock.close()
+            sock = None
+
+    if sock is not None:
+        sock.close()
+    return results
+
+def percentile(values, fraction):
+    ''' Return fraction percentile of sorted values. '''
+    if not values:
+        return 0.0
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+def summarize(results, elapsed):
+    ''' Return dictionary of throughput and latency statistics. '''
+    latencies = sorted(latency for _, latency in results)
+    statuses  = {}
+    for status, _ in results:
+        statuses[str(status)] = statuses.get(str(status), 0) + 1
+
+    return {
+        'requests':   len(results),
+        'errors':     statuses.get('0', 0),
+        'statuses':   statuses,
+        'elapsed':    elapsed,
+        'throughput': len(results) / elapsed if elapsed else 0.0,
+        'p50':        percentile(latencies, 0.50) * 1000,
+        'p90':        percentile(latencies, 0.90) * 1000,
+        'p99':        percentile(latencies, 0.99) * 1000,
+        'max':        (latencies[-1] if latencies else 0.0) * 1000,
+    }
+
+def compare(summary, baseline, tolerance):
+    ''' Return list of regressions of summary versus baseline. '''
+    regressions = []
+    if summary['throughput'] < baseline['throughput'] * (1 - tolerance):
+        regressions.append(f"throughput {summary['throughput']:.1f} < {baseline['throughput']:.1f} req/s")
+    for metric in ('p50', 'p90', 'p99'):
+        if summary[metric] > baseline[metric] * (1 + tolerance):
+            regressions.append(f'{metric} {summary[metric]:.2f} > {baseline[metric]:.2f} ms')
+    if summary['errors'] > baseline['errors']:
+        regressions.append(f"errors {summary['errors']} > {baseline['errors']}")
+    return regressions
+
+def start_server(mode, arguments, port):
+    ''' Start bin/spidey in mode and wait until it accepts connections. '''
+    spidey  = os.path.join(os.path.dirname(os.path.abspath(sys.argv[0])), 'spidey')
+    command = [spidey, '-c', mode, '-p', str(port)] + arguments.split()
+    server  = subprocess.Popen(command, stderr=subprocess.DEVNULL)
+    for _ in range(100):
+        try:
+            socket.create_connection((HOST, port), timeout=1).close()
+            return server
+        except OSError:
+            time.sleep(0.05)
+    server.terminate()
+    raise RuntimeError(f'{" ".join(command)} did not start')
+
+# Main Execution
+
+def main():
+    global HOST, PORT, SPEED, WORKERS, TOLERANCE
+
+    mode      = None
+    arguments = ''
+    baseline  = None
+    output    = None
+
+    try:
+        options, paths = getopt.getopt(sys.argv[1:], 'hH:p:s:w:m:a:b:o:t:')
+    except getopt.GetoptError as e:
+        print(e)
+        usage(1)
+
+    for option, value in options:
+        if option == '-H':
+            HOST = value
+        elif option == '-p':
+            PORT = int(value)
+        elif option == '-s':
+            SPEED = float(value)
+        elif option == '-w':
+            WORKERS = int(value)
+        elif option == '-m':
+            mode = value
+        elif option == '-a':
+            arguments = value
+        elif option == '-b':
+            baseline = value
+        elif option == '-o':
+            output = value
+        elif option == '-t':
+            TOLERANCE = float(value)
+        else:
+            usage(0)
+
+    if len(paths) != 1:
+        usage(1)
+
+    connections = build_connections(load_capture(paths[0]))
+    server      = start_server(mode, arguments, PORT) if mode else None
+
+    # Replay connections, each in order, many at once (connections are only
+    # handed to a worker once they are due, so waiting does not hold workers)
+    try:
+        started = time.monotonic()
+        results = []
+        with concurrent.futures.ThreadPoolExecutor(WORKERS) as executor:
+            futures = []
+            for connection in connections:
+                if SPEED > 0:
+                    delay = started + connection[0][0] / SPEED - time.monotonic()
+                    if delay > 0:
+                        time.sleep(delay)
+                futures.append(executor.submit(replay_connection, connection, HOST, PORT, SPEED, started))
+            for future in concurrent.futures.as_completed(futures):
+                results.extend(future.result())
+        elapsed = time.monotonic() - started
+    finally:
+        if server:
+            server.terminate()
+            server.wait()
+
+    summary = summarize(results, elapsed)
+    print(f"requests    {summary['requests']} ({summary['errors']} errors) in {len(connections)} connections")
+    print(f"statuses    {' '.join(f'{k}:{v}' for k, v in sorted(summary['statuses'].items()))}")
+    print(f"elapsed     {summary['elapsed']:.3f} s")
+    print(f"throughput  {summary['throughput']:.1f} req/s")
+    print(f"latency     p50 {summary['p50']:.2f} ms, p90 {summary['p90']:.2f} ms, p99 {summary['p99']:.2f} ms, max {summary['max']:.2f} ms")
+
+    if output:
+        with open(output, 'w') as stream:
+            json.dump(summary, stream, indent=4)
+
+    if baseline:
+        regressions = compare(summary, json.load(open(baseline)), TOLERANCE)
+        for regression in regressions:
+            print(f'REGRESSION  {regression}')
+        if regressions:
+            sys.exit(1)
+
+if __name__ == '__main__':
+    main()
@@ -13,17 +13,19 @@ def usage(status=0):
     print(f'''Usage: {progname} [-h HAMMERS -t THROWS] URL
     -h  HAMMERS     Number of hammers to utilize (1)
     -t  THROWS      Number of throws per hammer  (1)
+    -k              Accept self-signed certificates (https URLs)
     -v              Display verbose output
     ''')
     sys.exit(status)
 
-def hammer(url, throws, verbose, hid):
+def hammer(url, throws, verbose, hid, verify=True):
     ''' Hammer specified url by making multiple throws (ie. HTTP requests).
 
     - url:      URL to request
     - throws:   How many times to make the request
     - verbose:  Whether or not to display the text of the response
     - hid:      Unique hammer identifier
+    - verify:   Whether or not to verify the server certificate
 
     Return the average elapsed time of all the throws.
     '''
@@ -35,7 +37,7 @@ def hammer(url, throws, verbose, hid):
         
         # HTTP Request
         tSStart = time.time()
-        r = requests.get(url);
+        r = requests.get(url, verify=verify);
         tSEnd = time.time()
 
         if (verbose):
@@ -60,6 +62,7 @@ def main():
     hammers = 1
     throws  = 1
     verbose = False
+    verify  = True
     setURL  = False
     url     = ''
 
@@ -84,6 +87,9 @@ def main():
                 skip = True
         elif arg == '-v':                       # Verbose flag
             verbose = True
+        elif arg == '-k':                       # Insecure flag
+            verify = False
+            requests.packages.urllib3.disable_warnings()
         elif arg[0] == '-' and len(arg) == 2:   # Prevents unknown flags
             usage(1)
         else:
@@ -97,7 +103,7 @@ def main():
 
     # Create pool of workers and perform throws
     avgTimes = []
-    args = ((url, throws, verbose, hid) for hid in range(hammers))
+    args = ((url, throws, verbose, hid, verify) for hid in range(hammers))
     with concurrent.futures.ProcessPoolExecutor(hammers) as executor:
         avgElapsed = list(executor.map(do_hammer, args))
         
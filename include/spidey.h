@@ -3,12 +3,15 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <netdb.h>
 #include <unistd.h>
 
+#include <sys/stat.h>
+
 /* Constants */
 
 #define WHITESPACE	" \t\n"
@@ -19,15 +22,44 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    SHARDED,                            /**< Forking server per CPU */
     UNKNOWN
 } ServerMode;
 
 /* Global Variables */
 
-extern char *Port;                      /**< Port number */
+extern char *Port;                      /**< Port number of first TCP listener ("0" if none) */
+extern char *Addresses[];               /**< Listen addresses (port numbers or unix:path) */
+extern size_t NAddresses;               /**< Number of listen addresses */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern char *PackPath;                  /**< Path to site pack (NULL if none) */
+extern long  IdleTimeout;               /**< Milliseconds to wait for a request */
+extern long  HeaderTimeout;             /**< Milliseconds to read request headers */
+extern long  WriteTimeout;              /**< Milliseconds a response write may stall */
+extern long  RequestTimeout;            /**< Milliseconds for entire request */
+extern long  MaxChildren;               /**< Maximum concurrent forked children */
+extern long  MaxPending;                /**< Maximum connections waiting for a child */
+extern long  HandlerLimits[];           /**< Maximum concurrent children per Handler (0 is unlimited) */
+extern long  RetryAfter;                /**< Seconds advertised in 503 Retry-After */
+extern long  BrowsePageSize;            /**< Maximum entries per directory listing page */
+extern long  KeepAliveRequests;         /**< Maximum requests per connection (1 disables keep-alive) */
+extern long  BodyLimit;                 /**< Maximum request body bytes passed to CGI scripts */
+extern long  ShardCount;                /**< Number of sharded workers (0 is one per CPU) */
+extern char *TracePath;                 /**< Path to trace event file (NULL if none) */
+extern char *CapturePath;               /**< Path to request capture log (NULL if none) */
+extern long  TraceRate;                 /**< Trace one in TraceRate requests */
+extern char *CertificatePath;           /**< Path to PEM certificate and key (NULL serves plain HTTP) */
+extern long  CacheEntries;              /**< Slots in shared cache (0 disables it) */
+extern long  CacheTTL;                  /**< Seconds a shared cache entry stays valid */
+extern long  InlineLimit;               /**< Largest file served from a stored complete response (0 disables it) */
+extern long  InlineBudget;              /**< Bytes of memory for stored complete responses */
+extern long  SendQuantum;               /**< Bytes sent per scheduled slice (larger responses are scheduled) */
+extern long  Bandwidth;                 /**< Bytes per second shared by scheduled transfers (0 is unlimited) */
+extern long  ClientBandwidth;           /**< Bytes per second of scheduled transfers per client address (0 is unlimited) */
+extern char *WarmPath;                  /**< Path to access profile warmed at startup (NULL if none) */
+extern long  WarmLimit;                 /**< Maximum URIs warmed at startup */
 
 /* Logging Macros */
 
@@ -40,32 +72,243 @@ extern char *RootPath;                  /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* Tracing Macros (build with make TRACE=1) */
+
+#ifdef TRACE
+#define trace_start(r)          ((r)->traced = trace_sample(), (r)->started = trace_now())
+#define trace_begin(r, span)    uint64_t span##_trace = (r)->traced ? trace_now() : 0
+#define trace_end(r, span)      do { if ((r)->traced) trace_record(#span, span##_trace, NULL); } while (0)
+#define trace_commit(r)         do { if ((r)->traced) trace_flush(); } while (0)
+#define trace_finish(r)         do { if ((r)->traced) { if ((r)->method) trace_record("request", (r)->started, (r)->uri); trace_flush(); } } while (0)
+#define trace_handoff(r)        ((r)->traced = false)
+#else
+#define trace_start(r)
+#define trace_begin(r, span)
+#define trace_end(r, span)
+#define trace_commit(r)
+#define trace_finish(r)
+#define trace_handoff(r)
+#endif
+
+void	    trace_init(void);
+uint64_t    trace_now(void);
+bool	    trace_sample(void);
+void	    trace_record(const char *name, uint64_t start, const char *detail);
+void	    trace_flush(void);
+
+/* Scanning */
+
+typedef struct {
+    const char *name;                   /*< Name of instruction set */
+    size_t    (*delimiter)(const char *s, size_t n, const char *set); /*< Offset of first byte in set */
+    size_t    (*token)(const char *s, size_t n);  /*< Offset of first non-token byte */
+} Scanner;
+
+extern const Scanner  Scanners[];       /**< Available scanners (NULL terminated) */
+extern const Scanner *Scan;             /**< Scanner selected by scan_init */
+
+#define scan_delimiter(s, n, set)   Scan->delimiter((s), (n), (set))
+#define scan_token(s, n)            Scan->token((s), (n))
+
+void	    scan_init(void);
+bool	    scan_select(const char *name);
+
+/* Timer Wheel */
+
+#define TIMER_TICK_MS	10		/**< Milliseconds per wheel tick */
+#define TIMER_BITS	6		/**< Bits of expiration per level */
+#define TIMER_SLOTS	(1 << TIMER_BITS)
+#define TIMER_MASK	(TIMER_SLOTS - 1)
+#define TIMER_LEVELS	4
+
+typedef struct timer Timer;
+struct timer {
+    uint64_t  expires;                  /*< Absolute expiration tick */
+    void    (*callback)(Timer *, void *);/*< Function to call on expiration */
+    void     *arg;                      /*< Argument to callback */
+    Timer    *next;                     /*< Next timer in slot (NULL if idle) */
+    Timer    *prev;                     /*< Previous timer in slot */
+};
+
+typedef struct {
+    uint64_t  current;                  /*< Current tick */
+    size_t    count;                    /*< Number of pending timers */
+    Timer     slots[TIMER_LEVELS][TIMER_SLOTS]; /*< Slot list sentinels */
+} TimerWheel;
+
+extern TimerWheel Timers;               /**< Per-process timer wheel */
+
+uint64_t    timer_now(void);
+void	    timer_init(TimerWheel *w);
+void	    timer_add(TimerWheel *w, Timer *t, uint64_t msecs);
+void	    timer_cancel(TimerWheel *w, Timer *t);
+size_t	    timer_advance(TimerWheel *w);
+int	    timer_timeout(TimerWheel *w);
+long	    timer_remaining(Timer *t);
+
+/**
+ * Request deadlines
+ */
+typedef enum {
+    TIMEOUT_NONE = 0,                   /**< No deadline expired */
+    TIMEOUT_IDLE,                       /**< Waiting for request to arrive */
+    TIMEOUT_HEADER,                     /**< Reading request line and headers */
+    TIMEOUT_WRITE,                      /**< Writing response */
+    TIMEOUT_REQUEST,                    /**< Entire request */
+    TIMEOUT_NTYPES
+} Timeout;
+
+/* Statistics */
+
+typedef struct {
+    size_t  accepted;                   /*< Number of accepted connections */
+    size_t  handled;                    /*< Number of successfully handled requests */
+    size_t  timeouts[TIMEOUT_NTYPES];   /*< Number of expired deadlines by type */
+    size_t  queued;                     /*< Number of connections queued for a child */
+    size_t  shed;                       /*< Number of connections shed with 503 */
+    size_t  cache_hits;                 /*< Number of shared cache lookups answered */
+    size_t  cache_misses;               /*< Number of shared cache lookups not answered */
+    size_t  cache_evictions;            /*< Number of valid shared cache entries replaced */
+    size_t  throttled;                  /*< Number of waits of scheduled transfers */
+    size_t  inline_hits;                /*< Number of requests answered with a stored response */
+    size_t  inline_misses;              /*< Number of inline store lookups not answered */
+    size_t  inline_refreshes;           /*< Number of stored responses rebuilt after their file changed */
+    size_t  inline_entries;             /*< Number of stored responses (gauge) */
+    size_t  inline_bytes;               /*< Bytes of stored responses (gauge) */
+} __attribute__((aligned(64))) Stats;  /* Own cache line(s) per shard */
+
+extern Stats *Statistics;               /**< Statistics of this process's shard */
+
+#define stats_add(field, n) __atomic_add_fetch(&Statistics->field, (n), __ATOMIC_RELAXED)
+
+void	    stats_init(void);
+void	    stats_shards(long nshards);
+void	    stats_select(long shard);
+void	    stats_check(void);
+void	    stats_dump(FILE *stream);
+
 /* HTTP Request */
 
+/**
+ * Well-known HTTP headers (sorted; see bin/headers.py)
+ */
+typedef enum {
+    HEADER_ACCEPT = 0,
+    HEADER_ACCEPT_CHARSET,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_AUTHORIZATION,
+    HEADER_CACHE_CONTROL,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_COOKIE,
+    HEADER_EXPECT,
+    HEADER_HOST,
+    HEADER_HTTP2_SETTINGS,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_RANGE,
+    HEADER_KEEP_ALIVE,
+    HEADER_ORIGIN,
+    HEADER_PRAGMA,
+    HEADER_RANGE,
+    HEADER_REFERER,
+    HEADER_TE,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_UPGRADE,
+    HEADER_USER_AGENT,
+    HEADER_X_FORWARDED_FOR,
+    HEADER_NKNOWN,
+    HEADER_UNKNOWN = HEADER_NKNOWN      /**< Not a well-known header */
+} HeaderId;
+
+HeaderId    header_lookup(const char *name, size_t length);
+const char *header_name(HeaderId id);
+
 typedef struct header Header;
 struct header {
     char    *name;                      /*< Name of header entry */
     char    *data;                      /*< Data of header entry */
-    Header  *next;                      /*< Next header entry */
 };
 
 typedef struct {
     int     fd;                         /*< Client socket file descripter */
-    FILE    *stream;                    /*< Client socket file stream */
+    FILE    *stream;                    /*< Client socket file stream (for writing) */
+    struct ssl_st *tls;                 /*< TLS session (NULL if plain or not yet negotiated) */
+    bool     ktls_send;                 /*< Whether kernel encrypts writes to fd */
+    bool     ktls_recv;                 /*< Whether kernel decrypts reads from fd */
+    bool     local;                     /*< Whether client connected over a Unix domain socket */
+    char     buffer[BUFSIZ];            /*< Bytes received from client */
+    size_t   buffered;                  /*< Number of bytes in buffer */
+    size_t   consumed;                  /*< Number of buffered bytes already parsed */
     char    *method;                    /*< HTTP method */
     char    *uri;                       /*< HTTP uniform resource identifier */
     char    *path;                      /*< Real path corrsponding to URI and RootPath */
     char    *query;                     /*< HTTP query string */
+    unsigned version;                   /*< HTTP version (10 for HTTP/1.0, 11 for HTTP/1.1) */
+    bool     keepalive;                 /*< Whether connection persists after response */
+    size_t   served;                    /*< Number of earlier requests on connection */
+    bool     chunked;                   /*< Whether request body chunks remain */
+    size_t   remaining;                 /*< Request body bytes left (in current chunk if chunked) */
+    size_t   received;                  /*< Request body bytes received so far */
+    FILE    *upload;                    /*< Request body received on an HTTP/2 stream (NULL if none) */
+    FILE    *payload;                   /*< File an HTTP/2 stream sends the response body from (NULL if none) */
+    bool     traced;                    /*< Whether request was sampled for tracing (TRACE builds only) */
+    uint64_t started;                   /*< Monotonic nanoseconds request started (TRACE builds only) */
 
     char     host[NI_MAXHOST];          /*< Host name of client */
     char     port[NI_MAXSERV];          /*< Port number of client */
 
-    Header  *headers;                   /*< List of name, data Header pairs */
+    char    *known[HEADER_NKNOWN];      /*< Data of well-known headers by HeaderId */
+    Header  *headers;                   /*< Array of unknown name, data Header pairs */
+    size_t   nheaders;                  /*< Number of unknown headers */
+    size_t   capacity;                  /*< Allocated capacity of unknown headers */
+
+    Timeout  phase;                     /*< Current request phase */
+    Timeout  timeout;                   /*< Deadline that expired (if any) */
+    Timer    deadline;                  /*< Deadline of current phase */
+    Timer    expiry;                    /*< Deadline of entire request */
 } Request;
 
 Request *   accept_request(int sfd);
 void	    free_request(Request *request);
+int	    request_reset(Request *request);
 int	    parse_request(Request *request);
+const char *request_header(Request *request, HeaderId id);
+int	    request_add_header(Request *request, const char *name, const char *data);
+ssize_t	    request_read(Request *request, void *data, size_t size);
+bool	    request_pending(Request *request);
+bool	    request_zerocopy(Request *request);
+ssize_t	    request_body(Request *request, int pfd);
+void	    request_chunk(Request *request, const void *data, size_t size);
+void	    request_phase(Request *request, Timeout phase);
+bool	    request_timedout(Request *request);
+
+/* HPACK */
+
+typedef struct {
+    char    *name;                      /*< Name of dynamic table entry */
+    char    *value;                     /*< Value of dynamic table entry */
+    size_t   size;                      /*< Size of entry as defined by RFC 7541 */
+} HpackEntry;
+
+typedef struct {
+    HpackEntry *entries;                /*< Ring of dynamic table entries */
+    size_t      capacity;               /*< Number of slots in ring */
+    size_t      first;                  /*< Slot of newest entry */
+    size_t      count;                  /*< Number of entries */
+    size_t      size;                   /*< Total size of entries */
+    size_t      max_size;               /*< Current maximum size */
+    size_t      limit;                  /*< SETTINGS_HEADER_TABLE_SIZE */
+} HpackTable;
+
+typedef int (*HpackCallback)(void *arg, const char *name, const char *value);
+
+void	    hpack_init(HpackTable *t, size_t max_size);
+void	    hpack_free(HpackTable *t);
+int	    hpack_decode(HpackTable *t, const uint8_t *block, size_t length, HpackCallback callback, void *arg);
+size_t	    hpack_encode(uint8_t *out, size_t size, const char *name, const char *value);
 
 /* HTTP Request Handlers */
 
@@ -73,19 +316,204 @@ typedef enum {
     HTTP_STATUS_OK = 0,			/* 200 OK */
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
+    HTTP_STATUS_REQUEST_TIMEOUT,	/* 408 Request Timeout */
+    HTTP_STATUS_PAYLOAD_TOO_LARGE,	/* 413 Payload Too Large */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
 } Status;
 
+/**
+ * Request handler types
+ */
+typedef enum {
+    HANDLER_BROWSE = 0,                 /**< Directory listing */
+    HANDLER_FILE,                       /**< Static file */
+    HANDLER_CGI,                        /**< CGI script */
+    HANDLER_PLUGIN,                     /**< Handler plugin (shared object) */
+    HANDLER_NTYPES
+} Handler;
+
 Status      handle_request(Request *request);
+Status      dispatch_request(Request *request);
+size_t      format_status(Request *request, const char *status, bool framed, char *buffer, size_t size);
+void        handle_status(Request *request, const char *status, bool framed);
+
+/* Handler Plugins (see plugins/) */
+
+#define PLUGIN_SYMBOL	"spidey_plugin"	/**< Symbol of Plugin structure in shared object */
+#define PLUGIN_VERSION	2		/**< Version of Plugin, Response and Request structures */
+#define PLUGIN_SUFFIX	".so"		/**< Suffix of plugins found under RootPath */
+
+typedef struct {
+    char     status[64];                /*< Status code and reason ("200 OK" unless changed) */
+    FILE    *headers;                   /*< Header lines ("Name: value\r\n" each) */
+    FILE    *body;                      /*< Body (Content-Length is added by the server) */
+} Response;
+
+typedef struct {
+    int         version;                /*< PLUGIN_VERSION plugin was built against */
+    const char *name;                   /*< Name of plugin for logs */
+    bool      (*init)(void);            /*< Called once after loading (may be NULL) */
+    Status    (*handle)(const Request *request, const char *body, size_t length, Response *response);
+} Plugin;
+
+bool	    plugin_register(const char *spec);
+bool	    plugin_init(void);
+bool	    plugin_path(const char *path);
+const Plugin *plugin_route(const char *uri);
+const Plugin *plugin_find(const char *path);
+
+/* Shared Cache */
+
+#define CACHE_KEY	256		/**< Longest cached URI (with NUL) */
+#define CACHE_PATH	512		/**< Longest cached real path (with NUL) */
+#define CACHE_MIMETYPE	128		/**< Longest cached mimetype (with NUL) */
+#define CACHE_BODY	16384		/**< Largest file body kept in cache */
+
+typedef struct {
+    uint32_t sequence;                  /*< Seqlock sequence (odd while entry is written) */
+    uint32_t hash;                      /*< Hash of key (0 if slot is empty) */
+    uint32_t referenced;                /*< Clock bit (set by hits, cleared by eviction sweeps) */
+    Handler  handler;                   /*< Handler type of path */
+    uint64_t expires;                   /*< Monotonic milliseconds entry stays valid until */
+    int64_t  length;                    /*< Bytes of file body (-1 if not cached) */
+    uint64_t checked;                   /*< Monotonic milliseconds path was last compared */
+    uint64_t device;                    /*< Device of path */
+    uint64_t inode;                     /*< Inode of path */
+    uint32_t mode;                      /*< Mode of path */
+    int64_t  size;                      /*< Size of path */
+    int64_t  mtime;                     /*< Modification time of path in nanoseconds */
+    int64_t  ctime;                     /*< Status change time of path in nanoseconds */
+    char     key[CACHE_KEY];            /*< Request URI */
+    char     path[CACHE_PATH];          /*< Real path of URI */
+    char     mimetype[CACHE_MIMETYPE];  /*< Mimetype of file (empty if not a file) */
+    char     body[CACHE_BODY];          /*< File contents (first length bytes) */
+} CacheEntry;
+
+void	    cache_init(void);
+bool	    cache_lookup(const char *uri, CacheEntry *entry);
+bool	    cache_store(CacheEntry *entry, const struct stat *s, bool warmed);
+
+/* Inline Response Store */
+
+void	    inline_init(void);
+const char *inline_lookup(const char *uri, size_t *length);
+bool	    inline_store(const CacheEntry *entry, const struct stat *s);
+Status      inline_serve(Request *request, const char *response, size_t length);
+
+/* Transmit Scheduler */
+
+void	    transmit_init(void);
+long	    transmit_begin(Request *request, size_t size);
+size_t	    transmit_grant(Request *request, long flow, size_t want);
+void	    transmit_end(long flow);
+
+/* HTTP/2 */
+
+Status      http2_serve(Request *request, bool upgrade);
+
+/* Site Pack (see bin/pack.py) */
+
+#define PACK_MAGIC	"SPDYPACK"
+#define PACK_VERSION	2
+
+/**
+ * Site pack response variants
+ */
+typedef enum {
+    PACK_IDENTITY = 0,                  /**< Uncompressed body */
+    PACK_GZIP,                          /**< Content-Encoding: gzip */
+    PACK_NVARIANTS
+} PackEncoding;
+
+typedef struct {
+    char     magic[8];                  /*< PACK_MAGIC */
+    uint32_t version;                   /*< PACK_VERSION */
+    uint32_t nentries;                  /*< Number of entries */
+    uint32_t nbuckets;                  /*< Number of displacement buckets */
+    uint32_t nslots;                    /*< Number of entry slots */
+    uint64_t size;                      /*< Size of pack file */
+} PackHeader;
+
+typedef struct {
+    uint64_t offset;                    /*< Offset of response headers (body follows) */
+    uint32_t head;                      /*< Length of response headers (0 if absent) */
+    uint32_t reserved;
+    uint64_t length;                    /*< Length of body */
+} PackVariant;
+
+typedef struct {
+    uint64_t    uri;                    /*< Offset of URI */
+    uint32_t    urilen;                 /*< Length of URI */
+    uint32_t    reserved;
+    PackVariant variants[PACK_NVARIANTS];/*< Responses by PackEncoding */
+} PackEntry;
+
+bool	    pack_open(const char *path);
+const PackEntry *pack_lookup(const char *uri, size_t length);
+Status      pack_serve(Request *request, const PackEntry *entry);
+
+/* Request Capture (see bin/replay.py) */
+
+#define CAPTURE_MAGIC	"SPDYCAPT"
+#define CAPTURE_VERSION	1
+
+typedef struct {
+    char     magic[8];                  /*< CAPTURE_MAGIC */
+    uint32_t version;                   /*< CAPTURE_VERSION */
+    uint32_t reserved;
+    uint64_t started;                   /*< Monotonic nanoseconds capture started */
+} CaptureHeader;
+
+typedef struct {
+    uint64_t offset;                    /*< Nanoseconds since capture started */
+    uint32_t pid;                       /*< Process that read the request */
+    uint32_t served;                    /*< Earlier requests on same connection */
+    uint32_t length;                    /*< Length of request head that follows */
+} __attribute__((packed)) CaptureRecord;
+
+void	    capture_init(void);
+void	    capture_request(Request *request, const char *head, size_t length);
+
+/* Startup Cache Warming */
+
+void	    warm_start(const char *path);
+
+/* TLS (see bin/mkcert.sh) */
+
+bool	    tls_init(const char *path);
+int	    tls_accept(Request *request);
+ssize_t	    tls_recv(Request *request, void *data, size_t size);
+bool	    tls_pending(Request *request);
+void	    tls_close(Request *request);
 
 /* HTTP Server */
 
-int         single_server(int sfd);
-int         forking_server(int sfd);
+int         single_server(const int *sfds, size_t nsfds);
+int         forking_server(const int *sfds, size_t nsfds);
+int         sharded_server(const int *sfds, size_t nsfds);
+bool        forking_admit(Handler handler);
+void        forking_release(void);
+
+/* Hot Restart */
+
+#define RESTART_GRACE	1000		/**< Milliseconds a draining server waits on idle connections */
+
+void	    restart_init(char *argv[]);
+void	    restart_inherit(void);
+int	    restart_listener(const char *address);
+bool	    restart_ready(void);
+bool	    restart_check(const int *listeners, size_t nlisteners, long msecs);
+int	    restart_fd(void);
+bool	    restart_draining(void);
 
 /* Socket */
 
-int	    socket_listen(const char *port);
+#define SOCKET_ADDRESSES	8		/**< Maximum listen addresses */
+#define SOCKET_UNIX	"unix:"		/**< Prefix of Unix domain socket addresses */
+
+int	    socket_listen(const char *address);
+bool	    socket_unix(const char *address);
 
 /* Utilities */
 
@@ -0,0 +1,85 @@
+/* env.c: Sample Handler Plugin (in-process www/scripts/env.sh) */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <string.h>
+
+/* Internal Declarations */
+static Status env_handle(const Request *request, const char *body, size_t length, Response *response);
+static void env_variable(Response *response, const char *name, const char *value);
+static void env_header(Response *response, const char *name, const char *value);
+
+/* Plugin */
+const Plugin spidey_plugin = {
+    .version = PLUGIN_VERSION,
+    .name    = "env",
+    .handle  = env_handle,
+};
+
+/**
+ * List the CGI environment env.sh would see for request.
+ *
+ * @param   request     Request structure (read-only).
+ * @param   body        Request body (NULL if none).
+ * @param   length      Length of request body.
+ * @param   response    Response to write.
+ * @return  HTTP_STATUS_OK.
+ *
+ * Only the variables the server exports to CGI scripts are listed, since a
+ * plugin shares the server's own environment.
+ **/
+static Status env_handle(const Request *request, const char *body, size_t length, Response *response) {
+    char buffer[32];
+
+    fprintf(response->headers, "Content-Type: text/plain\r\n");
+
+    if (length > 0) {
+        snprintf(buffer, sizeof(buffer), "%zu", length);
+        env_variable(response, "CONTENT_LENGTH", buffer);
+    }
+    env_variable(response, "CONTENT_TYPE", request->known[HEADER_CONTENT_TYPE]);
+    env_variable(response, "DOCUMENT_ROOT", RootPath);
+
+    for (HeaderId id = 0; id < HEADER_NKNOWN; id++) {
+        env_header(response, header_name(id), request->known[id]);
+    }
+    for (size_t i = 0; i < request->nheaders; i++) {
+        env_header(response, request->headers[i].name, request->headers[i].data);
+    }
+
+    env_variable(response, "QUERY_STRING", request->query);
+    env_variable(response, "REMOTE_ADDR", request->host);
+    env_variable(response, "REMOTE_PORT", request->port);
+    env_variable(response, "REQUEST_METHOD", request->method);
+    env_variable(response, "REQUEST_URI", request->uri);
+    env_variable(response, "SCRIPT_FILENAME", request->path);
+    env_variable(response, "SERVER_PORT", Port);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Write variable as NAME=value (skipped if value is NULL).
+ **/
+static void env_variable(Response *response, const char *name, const char *value) {
+    if (value) {
+        fprintf(response->body, "%s=%s\n", name, value);
+    }
+}
+
+/**
+ * Write header as HTTP_NAME=value, named the way setenv_header names it.
+ **/
+static void env_header(Response *response, const char *name, const char *value) {
+    if (!value) {
+        return;
+    }
+
+    fputs("HTTP_", response->body);
+    for (const char *c = name; *c; c++) {
+        fputc(*c == '-' ? '_' : toupper((unsigned char)*c), response->body);
+    }
+    fprintf(response->body, "=%s\n", value);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,230 @@
+/* cache.c: Shared Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+#define CACHE_BASIS	2166136261u     /* FNV-1a offset basis */
+#define CACHE_PROBES	8               /* Slots examined per lookup */
+#define CACHE_UNUSED	UINT64_MAX      /* Expiry of warmed entry until its first hit */
+#define CACHE_RECHECK	1000            /* Milliseconds a checked entry is trusted without stat */
+
+/* Global Variables */
+static CacheEntry *Cache     = NULL;    /* Shared slots (NULL if disabled) */
+static size_t      CacheMask = 0;       /* Number of slots - 1 */
+
+/* Internal Declarations */
+static bool cache_check(CacheEntry *slot, uint32_t sequence, const CacheEntry *entry, uint64_t now);
+
+/**
+ * Hash URI with 32-bit FNV-1a (never 0, which marks an empty slot).
+ **/
+static inline uint32_t cache_hash(const char *s) {
+    uint32_t hash = CACHE_BASIS;
+    for (; *s; s++) {
+        hash = (hash ^ (unsigned char)*s) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * Map shared cache.
+ *
+ * The cache is an anonymous shared mapping of CacheEntries slots (rounded up
+ * to a power of two), created before any process forks so that every child
+ * and shard reads and fills the same table.  Slots are only backed by memory
+ * once they are used.
+ **/
+void cache_init(void) {
+    if (CacheEntries <= 0) {
+        return;
+    }
+
+    size_t nslots = 1;
+    while (nslots < (size_t)CacheEntries) {
+        nslots <<= 1;
+    }
+
+    Cache = mmap(NULL, nslots * sizeof(CacheEntry), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (Cache == MAP_FAILED) {
+        log("Unable to mmap cache: %s", strerror(errno));
+        Cache = NULL;
+        return;
+    }
+
+    CacheMask = nslots - 1;
+    debug("CacheEntries    = %zu (%zu bytes, valid %ld s)", nslots, nslots * sizeof(CacheEntry), CacheTTL);
+}
+
+/**
+ * Look up valid entry of URI.
+ *
+ * @param   uri         Request URI.
+ * @param   entry       Entry to copy the cached entry into.
+ * @return  Whether or not a valid entry was found.
+ *
+ * Slots are read without locking: the entry is copied between two reads of
+ * the slot's sequence, and the copy is discarded if a writer held or took the
+ * slot in between (an odd or changed sequence).  A hit sets the slot's clock
+ * bit so the next eviction sweep passes it over, and the first hit of a
+ * warmed entry starts its CacheTTL.
+ *
+ * An entry checked within the last CACHE_RECHECK milliseconds is trusted;
+ * otherwise its path is stat'd once, and if the file was removed or replaced,
+ * or its size, mode, mtime or ctime changed, the entry is dropped (see
+ * cache_check) so a stale body or handler is never served.
+ **/
+bool cache_lookup(const char *uri, CacheEntry *entry) {
+    if (!Cache) {
+        return false;
+    }
+
+    uint32_t hash = cache_hash(uri);
+    uint64_t now  = timer_now();
+    for (size_t i = 0; i < CACHE_PROBES; i++) {
+        CacheEntry *slot     = &Cache[(hash + i) & CacheMask];
+        uint32_t    sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if ((sequence & 1) || __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash) {
+            continue;
+        }
+
+        memcpy(entry, slot, offsetof(CacheEntry, body));
+        if (entry->length > 0 && entry->length <= CACHE_BODY) {
+            memcpy(entry->body, slot->body, entry->length);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) {
+            continue;
+        }
+
+        if (strncmp(entry->key, uri, CACHE_KEY) == 0 && entry->expires > now &&
+            (now - entry->checked < CACHE_RECHECK || cache_check(slot, sequence, entry, now))) {
+            if (entry->expires == CACHE_UNUSED) {
+                uint64_t unused = CACHE_UNUSED;
+                __atomic_compare_exchange_n(&slot->expires, &unused, now + CacheTTL * 1000, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            }
+            __atomic_store_n(&slot->referenced, 1, __ATOMIC_RELAXED);
+            stats_add(cache_hits, 1);
+            return true;
+        }
+    }
+
+    stats_add(cache_misses, 1);
+    return false;
+}
+
+/**
+ * Store entry (key, path, handler, and for files mimetype and body).
+ *
+ * @param   entry       Entry to store (hash, expiry and clock bit are set here).
+ * @param   s           Status of path taken before the entry was built.
+ * @param   warmed      Whether the entry was warmed at startup, so its CacheTTL
+ * only starts with its first hit, which always compares it with its path
+ * first (see cache_lookup).
+ * @return  Whether or not the entry was stored.
+ *
+ * The entry replaces an older entry of the same key, or else takes a free or
+ * expired slot within the probe window.  When all are in use, a clock sweep
+ * over the window clears the bits of recently hit entries and evicts the
+ * first entry without one.  Writers take the slot by making its sequence odd;
+ * if another process already holds it, the store is skipped, since the cache
+ * is only an optimization.
+ **/
+bool cache_store(CacheEntry *entry, const struct stat *s, bool warmed) {
+    if (!Cache || strlen(entry->key) >= CACHE_KEY - 1 || strlen(entry->path) >= CACHE_PATH - 1) {
+        return false;
+    }
+
+    entry->hash       = cache_hash(entry->key);
+    entry->expires    = warmed ? CACHE_UNUSED : timer_now() + CacheTTL * 1000;
+    entry->referenced = 0;
+    entry->checked    = warmed ? 0 : timer_now();
+    entry->device     = s->st_dev;
+    entry->inode      = s->st_ino;
+    entry->mode       = s->st_mode;
+    entry->size       = s->st_size;
+    entry->mtime      = s->st_mtim.tv_sec * 1000000000LL + s->st_mtim.tv_nsec;
+    entry->ctime      = s->st_ctim.tv_sec * 1000000000LL + s->st_ctim.tv_nsec;
+
+    /* Prefer the key's own slot, then a free or expired slot */
+    uint64_t    now    = timer_now();
+    CacheEntry *victim = NULL;
+    for (size_t i = 0; i < CACHE_PROBES; i++) {
+        CacheEntry *slot = &Cache[(entry->hash + i) & CacheMask];
+        uint32_t    hash = __atomic_load_n(&slot->hash, __ATOMIC_RELAXED);
+        if (hash == entry->hash && strncmp(slot->key, entry->key, CACHE_KEY) == 0) {
+            victim = slot;
+            break;
+        }
+        if (!victim && (hash == 0 || slot->expires <= now)) {
+            victim = slot;
+        }
+    }
+
+    /* Otherwise evict with a clock sweep over the window */
+    if (!victim) {
+        for (size_t i = 0; i < CACHE_PROBES && !victim; i++) {
+            CacheEntry *slot = &Cache[(entry->hash + i) & CacheMask];
+            if (!__atomic_exchange_n(&slot->referenced, 0, __ATOMIC_RELAXED)) {
+                victim = slot;
+            }
+        }
+        if (!victim) {
+            victim = &Cache[entry->hash & CacheMask];
+        }
+        stats_add(cache_evictions, 1);
+    }
+
+    /* Write slot under its seqlock */
+    uint32_t sequence = __atomic_load_n(&victim->sequence, __ATOMIC_RELAXED);
+    if ((sequence & 1) || !__atomic_compare_exchange_n(&victim->sequence, &sequence, sequence + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    size_t length = offsetof(CacheEntry, body) + (entry->length > 0 ? entry->length : 0);
+    memcpy((char *)victim + sizeof(victim->sequence), (char *)entry + sizeof(entry->sequence), length - sizeof(entry->sequence));
+    __atomic_store_n(&victim->sequence, sequence + 2, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Compare copied entry with its path, dropping it if the path changed.
+ *
+ * @param   slot        Slot the entry was copied from.
+ * @param   sequence    Sequence of slot when it was copied.
+ * @param   entry       Copy of entry.
+ * @param   now         Current monotonic milliseconds.
+ * @return  Whether or not the copy is current.
+ *
+ * Comparing the mode and ctime catches a chmod, so a file made executable is
+ * run as a CGI script instead of having its source served from the cache.
+ **/
+static bool cache_check(CacheEntry *slot, uint32_t sequence, const CacheEntry *entry, uint64_t now) {
+    struct stat s;
+    if (stat(entry->path, &s) == 0 && (uint64_t)s.st_dev == entry->device && (uint64_t)s.st_ino == entry->inode &&
+        s.st_mode == entry->mode && s.st_size == entry->size &&
+        s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec == entry->mtime &&
+        s.st_ctim.tv_sec * 1000000000LL + s.st_ctim.tv_nsec == entry->ctime) {
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence) {
+            __atomic_store_n(&slot->checked, now, __ATOMIC_RELAXED);
+        }
+        return true;
+    }
+
+    /* Empty slot under its seqlock (skipped if another process holds it) */
+    debug("Dropped stale cache entry of %s", entry->key);
+    if (__atomic_compare_exchange_n(&slot->sequence, &sequence, sequence + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&slot->hash, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+    }
+    return false;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,78 @@
+/* capture.c: Request Capture */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/uio.h>
+
+/* Global Variables */
+static int      CaptureFd      = -1;    /* Capture log (O_APPEND, shared by all processes) */
+static uint64_t CaptureStarted = 0;     /* Monotonic nanoseconds capture started */
+
+/**
+ * Return monotonic time in nanoseconds.
+ **/
+static uint64_t capture_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Open request capture log.
+ *
+ * The log is a CaptureHeader followed by one CaptureRecord and raw request
+ * head per request, in arrival order.  Every process appends whole records
+ * with a single writev, so no coordination is needed.
+ **/
+void capture_init(void) {
+    if (!CapturePath) {
+        return;
+    }
+
+    CaptureHeader header = {.magic = CAPTURE_MAGIC, .version = CAPTURE_VERSION};
+    header.started = CaptureStarted = capture_now();
+
+    CaptureFd = open(CapturePath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (CaptureFd < 0 || write(CaptureFd, &header, sizeof(header)) != sizeof(header)) {
+        fatal("Unable to open capture %s: %s", CapturePath, strerror(errno));
+    }
+    debug("CapturePath     = %s", CapturePath);
+}
+
+/**
+ * Append request head to capture log.
+ *
+ * @param   r           Request structure.
+ * @param   head        Raw request head (request line through blank line).
+ * @param   length      Length of request head.
+ *
+ * The process id and number of earlier requests on the connection let a
+ * replay reuse connections the way the client did.
+ **/
+void capture_request(Request *r, const char *head, size_t length) {
+    if (CaptureFd < 0) {
+        return;
+    }
+
+    CaptureRecord record = {
+        .offset = capture_now() - CaptureStarted,
+        .pid    = getpid(),
+        .served = r->served,
+        .length = length,
+    };
+    struct iovec iov[] = {
+        {.iov_base = &record, .iov_len = sizeof(record)},
+        {.iov_base = (void *)head, .iov_len = length},
+    };
+
+    if (writev(CaptureFd, iov, 2) < 0) {
+        debug("Unable to write capture: %s", strerror(errno));
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
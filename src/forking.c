@@ -1,49 +1,334 @@
 /* forking.c: Forking HTTP Server */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
+#include <poll.h>
 #include <signal.h>
 #include <string.h>
 
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Internal Declarations */
+static void forking_reap(void);
+static void forking_dispatch(void);
+static void forking_shed(Request *request);
+static void forking_detach(void);
+
+/* Admission State */
+static pid_t    *ChildPids     = NULL;  /* Pid occupying each child slot (parent only) */
+static int      *ChildHandlers = NULL;  /* Handler + 1 of each child slot (shared, 0 if unknown) */
+static long      ChildSlot     = -1;    /* Slot of this process (children only) */
+static long      ActiveChildren = 0;    /* Number of occupied child slots */
+
+static Request **Pending       = NULL;  /* Ring of connections waiting for a slot */
+static long      PendingSize   = 0;
+static long      PendingHead   = 0;
+static long      PendingCount  = 0;
+
+static const int *Listeners    = NULL;  /* Listening sockets (parent only) */
+static size_t     NListeners   = 0;
+
+/**
+ * Terminate child whose request exceeded RequestTimeout.
+ *
+ * Socket I/O is already bounded by the request deadline, so this only fires
+ * when the child is stuck elsewhere (e.g. waiting on a CGI script).
+ **/
+static void forking_expire(int signum) {
+    stats_add(timeouts[TIMEOUT_REQUEST], 1);
+    _exit(EXIT_FAILURE);
+}
+
+/**
+ * Interrupt ppoll when a child exits so it can be reaped.
+ **/
+static void forking_sigchld(int signum) {
+}
+
 /**
  * Fork incoming HTTP requests to handle the concurrently.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   sfds        Server socket file descriptors.
+ * @param   nsfds       Number of server sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
  *
  * The parent should accept a request and then fork off and let the child
- * handle the request.
+ * handle the request.  Every listener that is ready is accepted from in turn,
+ * so TCP and Unix domain clients share the same children and queue.
+ *
+ * At most MaxChildren children run at once.  Connections accepted while all
+ * slots are busy wait in a queue of MaxPending entries, and once that is full
+ * (or a queued connection exceeds its deadlines) the parent answers 503
+ * Service Unavailable itself without forking.
+ *
+ * Once a hot restart hands the listeners to a new server (see restart_check),
+ * the parent closes them, asks its children to finish their connections
+ * (see request_wait), and returns when the last one exits.
  **/
-int forking_server(int sfd) {
+int forking_server(const int *sfds, size_t nsfds) {
+    sigset_t      mask, origmask;
+    struct pollfd pfds[SOCKET_ADDRESSES + 1];
+
+    Listeners  = sfds;
+    NListeners = nsfds;
+
+    /* Allocate child slots and pending queue */
+    ChildPids     = calloc(MaxChildren, sizeof(pid_t));
+    ChildHandlers = mmap(NULL, MaxChildren * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    PendingSize   = MaxPending + 1;
+    Pending       = calloc(PendingSize, sizeof(Request *));
+    if (!ChildPids || ChildHandlers == MAP_FAILED || !Pending) {
+        fatal("Unable to allocate admission state: %s", strerror(errno));
+    }
+
+    /* Reap children from the loop; SIGCHLD is only delivered inside ppoll */
+    struct sigaction action = {.sa_handler = forking_sigchld};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &origmask);
+
+    for (size_t i = 0; i < nsfds; i++) {
+        pfds[i] = (struct pollfd){.fd = sfds[i], .events = POLLIN};
+    }
+
     /* Accept and handle HTTP request */
     while (true) {
-    	/* Accept request */
-        Request *request = accept_request(sfd);
-        if (!request) {
-            log("Unable to accept request %s", strerror(errno));
+        stats_check();
+        forking_reap();
+        timer_advance(&Timers);
+        forking_dispatch();
+
+        /* Once the new server accepts, stop listening and drain children */
+        if (NListeners && restart_check(sfds, nsfds, 0)) {
+            for (size_t i = 0; i < nsfds; i++) {
+                close(sfds[i]);
+            }
+            NListeners = 0;
+            for (long slot = 0; slot < MaxChildren; slot++) {
+                if (ChildPids[slot]) {
+                    kill(ChildPids[slot], SIGUSR2);
+                }
+            }
+        }
+        if (!NListeners && !ActiveChildren && !PendingCount) {
+            break;
+        }
+
+        /* Wait for a connection, child exit, queued deadline, or new server */
+        int msecs = PendingCount ? timer_timeout(&Timers) : -1;
+        struct timespec ts = {.tv_sec = msecs / 1000, .tv_nsec = (msecs % 1000) * 1000000L};
+        pfds[NListeners] = (struct pollfd){.fd = restart_fd(), .events = POLLIN};
+        if (ppoll(pfds, NListeners + 1, msecs < 0 ? NULL : &ts, &origmask) <= 0) {
+            continue;
+        }
+
+        for (size_t i = 0; i < NListeners; i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            /* Accept request (another shard may have taken a shared listener's) */
+            Request *request = accept_request(pfds[i].fd);
+            if (!request) {
+                if (errno != EINTR && errno != EAGAIN)
+                    log("Unable to accept request %s", strerror(errno));
+                continue;
+            }
+
+            /* Queue request for a child or shed it */
+            if (ActiveChildren >= MaxChildren && PendingCount >= MaxPending) {
+                forking_shed(request);
+                continue;
+            }
+
+            Pending[(PendingHead + PendingCount++) % PendingSize] = request;
+            if (ActiveChildren >= MaxChildren) {
+                stats_add(queued, 1);
+            }
+            forking_dispatch();
+        }
+    }
+
+    log("Drained connections; exiting");
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Determine if this process may run the specified handler type.
+ *
+ * @param   handler     Handler type the request will be dispatched to.
+ * @return  Whether or not the handler is under its concurrency limit.
+ *
+ * Children record their handler type in their shared slot and then count how
+ * many slots hold the same type.  The slot is cleared by forking_release once
+ * the request is answered, so an idle keep-alive connection does not count
+ * against any limit, and by the parent when it reaps the child, however the
+ * child exits.  Outside of a forked child there is nothing to limit.
+ **/
+bool forking_admit(Handler handler) {
+    if (ChildSlot < 0 || HandlerLimits[handler] <= 0) {
+        return true;
+    }
+
+    __atomic_store_n(&ChildHandlers[ChildSlot], handler + 1, __ATOMIC_SEQ_CST);
+
+    long active = 0;
+    for (long slot = 0; slot < MaxChildren; slot++) {
+        if (__atomic_load_n(&ChildHandlers[slot], __ATOMIC_SEQ_CST) == handler + 1) {
+            active++;
+        }
+    }
+
+    if (active > HandlerLimits[handler]) {
+        __atomic_store_n(&ChildHandlers[ChildSlot], 0, __ATOMIC_SEQ_CST);
+        stats_add(shed, 1);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Release handler recorded by forking_admit after a request is answered.
+ **/
+void forking_release(void) {
+    if (ChildSlot >= 0) {
+        __atomic_store_n(&ChildHandlers[ChildSlot], 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Reap exited children and release their slots.
+ **/
+static void forking_reap(void) {
+    pid_t pid;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (long slot = 0; slot < MaxChildren; slot++) {
+            if (ChildPids[slot] == pid) {
+                ChildPids[slot] = 0;
+                __atomic_store_n(&ChildHandlers[slot], 0, __ATOMIC_SEQ_CST);
+                ActiveChildren--;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Fork children for queued requests while slots are available.
+ **/
+static void forking_dispatch(void) {
+    while (PendingCount > 0 && ActiveChildren < MaxChildren) {
+        Request *request = Pending[PendingHead];
+        PendingHead = (PendingHead + 1) % PendingSize;
+        PendingCount--;
+
+        /* Shed requests whose deadlines passed while queued */
+        if (request->timeout != TIMEOUT_NONE) {
+            forking_shed(request);
             continue;
         }
 
-	/* Ignore children */
-        signal(SIGCHLD, SIG_IGN);
+        long slot = 0;
+        while (ChildPids[slot]) {
+            slot++;
+        }
 
 	/* Fork off child process to handle request */
         pid_t pid = fork();
         if(pid == 0) {
-            handle_request(request);
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigprocmask(SIG_SETMASK, &mask, NULL);
+            signal(SIGCHLD, SIG_DFL);
+
+            forking_detach();
+            ChildSlot = slot;
+            if (RequestTimeout > 0) {
+                signal(SIGALRM, forking_expire);
+            }
+
+            /* Handle requests until the connection stops being persistent */
+            Status status;
+            do {
+                if (RequestTimeout > 0) {
+                    alarm((RequestTimeout + 999) / 1000 + 1);
+                }
+                status = handle_request(request);
+                forking_release();
+            } while (status == HTTP_STATUS_OK && request->keepalive && request_reset(request) == 0);
             free_request(request);
             exit(EXIT_SUCCESS);
         }
+        else if (pid < 0) {
+            log("Unable to fork: %s", strerror(errno));
+            forking_shed(request);
+        }
         else {
+            ChildPids[slot] = pid;
+            ActiveChildren++;
+            trace_handoff(request);
             free_request(request);
         }
     }
+}
 
-    /* Close server socket */
-    return EXIT_SUCCESS;
+/**
+ * Drop the parent's listeners and queued connections in a new child.
+ *
+ * A child keeping another connection's socket open would hold it open after
+ * the child serving it closes it, so its client never sees the end of an
+ * unframed response, and would leak descriptors with the queue depth.
+ **/
+static void forking_detach(void) {
+    for (size_t i = 0; i < NListeners; i++) {
+        close(Listeners[i]);
+    }
+    NListeners = 0;
+
+    while (PendingCount > 0) {
+        free_request(Pending[PendingHead]);
+        PendingHead = (PendingHead + 1) % PendingSize;
+        PendingCount--;
+    }
+}
+
+/**
+ * Reject request with 503 Service Unavailable directly from the parent.
+ *
+ * @param   request     Request to reject (deallocated).
+ *
+ * The response is written with a single non-blocking send so a slow client
+ * can never stall the parent.  Any request bytes already received are drained
+ * first so closing the socket does not reset the connection before the
+ * client reads the response.  Secure connections are only closed, since the
+ * parent never negotiates TLS (Unix domain connections are always plain).
+ **/
+static void forking_shed(Request *request) {
+    char buffer[BUFSIZ];
+    int  length = snprintf(buffer, sizeof(buffer),
+        "HTTP/1.0 %s\r\nRetry-After: %ld\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+        http_status_string(HTTP_STATUS_SERVICE_UNAVAILABLE), RetryAfter);
+
+    if (!CertificatePath || request->local) {
+        while (recv(request->fd, buffer + length, sizeof(buffer) - length, MSG_DONTWAIT) > 0);
+        send(request->fd, buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        shutdown(request->fd, SHUT_WR);
+    }
+
+    stats_add(shed, 1);
+    log("Shed request from %s:%s", request->host, request->port);
+    free_request(request);
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
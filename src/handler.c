@@ -1,20 +1,62 @@
 /* handler.c: HTTP Request Handlers */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stdarg.h>
 #include <string.h>
 
 #include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+extern char **environ;
+
+/* Constants */
+
+#define BROWSE_BATCH	32768		/* Bytes of directory entries per getdents64 */
+#define BROWSE_SORTED	100000		/* Entries a sorted page may reach (offset + limit) */
+#define CGI_CHUNK	(4 * BUFSIZ)	/* Largest chunk of CGI output */
+
+/* Directory listing output, coalesced into chunks of up to BUFSIZ bytes */
+typedef struct {
+    Request *r;                         /* Request being answered */
+    bool     chunked;                   /* Whether body uses chunked encoding */
+    bool     failed;                    /* Whether writing to the client failed */
+    size_t   used;                      /* Number of bytes in data */
+    char     data[BUFSIZ];              /* Pending output */
+} Listing;
+
 /* Internal Declarations */
 Status handle_browse_request(Request *request);
-Status handle_file_request(Request *request);
+Status handle_file_request(Request *request, CacheEntry *entry, bool cached);
+Status handle_cached_file(Request *request, const CacheEntry *entry);
 Status handle_cgi_request(Request *request);
+Status handle_plugin_request(Request *request, const Plugin *plugin);
 Status handle_error(Request *request, Status status);
+void   setenv_header(const char *name, const char *data);
+pid_t  cgi_spawn(Request *r, int *in, int *out);
+void   cgi_wait(pid_t pid, bool terminate);
+char * cgi_header_end(char *data, size_t size);
+long   cgi_parse_headers(const char *head, const char *body, char *status, size_t size);
+void   cgi_write_headers(Request *r, const char *head, const char *body);
+bool   cgi_copy_body(Request *r, int pfd, char *buffer, size_t nbuffer, long length, bool chunked);
+long   browse_param(const char *query, const char *name, long fallback);
+int    browse_compare(const void *a, const void *b);
+bool   browse_heap_push(char ***heap, size_t *nheap, size_t *cap, size_t count, const char *name);
+void   listing_entry(Listing *l, const char *name);
+void   listing_printf(Listing *l, const char *format, ...);
+void   listing_flush(Listing *l);
 
 /**
  * Handle HTTP Request.
@@ -28,17 +70,160 @@ Status handle_error(Request *request, Status status);
  * On error, handle_error should be used with an appropriate HTTP status code.
  **/
 Status  handle_request(Request *r) {
-    Status result;
+    /* Negotiate TLS before the first request of a secure connection */
+    if (CertificatePath && !r->stream) {
+        trace_begin(r, handshake);
+        int negotiated = tls_accept(r);
+        trace_end(r, handshake);
+        if (negotiated < 0) {
+            r->keepalive = false;
+            return r->timeout != TIMEOUT_NONE ? HTTP_STATUS_REQUEST_TIMEOUT : HTTP_STATUS_BAD_REQUEST;
+        }
+    }
 
     /* Parse request: parse_request_method */
+    trace_begin(r, parse);
     int requestSuccess = parse_request(r);
+    trace_end(r, parse);
+    if (r->timeout == TIMEOUT_IDLE) {
+        debug("Idle connection");
+        return HTTP_STATUS_REQUEST_TIMEOUT;
+    }
+
+    request_phase(r, TIMEOUT_WRITE);
+    if (r->timeout != TIMEOUT_NONE) {
+        debug("Request timeout");
+        return handle_error(r, HTTP_STATUS_REQUEST_TIMEOUT);
+    }
+
+    if (requestSuccess == -1 && r->served && !r->buffered) {
+        debug("Persistent connection closed by client");
+        r->keepalive = false;
+        return HTTP_STATUS_OK;
+    }
+
     if (requestSuccess == -1 || !r->method || !r->uri) {
         debug("Bad request 1");
         return handle_error(r, HTTP_STATUS_BAD_REQUEST);
     }
 
+    /* Switch to HTTP/2 on connection preface or h2c upgrade (requests with
+     * a body are answered over HTTP/1.1 instead) */
+    const char *upgrade = request_header(r, HEADER_UPGRADE);
+    if (streq(r->method, "PRI") && streq(r->uri, "*")) {
+        return http2_serve(r, false);
+    }
+    if (upgrade && strcasestr(upgrade, "h2c") && request_header(r, HEADER_HTTP2_SETTINGS) && !r->chunked && !r->remaining) {
+        return http2_serve(r, true);
+    }
+
+    /* Keep connection alive if the client wants to (HTTP/1.1 by default) */
+    const char *connection = request_header(r, HEADER_CONNECTION);
+    if (r->version >= 11) {
+        r->keepalive = !(connection && strcasestr(connection, "close"));
+    } else {
+        r->keepalive = connection && strcasestr(connection, "keep-alive");
+    }
+    if (r->served + 1 >= KeepAliveRequests || restart_draining()) {
+        r->keepalive = false;
+    }
+
+    return dispatch_request(r);
+}
+
+/**
+ * Dispatch parsed HTTP Request.
+ *
+ * @param   r           HTTP Request structure (method and uri set).
+ * @return  Status of the HTTP request.
+ *
+ * This determines the request path and type, and then dispatches to the
+ * appropriate handler type.  HTTP/2 streams enter here directly, and URIs
+ * under a prefix registered with -L go straight to their plugin.
+ *
+ * Successfully handled URIs are remembered in the shared cache, so later
+ * requests in any process skip realpath and stat (and small files are served
+ * from the cache itself) until the entry expires after CacheTTL seconds.  The
+ * path is still stat'd at most once a second, and entries whose file changed
+ * are dropped (see cache_lookup).
+ * Files of up to InlineLimit bytes are answered before that with their
+ * stored complete response, which stays valid until the file changes.
+ **/
+Status  dispatch_request(Request *r) {
+    Status result;
+
+    /* Route registered URI prefixes straight to their plugins */
+    const Plugin *plugin = plugin_route(r->uri);
+    if (plugin) {
+        if (!forking_admit(HANDLER_PLUGIN)) {
+            debug("Handler %d over limit", HANDLER_PLUGIN);
+            return handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        }
+
+        trace_begin(r, handle);
+        result = handle_plugin_request(r, plugin);
+        trace_end(r, handle);
+        if (result != HTTP_STATUS_OK)
+            return handle_error(r, result);
+
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
+        stats_add(handled, 1);
+        return result;
+    }
+
+    /* Answer from site pack without touching the filesystem */
+    trace_begin(r, pack_lookup);
+    const PackEntry *entry = pack_lookup(r->uri, strlen(r->uri));
+    trace_end(r, pack_lookup);
+    if (entry) {
+        if (!forking_admit(HANDLER_FILE)) {
+            debug("Handler %d over limit", HANDLER_FILE);
+            return handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        }
+
+        trace_begin(r, pack_serve);
+        result = pack_serve(r, entry);
+        trace_end(r, pack_serve);
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
+        stats_add(handled, 1);
+        return result;
+    }
+
+    /* Answer small files with their stored complete response */
+    size_t length;
+    trace_begin(r, inline_lookup);
+    const char *response = inline_lookup(r->uri, &length);
+    trace_end(r, inline_lookup);
+    if (response) {
+        if (!forking_admit(HANDLER_FILE)) {
+            debug("Handler %d over limit", HANDLER_FILE);
+            return handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        }
+
+        trace_begin(r, inline_serve);
+        result = inline_serve(r, response, length);
+        trace_end(r, inline_serve);
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
+        stats_add(handled, 1);
+        return result;
+    }
+
+    /* Look up path, handler type, mimetype and small body in shared cache */
+    CacheEntry cache;
+    Handler    handler;
+    trace_begin(r, cache_lookup);
+    bool cached = cache_lookup(r->uri, &cache);
+    trace_end(r, cache_lookup);
+    if (cached) {
+        r->path = strdup(cache.path);
+        handler = cache.handler;
+        goto dispatch;
+    }
+
     /* Determine request path */
+    trace_begin(r, realpath);
     r->path = determine_request_path(r->uri);
+    trace_end(r, realpath);
     if (!r->path) {
         debug("Bad request 2");
         return handle_error(r, HTTP_STATUS_BAD_REQUEST);
@@ -46,18 +231,24 @@ Status  handle_request(Request *r) {
     
     debug("HTTP REQUEST PATH: %s", r->path);
 
-    /* Dispatch to appropriate request handler type based on file type */
+    /* Determine request handler type based on file type */
     struct stat s;
-    if (stat(r->path, &s) == 0){
+    trace_begin(r, stat);
+    int found = stat(r->path, &s) == 0;
+    trace_end(r, stat);
+    if (found){
         if (S_ISDIR(s.st_mode))
-            result = handle_browse_request(r);
+            handler = HANDLER_BROWSE;
 
         else if(S_ISREG(s.st_mode) && access(r->path, R_OK) == 0){
             if (access(r->path, X_OK) == 0)
-                result = handle_cgi_request(r);
+                handler = plugin_path(r->path) ? HANDLER_PLUGIN : HANDLER_CGI;
             else
-                result = handle_file_request(r);
+                handler = HANDLER_FILE;
         }
+
+        else
+            return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
 
     // Checking for stat failure
@@ -66,12 +257,41 @@ Status  handle_request(Request *r) {
         return handle_error(r, result);
     }
 
+    /* Start cache entry (the file handler adds mimetype and body) */
+    snprintf(cache.key, sizeof(cache.key), "%s", r->uri);
+    snprintf(cache.path, sizeof(cache.path), "%s", r->path);
+    cache.handler     = handler;
+    cache.length      = -1;
+    cache.mimetype[0] = '\0';
+
+    /* Enforce per-handler concurrency limit */
+dispatch:
+    if (!forking_admit(handler)) {
+        debug("Handler %d over limit", handler);
+        return handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+    }
+
+    /* Dispatch to appropriate request handler */
+    trace_begin(r, handle);
+    switch (handler) {
+        case HANDLER_BROWSE: result = handle_browse_request(r); break;
+        case HANDLER_CGI:    result = handle_cgi_request(r); break;
+        case HANDLER_PLUGIN: result = handle_plugin_request(r, plugin_find(r->path)); break;
+        default:             result = handle_file_request(r, &cache, cached); break;
+    }
+    trace_end(r, handle);
+
     // If something goes wrong
     if (result != HTTP_STATUS_OK)
         return handle_error(r, result);
 
+    if (!cached) {
+        cache_store(&cache, &s, false);
+    }
+
 
     log("HTTP REQUEST STATUS: %s", http_status_string(result));
+    stats_add(handled, 1);
 
     // Freeing everything
     return result;
@@ -85,101 +305,423 @@ Status  handle_request(Request *r) {
  *
  * This lists the contents of a directory in HTML.
  *
+ * Entries are read with getdents64 in fixed size batches and written as they
+ * are produced (with chunked encoding for HTTP/1.1 clients), so memory stays
+ * bounded no matter how large the directory is.  The query string selects a
+ * page:
+ *
+ *  offset=N    Skip the first N entries.
+ *  limit=N     List at most N entries (capped at BrowsePageSize).
+ *  sort=none   List entries in directory order, streaming immediately.
+ *
+ * Sorted listings keep only the first offset + limit names in a heap, so
+ * sorted pages reaching beyond BROWSE_SORTED entries are refused with
+ * HTTP_STATUS_BAD_REQUEST, which keeps the heap bounded however large offset
+ * is.  A "Next" link in the same order is emitted when entries remain; past
+ * the last sorted page it links to the listing in directory order instead.
+ *
  * If the path cannot be opened or scanned as a directory, then handle error
- * with HTTP_STATUS_NOT_FOUND.
+ * with HTTP_STATUS_INTERNAL_SERVER_ERROR.
  **/
 Status  handle_browse_request(Request *r) {
     debug("Handling Directory Request");
-    struct dirent **entries;
-    int n;
+    char   batch[BROWSE_BATCH];
+    char **heap   = NULL;
+    size_t nheap  = 0;
+    size_t cap    = 0;
+    long   index  = 0;
+    bool   more   = false;
+
+    /* Determine page */
+    long offset = browse_param(r->query, "offset", 0);
+    long limit  = browse_param(r->query, "limit", BrowsePageSize);
+    bool sorted = !strstr(r->query, "sort=none");
+    if (limit <= 0 || limit > BrowsePageSize)
+        limit = BrowsePageSize;
+    if (offset < 0)
+        offset = 0;
+    if (offset > LONG_MAX - limit)
+        offset = LONG_MAX - limit;
+    if (sorted && offset + limit > BROWSE_SORTED)
+        return handle_error(r, HTTP_STATUS_BAD_REQUEST);
 
-    /* Open a directory for reading or scanning */
-    n = scandir(r->path, &entries, 0, alphasort);
-    if(n < 0) {
-        debug("Scandir Failed: %s", strerror(errno));
+    /* Open directory for reading */
+    int fd = open(r->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        debug("Open directory failed: %s", strerror(errno));
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
 
     /* Write HTTP Header with OK Status and text/html Content-Type */
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
+    Listing l = {.r = r, .chunked = r->fd >= 0 && r->version >= 11};
+    handle_status(r, "200 OK", l.chunked);
     fprintf(r->stream, "Content-Type: text/html\r\n");
+    if (l.chunked) {
+        fprintf(r->stream, "Transfer-Encoding: chunked\r\n");
+    }
     fprintf(r->stream, "\r\n");
 
     /* For each entry in directory, emit HTML list item */
-    fprintf(r->stream, "<ul>\n");
-    for(int i = 0; i < n; i++) {
-        if (streq(entries[i]->d_name, ".")) {
-            free(entries[i]);
-            continue;
+    listing_printf(&l, "<ul>\n");
+    while (!more && !l.failed) {
+        ssize_t nread = getdents64(fd, batch, sizeof(batch));
+        if (nread <= 0) {
+            if (nread < 0)
+                debug("getdents64 failed: %s", strerror(errno));
+            break;
         }
-        
-        fprintf(r->stream, "<html>\n<head></head>\n<body>\n<li>\n");
-        if(streq(r->uri, "/")) {
-            fprintf(r->stream, "<a href=\"/%s\">", entries[i]->d_name);
+
+        for (ssize_t position = 0; position < nread; ) {
+            struct dirent64 *entry = (struct dirent64 *)(batch + position);
+            position += entry->d_reclen;
+            if (streq(entry->d_name, ".")) {
+                continue;
+            }
+
+            if (sorted) {
+                if (!browse_heap_push(&heap, &nheap, &cap, offset + limit, entry->d_name)) {
+                    l.failed = true;
+                    break;
+                }
+            } else if (index >= offset + limit) {
+                more = true;
+                break;
+            } else if (index >= offset) {
+                listing_entry(&l, entry->d_name);
+            }
+            index++;
         }
-        else {
-            fprintf(r->stream, "<a href=\"%s/%s\">", r->uri, entries[i]->d_name);
+
+        if (!sorted) {
+            listing_flush(&l);
+        }
+    }
+    close(fd);
+
+    /* Emit requested page of sorted entries */
+    if (sorted) {
+        qsort(heap, nheap, sizeof(char *), browse_compare);
+        for (size_t i = 0; i < nheap; i++) {
+            if ((long)i >= offset)
+                listing_entry(&l, heap[i]);
+            free(heap[i]);
         }
-        fprintf(r->stream, "%s", entries[i]->d_name);
-        fprintf(r->stream, "</a>\n");
-        fprintf(r->stream, "</li>\n");
-        free(entries[i]);
+        free(heap);
+        more = index > offset + limit;
     }
-    fprintf(r->stream, "</ul>\n</body>\n</html>");
 
-    free(entries);
+    if (more) {
+        long next = sorted && offset + 2 * limit > BROWSE_SORTED ? BROWSE_SORTED - offset - limit : limit;
+        if (next > 0) {
+            listing_printf(&l, "<a href=\"%s?offset=%ld&limit=%ld%s\">Next</a>\n",
+                r->uri, offset + limit, next, sorted ? "" : "&sort=none");
+        } else {
+            listing_printf(&l, "<a href=\"%s?sort=none\">All entries in directory order</a>\n", r->uri);
+        }
+    }
+    listing_printf(&l, "</ul>\n</body>\n</html>");
+    listing_flush(&l);
+    if (l.chunked && !l.failed) {
+        request_chunk(r, NULL, 0);
+    }
+    if (l.failed) {
+        r->keepalive = false;
+    }
 
     /* Return OK */
     return HTTP_STATUS_OK;
 }
 
+/**
+ * Return numeric query parameter (or fallback if missing or invalid).
+ **/
+long    browse_param(const char *query, const char *name, long fallback) {
+    size_t length = strlen(name);
+
+    for (const char *p = query; p && *p; p = strchr(p, '&'), p = p ? p + 1 : NULL) {
+        if (strncmp(p, name, length) == 0 && p[length] == '=') {
+            char *end;
+            long  value = strtol(p + length + 1, &end, 10);
+            return (end == p + length + 1 || (*end && *end != '&')) ? fallback : value;
+        }
+    }
+
+    return fallback;
+}
+
+/**
+ * Compare directory entry names the way alphasort does.
+ **/
+int     browse_compare(const void *a, const void *b) {
+    return strcoll(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * Keep name if it is among the smallest count names seen so far.
+ *
+ * @param   heap        Pointer to max-heap of names.
+ * @param   nheap       Pointer to number of names in heap.
+ * @param   cap         Pointer to allocated capacity of heap.
+ * @param   count       Number of names to keep.
+ * @param   name        Name of directory entry.
+ * @return  Whether or not the name could be recorded.
+ **/
+bool    browse_heap_push(char ***heap, size_t *nheap, size_t *cap, size_t count, const char *name) {
+    char **h = *heap;
+    size_t i;
+
+    if (*nheap < count) {
+        if (*nheap == *cap) {
+            size_t capacity = *cap ? 2 * *cap : 64;
+            if (!(h = realloc(h, capacity * sizeof(char *))))
+                return false;
+            *heap = h;
+            *cap  = capacity;
+        }
+
+        /* Sift new name up */
+        if (!(name = strdup(name)))
+            return false;
+        for (i = (*nheap)++; i > 0 && strcoll(h[(i - 1) / 2], name) < 0; i = (i - 1) / 2)
+            h[i] = h[(i - 1) / 2];
+        h[i] = (char *)name;
+        return true;
+    }
+
+    if (strcoll(name, h[0]) >= 0)
+        return true;
+
+    /* Replace largest name and sift it down */
+    char *replacement = strdup(name);
+    if (!replacement)
+        return false;
+    free(h[0]);
+    for (i = 0; 2 * i + 1 < *nheap; ) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < *nheap && strcoll(h[child + 1], h[child]) > 0)
+            child++;
+        if (strcoll(h[child], replacement) <= 0)
+            break;
+        h[i] = h[child];
+        i = child;
+    }
+    h[i] = replacement;
+    return true;
+}
+
+/**
+ * Emit HTML list item for directory entry.
+ **/
+void    listing_entry(Listing *l, const char *name) {
+    listing_printf(l, "<html>\n<head></head>\n<body>\n<li>\n");
+    if (streq(l->r->uri, "/")) {
+        listing_printf(l, "<a href=\"/%s\">", name);
+    } else {
+        listing_printf(l, "<a href=\"%s/%s\">", l->r->uri, name);
+    }
+    listing_printf(l, "%s</a>\n</li>\n", name);
+}
+
+/**
+ * Append formatted text to listing, flushing it as a chunk when full.
+ **/
+void    listing_printf(Listing *l, const char *format, ...) {
+    va_list args;
+    char   *text = NULL;
+    int     length;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        va_start(args, format);
+        length = vsnprintf(l->data + l->used, sizeof(l->data) - l->used, format, args);
+        va_end(args);
+        if (length < 0)
+            return;
+        if ((size_t)length < sizeof(l->data) - l->used) {
+            l->used += length;
+            return;
+        }
+        listing_flush(l);
+    }
+
+    /* Longer than the buffer: write it as its own chunk */
+    va_start(args, format);
+    length = vasprintf(&text, format, args);
+    va_end(args);
+    if (length > 0 && !l->failed) {
+        if (l->chunked)
+            request_chunk(l->r, text, length);
+        else
+            fwrite(text, 1, length, l->r->stream);
+    }
+    free(text);
+}
+
+/**
+ * Write buffered listing output to the client.
+ **/
+void    listing_flush(Listing *l) {
+    if (l->used && !l->failed) {
+        if (l->chunked)
+            request_chunk(l->r, l->data, l->used);
+        else
+            fwrite(l->data, 1, l->used, l->r->stream);
+
+        if (fflush(l->r->stream) != 0) {
+            request_timedout(l->r);
+            l->failed = true;
+        }
+    }
+    l->used = 0;
+}
+
 /**
  * Handle file request.
  *
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * This opens and streams the contents of the specified file to the socket,
+ * with sendfile when the socket takes bytes as they are (see
+ * request_zerocopy), so the file never passes through user space.  Files
+ * larger than SendQuantum go out in slices granted by the transmit scheduler.
+ * On an HTTP/2 stream, the open file is left in r->payload instead, and the
+ * connection sends it in DATA frames.
+ *
+ * The mimetype is recorded in the cache entry, and files of up to CACHE_BODY
+ * bytes are read whole into it, so once the entry is stored, later requests
+ * are answered from the shared cache without opening the file.  Files of up
+ * to InlineLimit bytes also have their complete response stored (see
+ * inline_store), which dispatch_request sends before consulting the cache.
  *
  * If the path cannot be opened for reading, then handle error with
  * HTTP_STATUS_NOT_FOUND.
  **/
-Status  handle_file_request(Request *r) {
+Status  handle_file_request(Request *r, CacheEntry *entry, bool cached) {
     debug("Handling File Request");
     FILE *fs = NULL;
     char buffer[BUFSIZ];
-    char *mimetype = NULL;
     size_t nread = 0;
 
+    /* Answer from shared cache */
+    if (cached && entry->length >= 0) {
+        return handle_cached_file(r, entry);
+    }
+
     /* Open file for reading */
+    trace_begin(r, open);
     fs = fopen(r->path, "r");
+    trace_end(r, open);
     if(!fs) {
-        fclose(fs);
         return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
     
-    /* Determine mimetype */
-    mimetype = determine_mimetype(r->path);
-    if(!mimetype) {
-        debug("no mimetype");
-    }
-        
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->stream, "Content-Type: %s\r\n", mimetype);
+    /* Determine mimetype (unless cached) */
+    if (!cached) {
+        trace_begin(r, mimetype);
+        char *mimetype = determine_mimetype(r->path);
+        trace_end(r, mimetype);
+        if(!mimetype) {
+            debug("no mimetype");
+        }
+        snprintf(entry->mimetype, sizeof(entry->mimetype), "%s", mimetype ? mimetype : DefaultMimeType);
+        free(mimetype);
+    }
+
+    /* Read small file whole into cache entry (and inline store) */
+    struct stat s;
+    bool framed = fstat(fileno(fs), &s) == 0;
+    if ((CacheEntries > 0 || InlineLimit > 0) && framed && s.st_size <= CACHE_BODY && fread(entry->body, 1, s.st_size, fs) == (size_t)s.st_size) {
+        entry->length = s.st_size;
+        fclose(fs);
+        inline_store(entry, &s);
+        return handle_cached_file(r, entry);
+    }
+    rewind(fs);
+
+    /* Write HTTP Headers with OK status, determined Content-Type and length */
+    handle_status(r, "200 OK", framed);
+    fprintf(r->stream, "Content-Type: %s\r\n", entry->mimetype);
+    if (framed)
+        fprintf(r->stream, "Content-Length: %lld\r\n", (long long)s.st_size);
     fprintf(r->stream, "\r\n");
 
+    /* HTTP/2 streams send the body from the file themselves (see h2_respond) */
+    if (framed && r->fd < 0) {
+        fflush(r->stream);
+        r->payload = fs;
+        return HTTP_STATUS_OK;
+    }
 
-    /* Read from file and write to socket in chunks */
-    nread = fread(buffer, 1, BUFSIZ, fs);
-    while(nread > 0) {
-        fwrite(buffer, 1, nread, r->stream);
-        nread = fread(buffer, 1, BUFSIZ, fs);
+    /* Send file from the page cache, or read from file and write to socket in
+     * chunks, in slices granted by the transmit scheduler */
+    trace_begin(r, send);
+    long   flow    = framed ? transmit_begin(r, s.st_size) : -1;
+    size_t allowed = 0;
+    if (framed && request_zerocopy(r) && fflush(r->stream) == 0) {
+        off_t offset = 0;
+        while (offset < s.st_size) {
+            if (!(allowed = transmit_grant(r, flow, s.st_size - offset))) {
+                r->keepalive = false;
+                break;
+            }
+            ssize_t nsent = sendfile(r->fd, fileno(fs), &offset, allowed);
+            if (nsent < 0 && errno == EINTR && !request_timedout(r)) {
+                continue;
+            }
+            if (nsent <= 0) {
+                if (nsent < 0) {
+                    request_timedout(r);
+                }
+                r->keepalive = false;
+                break;
+            }
+        }
+    } else {
+        off_t offset = 0;
+        while (!framed || offset < s.st_size) {
+            if (!allowed && !(allowed = transmit_grant(r, flow, framed ? s.st_size - offset : SIZE_MAX))) {
+                r->keepalive = false;
+                break;
+            }
+            nread = fread(buffer, 1, allowed < BUFSIZ ? allowed : BUFSIZ, fs);
+            if (nread == 0) {
+                break;
+            }
+            if (fwrite(buffer, 1, nread, r->stream) != nread && request_timedout(r)) {
+                r->keepalive = false;
+                break;
+            }
+            allowed -= nread;
+            offset  += nread;
+        }
     }
+    fflush(r->stream);
+    transmit_end(flow);
+    trace_end(r, send);
 
-    /* Close file, deallocate mimetype, return OK */
+    /* Close file, return OK */
     fclose(fs);
-    free(mimetype);
+
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Handle file request from cache entry.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   entry       Cache entry holding mimetype and whole file body.
+ * @return  Status of the HTTP file request.
+ **/
+Status  handle_cached_file(Request *r, const CacheEntry *entry) {
+    handle_status(r, "200 OK", true);
+    fprintf(r->stream, "Content-Type: %s\r\nContent-Length: %lld\r\n\r\n", entry->mimetype, (long long)entry->length);
+
+    trace_begin(r, send);
+    if (fwrite(entry->body, 1, entry->length, r->stream) != (size_t)entry->length && request_timedout(r)) {
+        r->keepalive = false;
+    }
+    fflush(r->stream);
+    trace_end(r, send);
 
     return HTTP_STATUS_OK;
 }
@@ -190,14 +732,14 @@ Status  handle_file_request(Request *r) {
  * @param   r           HTTP Request structure
  * @return  Status of the HTTP file request.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * This starts the specified executable, streams any request body into its
+ * stdin, and then streams its results to the socket.
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * If the script cannot be started, then handle error with
+ * HTTP_STATUS_INTERNAL_SERVER_ERROR.  A body over BodyLimit is refused with
+ * HTTP_STATUS_PAYLOAD_TOO_LARGE.
  **/
 Status  handle_cgi_request(Request *r) {
-    FILE *pfs;
     char buffer[BUFSIZ];
 
     /* Export CGI environment variables from request:
@@ -212,58 +754,494 @@ Status  handle_cgi_request(Request *r) {
     setenv("SERVER_PORT", Port, 1);
 
     /* Export CGI environment variables from request headers */
-    // host, accept, accept-language, accept-encoding, connection, user-agent
-    Header *temp = r->headers;
-    if (!temp)
+    // Clear headers of any previous request handled by this process
+    for (char **env = environ; *env; ) {
+        if (strncmp(*env, "HTTP_", 5) == 0) {
+            char name[BUFSIZ];
+            snprintf(name, sizeof(name), "%.*s", (int)strcspn(*env, "="), *env);
+            unsetenv(name);
+            env = environ;
+        } else {
+            env++;
+        }
+    }
+
+    // Only host, accept, accept-language, accept-encoding, connection and
+    // user-agent are exported (never Proxy, see httpoxy), looked up by id
+    static const HeaderId exported[] = {
+        HEADER_HOST, HEADER_ACCEPT, HEADER_ACCEPT_LANGUAGE,
+        HEADER_ACCEPT_ENCODING, HEADER_CONNECTION, HEADER_USER_AGENT,
+    };
+    bool headers = r->nheaders > 0;
+    for (HeaderId id = 0; id < HEADER_NKNOWN && !headers; id++) {
+        headers = r->known[id] != NULL;
+    }
+
+    for (size_t i = 0; i < sizeof(exported) / sizeof(exported[0]); i++) {
+        if (r->known[exported[i]]) {
+            setenv_header(header_name(exported[i]), r->known[exported[i]]);
+        }
+    }
+
+    if (!headers)
         return handle_error(r, HTTP_STATUS_BAD_REQUEST);
 
-    // Iterates through headers, setenv'ing when necessary
-    while(temp) {
-        if(streq(temp->name, "Host")) {
-            setenv("HTTP_HOST", temp->data, 1);
+    /* Export request body metadata (a chunked body has no length up front,
+     * so the script reads stdin until EOF) */
+    if (r->remaining > (size_t)BodyLimit)
+        return handle_error(r, HTTP_STATUS_PAYLOAD_TOO_LARGE);
+
+    if (!r->chunked && request_header(r, HEADER_CONTENT_LENGTH)) {
+        char length[32];
+        snprintf(length, sizeof(length), "%zu", r->remaining);
+        setenv("CONTENT_LENGTH", length, 1);
+    } else {
+        unsetenv("CONTENT_LENGTH");
+    }
+
+    const char *type = request_header(r, HEADER_CONTENT_TYPE);
+    if (type)
+        setenv("CONTENT_TYPE", type, 1);
+    else
+        unsetenv("CONTENT_TYPE");
+
+    /* Start CGI Script */
+    if(!r->path) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    // Checking for failure
+    int   in, pfd;
+    trace_begin(r, spawn);
+    pid_t pid = cgi_spawn(r, &in, &pfd);
+    trace_end(r, spawn);
+    if (pid < 0) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Stream request body into script's stdin (a script that exits without
+     * reading it just ends the connection) */
+    if (r->chunked || r->remaining) {
+        const char *expect = request_header(r, HEADER_EXPECT);
+        if (expect && strcasestr(expect, "100-continue") && r->version >= 11) {
+            fprintf(r->stream, "HTTP/1.1 100 Continue\r\n\r\n");
+            fflush(r->stream);
+        }
+
+        trace_begin(r, body);
+        ssize_t forwarded = request_body(r, in);
+        trace_end(r, body);
+        if (forwarded < 0 && errno != EPIPE) {
+            Status status = errno == EFBIG ? HTTP_STATUS_PAYLOAD_TOO_LARGE :
+                            r->timeout    ? HTTP_STATUS_REQUEST_TIMEOUT : HTTP_STATUS_BAD_REQUEST;
+            close(in);
+            close(pfd);
+            cgi_wait(pid, true);
+            return handle_error(r, status);
+        }
+    }
+    close(in);
+
+    /* Read CGI header block */
+    trace_begin(r, cgi_head);
+    size_t nhead    = 0;
+    char  *body     = NULL;
+    while (!body && nhead < sizeof(buffer)) {
+        ssize_t nread = read(pfd, buffer + nhead, sizeof(buffer) - nhead);
+        if (nread < 0 && errno == EINTR)
+            continue;
+        if (nread <= 0)
+            break;
+        nhead += nread;
+        body = cgi_header_end(buffer, nhead);
+    }
+    trace_end(r, cgi_head);
+
+    if (!body) {
+        debug("CGI script did not emit a header block");
+        close(pfd);
+        cgi_wait(pid, false);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Write status line and headers from CGI header block */
+    char status[64];
+    long length  = cgi_parse_headers(buffer, body, status, sizeof(status));
+    bool chunked = length < 0 && r->fd >= 0 && r->version >= 11;
+    handle_status(r, status, length >= 0 || chunked);
+    cgi_write_headers(r, buffer, body);
+    if (chunked)
+        fprintf(r->stream, "Transfer-Encoding: chunked\r\n");
+    fprintf(r->stream, "\r\n");
+
+    /* Copy body to socket (chunked output is coalesced until the script
+     * pauses or CGI_CHUNK bytes are ready) */
+    size_t nbody = buffer + nhead - body;
+    memmove(buffer, body, nbody);
+    trace_begin(r, cgi_body);
+    if (!cgi_copy_body(r, pfd, buffer, nbody, length, chunked))
+        r->keepalive = false;
+    trace_end(r, cgi_body);
+
+    /* Close pipe and reap script, return OK */
+    close(pfd);
+    cgi_wait(pid, false);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Handle plugin request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   plugin      Plugin to invoke (NULL if it could not be loaded).
+ * @return  Status of the HTTP plugin request.
+ *
+ * The plugin runs in this process with a read-only view of the request: any
+ * body is read first (up to BodyLimit) and passed in whole, and the response
+ * is buffered in memory so it is always sent with a Content-Length and the
+ * connection can persist.  A plugin that returns an error status gets the
+ * usual error page instead of anything it wrote.
+ **/
+Status  handle_plugin_request(Request *r, const Plugin *plugin) {
+    if (!plugin)
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+
+    /* Read request body into anonymous memory */
+    if (r->remaining > (size_t)BodyLimit)
+        return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+
+    char   *body   = NULL;
+    ssize_t length = 0;
+    if (r->chunked || r->remaining) {
+        const char *expect = request_header(r, HEADER_EXPECT);
+        if (expect && strcasestr(expect, "100-continue") && r->version >= 11) {
+            fprintf(r->stream, "HTTP/1.1 100 Continue\r\n\r\n");
+            fflush(r->stream);
         }
-        else if(streq(temp->name, "Accept")) {
-            setenv("HTTP_ACCEPT", temp->data, 1);
+
+        int bfd = memfd_create("spidey-body", MFD_CLOEXEC);
+        if (bfd < 0)
+            return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+
+        trace_begin(r, body);
+        length = request_body(r, bfd);
+        trace_end(r, body);
+        if (length < 0) {
+            close(bfd);
+            return errno == EFBIG ? HTTP_STATUS_PAYLOAD_TOO_LARGE :
+                   r->timeout    ? HTTP_STATUS_REQUEST_TIMEOUT : HTTP_STATUS_BAD_REQUEST;
         }
-        else if(streq(temp->name, "Accept-Language")) {
-            setenv("HTTP_ACCEPT_LANGUAGE", temp->data, 1);
+        if (length > 0 && (body = mmap(NULL, length, PROT_READ, MAP_PRIVATE, bfd, 0)) == MAP_FAILED) {
+            close(bfd);
+            return HTTP_STATUS_INTERNAL_SERVER_ERROR;
         }
-        else if(streq(temp->name, "Accept-Encoding")) {
-            setenv("HTTP_ACCEPT_ENCODING", temp->data, 1);
+        close(bfd);
+    }
+
+    /* Invoke plugin with in-memory response */
+    char    *headers  = NULL;
+    char    *content  = NULL;
+    size_t   nheaders = 0;
+    size_t   ncontent = 0;
+    Response response = {.status = "200 OK"};
+    response.headers  = open_memstream(&headers, &nheaders);
+    response.body     = open_memstream(&content, &ncontent);
+
+    Status status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    if (response.headers && response.body) {
+        trace_begin(r, plugin);
+        status = plugin->handle(r, body, length, &response);
+        trace_end(r, plugin);
+    }
+    if (response.headers)
+        fclose(response.headers);
+    if (response.body)
+        fclose(response.body);
+    if (body)
+        munmap(body, length);
+
+    /* Write response */
+    if (status == HTTP_STATUS_OK) {
+        handle_status(r, response.status, true);
+        fwrite(headers, 1, nheaders, r->stream);
+        fprintf(r->stream, "Content-Length: %zu\r\n\r\n", ncontent);
+        if (fwrite(content, 1, ncontent, r->stream) != ncontent && request_timedout(r))
+            r->keepalive = false;
+    }
+
+    free(headers);
+    free(content);
+    return status;
+}
+
+/**
+ * Start CGI script with pipes as its standard input and output.
+ *
+ * @param   r           HTTP Request structure (path set).
+ * @param   in          Pointer to store write end of the script's stdin.
+ * @param   out         Pointer to store read end of the script's stdout.
+ * @return  Process id of script (or -1 on error).
+ *
+ * Unlike popen, this gives the script both directions so the request body can
+ * be streamed in.  The script does not inherit the client socket, and gets
+ * the default SIGPIPE disposition back.
+ **/
+pid_t   cgi_spawn(Request *r, int *in, int *out) {
+    int ipipe[2], opipe[2];
+
+    if (pipe2(ipipe, O_CLOEXEC) < 0)
+        return -1;
+    if (pipe2(opipe, O_CLOEXEC) < 0) {
+        close(ipipe[0]);
+        close(ipipe[1]);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        if (r->fd > STDERR_FILENO)
+            close(r->fd);
+        if (dup2(ipipe[0], STDIN_FILENO) < 0 || dup2(opipe[1], STDOUT_FILENO) < 0)
+            _exit(EXIT_FAILURE);
+        execl(r->path, r->path, NULL);
+        _exit(EXIT_FAILURE);
+    }
+
+    close(ipipe[0]);
+    close(opipe[1]);
+    if (pid < 0) {
+        debug("Unable to fork: %s", strerror(errno));
+        close(ipipe[1]);
+        close(opipe[0]);
+        return -1;
+    }
+
+    *in  = ipipe[1];
+    *out = opipe[0];
+    return pid;
+}
+
+/**
+ * Reap CGI script.
+ *
+ * @param   pid         Process id of script.
+ * @param   terminate   Whether to terminate the script first.
+ **/
+void    cgi_wait(pid_t pid, bool terminate) {
+    if (terminate)
+        kill(pid, SIGTERM);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+}
+
+/**
+ * Find end of CGI header block.
+ *
+ * @param   data        Output received from script.
+ * @param   size        Number of bytes received.
+ * @return  Pointer to first byte of body (or NULL if the blank line has not
+ * arrived yet).  Scripts may end lines with \n or \r\n.
+ **/
+char *  cgi_header_end(char *data, size_t size) {
+    for (char *p = data; (p = memchr(p, '\n', data + size - p)); p++) {
+        if (p + 1 < data + size && p[1] == '\n')
+            return p + 2;
+        if (p + 2 < data + size && p[1] == '\r' && p[2] == '\n')
+            return p + 3;
+    }
+    return NULL;
+}
+
+/**
+ * Parse CGI header block.
+ *
+ * @param   head        Start of header block.
+ * @param   body        Start of body (end of header block).
+ * @param   status      Buffer to store status code and reason.
+ * @param   size        Size of status buffer.
+ * @return  Content-Length given by the script (-1 if absent).
+ *
+ * The status comes from a Status header, an NPH style "HTTP/1.x" first line,
+ * or defaults to 200 (302 with a Location header).
+ **/
+long    cgi_parse_headers(const char *head, const char *body, char *status, size_t size) {
+    long length    = -1;
+    bool explicit  = false;             /* Whether script gave a status */
+
+    snprintf(status, size, "200 OK");
+    for (const char *line = head, *next; line < body; line = next) {
+        const char *eol = memchr(line, '\n', body - line);
+        const char *value;
+        next = eol + 1;
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+
+        if (line == head && strncmp(line, "HTTP/", 5) == 0) {
+            value = memchr(line, ' ', eol - line);
+        } else if (strncasecmp(line, "Status:", 7) == 0) {
+            value = line + 7;
+        } else {
+            if (strncasecmp(line, "Content-Length:", 15) == 0)
+                length = strtol(line + 15, NULL, 10);
+            else if (strncasecmp(line, "Location:", 9) == 0 && !explicit)
+                snprintf(status, size, "302 Found");
+            continue;
         }
-        else if(streq(temp->name, "Connection")) {
-            setenv("HTTP_CONNECTION", temp->data, 1);
+
+        while (value && value < eol && isspace(*value))
+            value++;
+        if (value && value < eol && isdigit(*value)) {
+            snprintf(status, size, "%.*s", (int)(eol - value), value);
+            explicit = true;
         }
-        else if(streq(temp->name, "User-Agent")) {
-            setenv("HTTP_USER_AGENT", temp->data, 1);
+    }
+
+    return length;
+}
+
+/**
+ * Write CGI headers other than the status and connection management ones.
+ **/
+void    cgi_write_headers(Request *r, const char *head, const char *body) {
+    static const char *skipped[] = {"Status:", "Connection:", "Keep-Alive:", "Transfer-Encoding:", NULL};
+
+    for (const char *line = head, *next; line < body; line = next) {
+        const char *eol = memchr(line, '\n', body - line);
+        next = eol + 1;
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+
+        bool skip = eol == line || (line == head && strncmp(line, "HTTP/", 5) == 0);
+        for (const char **name = skipped; !skip && *name; name++) {
+            skip = strncasecmp(line, *name, strlen(*name)) == 0;
         }
-        
-        // Advances pointer
-        temp = temp->next;
+        if (!skip)
+            fprintf(r->stream, "%.*s\r\n", (int)(eol - line), line);
     }
+}
 
-    /* POpen CGI Script */
-    if(!r->path) {
-        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+/**
+ * Copy CGI body from script to client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   pfd         Pipe from script.
+ * @param   buffer      Buffer of BUFSIZ bytes holding start of body.
+ * @param   nbuffer     Number of body bytes already in buffer.
+ * @param   length      Content-Length given by script (-1 if none).
+ * @param   chunked     Whether to use chunked encoding.
+ * @return  Whether the complete body was delivered.
+ **/
+bool    cgi_copy_body(Request *r, int pfd, char *buffer, size_t nbuffer, long length, bool chunked) {
+    char   chunk[CGI_CHUNK];
+    size_t nchunk = 0;
+    long   total  = 0;
+    bool   eof    = false;
+
+    while (true) {
+        /* Clamp body to Content-Length */
+        if (length >= 0 && total + (long)nbuffer > length)
+            nbuffer = length - total;
+        total += nbuffer;
+
+        if (chunked) {
+            memcpy(chunk + nchunk, buffer, nbuffer);
+            nchunk += nbuffer;
+
+            /* Emit chunk when full, at end of output, or when the script
+             * has nothing more ready right now */
+            struct pollfd pfd_ready = {.fd = pfd, .events = POLLIN};
+            if (nchunk && (eof || nchunk + BUFSIZ > sizeof(chunk) || poll(&pfd_ready, 1, 0) == 0)) {
+                request_chunk(r, chunk, nchunk);
+                nchunk = 0;
+                if (fflush(r->stream) != 0) {
+                    request_timedout(r);
+                    return false;
+                }
+            }
+        } else if (nbuffer && fwrite(buffer, 1, nbuffer, r->stream) != nbuffer && request_timedout(r)) {
+            return false;
+        }
+
+        if (eof || (length >= 0 && total >= length))
+            break;
+
+        ssize_t nread = read(pfd, buffer, BUFSIZ);
+        if (nread < 0 && errno == EINTR) {
+            nbuffer = 0;
+            continue;
+        }
+        eof     = nread <= 0;
+        nbuffer = nread > 0 ? nread : 0;
     }
 
-    // Checking for failure
-    pfs = popen(r->path, "r");
-    if(pfs < 0) {
-        pclose(pfs);
-        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    if (chunked)
+        request_chunk(r, NULL, 0);
+
+    return length < 0 || total == length;
+}
+
+/**
+ * Export request header as CGI environment variable.
+ *
+ * @param   name        Header name (e.g. User-Agent).
+ * @param   data        Header data.
+ *
+ * The variable name is HTTP_ followed by the upper-cased header name with
+ * dashes replaced by underscores (e.g. HTTP_USER_AGENT).
+ **/
+void setenv_header(const char *name, const char *data) {
+    char buffer[BUFSIZ];
+    size_t length = snprintf(buffer, sizeof(buffer), "HTTP_%s", name);
+    if (length >= sizeof(buffer))
+        return;
+
+    for (char *c = buffer; *c; c++) {
+        *c = (*c == '-') ? '_' : toupper((unsigned char)*c);
     }
 
-    /* Copy data from popen to socket */
-    size_t nread = fread(buffer, 1, BUFSIZ, pfs);
-    while(nread > 0) {
-        fwrite(buffer, 1, nread, r->stream);
-        nread = fread(buffer , 1, BUFSIZ, pfs);
+    setenv(buffer, data, 1);
+}
+
+/**
+ * Format response status line and connection header.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   status      Status code and reason (e.g. "200 OK").
+ * @param   framed      Whether the body is delimited by Content-Length or
+ * chunked encoding (so the connection can outlive the response).
+ * @param   buffer      Buffer to format into.
+ * @param   size        Size of buffer.
+ * @return  Length of formatted text.
+ *
+ * HTTP/1.1 clients get an HTTP/1.1 status line.  The Connection header is
+ * only sent when it differs from the default of the client's version, and an
+ * unframed response body or an unread request body always ends the
+ * connection.
+ **/
+size_t  format_status(Request *r, const char *status, bool framed, char *buffer, size_t size) {
+    const char *connection = "";
+
+    r->keepalive = r->keepalive && framed && !r->chunked && !r->remaining;
+    if (r->keepalive && r->version < 11) {
+        connection = "Connection: keep-alive\r\n";
+    } else if (!r->keepalive && r->version >= 11) {
+        connection = "Connection: close\r\n";
     }
 
-    /* Close popen, return OK */
-    pclose(pfs);
-    return HTTP_STATUS_OK;
+    int length = snprintf(buffer, size, "HTTP/1.%d %s\r\n%s", r->version >= 11, status, connection);
+    return length < 0 ? 0 : ((size_t)length < size ? (size_t)length : size - 1);
+}
+
+/**
+ * Write response status line and connection header.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   status      Status code and reason (e.g. "200 OK").
+ * @param   framed      Whether the body is delimited.
+ **/
+void    handle_status(Request *r, const char *status, bool framed) {
+    char buffer[BUFSIZ];
+    fwrite(buffer, 1, format_status(r, status, framed, buffer, sizeof(buffer)), r->stream);
 }
 
 /**
@@ -279,8 +1257,11 @@ Status  handle_error(Request *r, Status status) {
     // Gets error string
     const char *status_string = http_status_string(status);
 
-    /* Write HTTP Header */
+    /* Write HTTP Header (error responses close the connection) */
+    r->keepalive = false;
     fprintf(r->stream, "HTTP/1.0 %s\r\n", status_string);
+    if (status == HTTP_STATUS_SERVICE_UNAVAILABLE)
+        fprintf(r->stream, "Retry-After: %ld\r\n", RetryAfter);
     fprintf(r->stream, "Content-Type: text/html\r\n");
     fprintf(r->stream, "\r\n");
 
@@ -294,11 +1275,19 @@ Status  handle_error(Request *r, Status status) {
         fprintf(r->stream, "<h2>Not really sure what you did to get here but good job.</h2>\n");
         fprintf(r->stream, "<center><img src=\"https://i.imgur.com/GpY6bTJ.png\"></center>\n");
     }
+    else if(status == HTTP_STATUS_PAYLOAD_TOO_LARGE) {
+        // 413 Payload Too Large
+        fprintf(r->stream, "<h2>That is way more than we can take. Try sending less.</h2>\n");
+    }
     else if(status == HTTP_STATUS_NOT_FOUND) {
         // 404 Not Found
         fprintf(r->stream, "<h2>Whatcha looking for?</h2>\n");
         fprintf(r->stream, "<center><img src=\"https://i.imgflip.com/11fjj7.jpg\"></center>\n");
     }
+    else if(status == HTTP_STATUS_SERVICE_UNAVAILABLE) {
+        // 503 Service Unavailable
+        fprintf(r->stream, "<h2>Too busy right now. Try again in a bit.</h2>\n");
+    }
     else {
         // 500 Internal Server Error
         fprintf(r->stream, "<h2>Something broke. Please don\'t take off points. ;)</h2>\n");
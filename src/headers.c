@@ -0,0 +1,149 @@
+/* headers.c: Well-Known HTTP Header Names */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+/* Perfect Hash Table
+ *
+ * Generated by bin/headers.py: every well-known header name hashes to a
+ * distinct slot, so classifying a name costs one hash and at most one
+ * case-insensitive comparison.  Regenerate whenever HeaderId changes.
+ */
+
+#define HEADER_BITS	6
+
+#define HEADER_SEED	905
+
+static const HeaderId HeaderSlots[1 << HEADER_BITS] = {
+    [ 0] = HEADER_UNKNOWN,
+    [ 1] = HEADER_CACHE_CONTROL,
+    [ 2] = HEADER_UNKNOWN,
+    [ 3] = HEADER_HOST,
+    [ 4] = HEADER_UNKNOWN,
+    [ 5] = HEADER_IF_NONE_MATCH,
+    [ 6] = HEADER_UNKNOWN,
+    [ 7] = HEADER_ACCEPT_CHARSET,
+    [ 8] = HEADER_UNKNOWN,
+    [ 9] = HEADER_UNKNOWN,
+    [10] = HEADER_ACCEPT_ENCODING,
+    [11] = HEADER_UNKNOWN,
+    [12] = HEADER_UNKNOWN,
+    [13] = HEADER_UNKNOWN,
+    [14] = HEADER_UNKNOWN,
+    [15] = HEADER_UNKNOWN,
+    [16] = HEADER_UNKNOWN,
+    [17] = HEADER_CONTENT_LENGTH,
+    [18] = HEADER_UNKNOWN,
+    [19] = HEADER_UNKNOWN,
+    [20] = HEADER_RANGE,
+    [21] = HEADER_UNKNOWN,
+    [22] = HEADER_HTTP2_SETTINGS,
+    [23] = HEADER_UNKNOWN,
+    [24] = HEADER_CONNECTION,
+    [25] = HEADER_UNKNOWN,
+    [26] = HEADER_COOKIE,
+    [27] = HEADER_UNKNOWN,
+    [28] = HEADER_TE,
+    [29] = HEADER_ORIGIN,
+    [30] = HEADER_UNKNOWN,
+    [31] = HEADER_IF_MODIFIED_SINCE,
+    [32] = HEADER_REFERER,
+    [33] = HEADER_AUTHORIZATION,
+    [34] = HEADER_UNKNOWN,
+    [35] = HEADER_UNKNOWN,
+    [36] = HEADER_UNKNOWN,
+    [37] = HEADER_UNKNOWN,
+    [38] = HEADER_UNKNOWN,
+    [39] = HEADER_KEEP_ALIVE,
+    [40] = HEADER_UNKNOWN,
+    [41] = HEADER_CONTENT_TYPE,
+    [42] = HEADER_TRANSFER_ENCODING,
+    [43] = HEADER_USER_AGENT,
+    [44] = HEADER_UNKNOWN,
+    [45] = HEADER_UNKNOWN,
+    [46] = HEADER_UNKNOWN,
+    [47] = HEADER_UNKNOWN,
+    [48] = HEADER_PRAGMA,
+    [49] = HEADER_X_FORWARDED_FOR,
+    [50] = HEADER_ACCEPT_LANGUAGE,
+    [51] = HEADER_UNKNOWN,
+    [52] = HEADER_ACCEPT,
+    [53] = HEADER_UNKNOWN,
+    [54] = HEADER_UNKNOWN,
+    [55] = HEADER_UNKNOWN,
+    [56] = HEADER_UPGRADE,
+    [57] = HEADER_UNKNOWN,
+    [58] = HEADER_UNKNOWN,
+    [59] = HEADER_UNKNOWN,
+    [60] = HEADER_UNKNOWN,
+    [61] = HEADER_IF_RANGE,
+    [62] = HEADER_UNKNOWN,
+    [63] = HEADER_EXPECT,
+};
+
+static const char *HeaderNames[HEADER_NKNOWN] = {
+    [HEADER_ACCEPT]              = "Accept",
+    [HEADER_ACCEPT_CHARSET]      = "Accept-Charset",
+    [HEADER_ACCEPT_ENCODING]     = "Accept-Encoding",
+    [HEADER_ACCEPT_LANGUAGE]     = "Accept-Language",
+    [HEADER_AUTHORIZATION]       = "Authorization",
+    [HEADER_CACHE_CONTROL]       = "Cache-Control",
+    [HEADER_CONNECTION]          = "Connection",
+    [HEADER_CONTENT_LENGTH]      = "Content-Length",
+    [HEADER_CONTENT_TYPE]        = "Content-Type",
+    [HEADER_COOKIE]              = "Cookie",
+    [HEADER_EXPECT]              = "Expect",
+    [HEADER_HOST]                = "Host",
+    [HEADER_HTTP2_SETTINGS]      = "HTTP2-Settings",
+    [HEADER_IF_MODIFIED_SINCE]   = "If-Modified-Since",
+    [HEADER_IF_NONE_MATCH]       = "If-None-Match",
+    [HEADER_IF_RANGE]            = "If-Range",
+    [HEADER_KEEP_ALIVE]          = "Keep-Alive",
+    [HEADER_ORIGIN]              = "Origin",
+    [HEADER_PRAGMA]              = "Pragma",
+    [HEADER_RANGE]               = "Range",
+    [HEADER_REFERER]             = "Referer",
+    [HEADER_TE]                  = "TE",
+    [HEADER_TRANSFER_ENCODING]   = "Transfer-Encoding",
+    [HEADER_UPGRADE]             = "Upgrade",
+    [HEADER_USER_AGENT]          = "User-Agent",
+    [HEADER_X_FORWARDED_FOR]     = "X-Forwarded-For",
+};
+
+/**
+ * Classify header name.
+ *
+ * @param   name        Header name (need not be NUL-terminated).
+ * @param   length      Length of header name.
+ * @return  HeaderId of well-known header or HEADER_UNKNOWN.
+ *
+ * Matching is case-insensitive as HTTP requires.
+ **/
+HeaderId header_lookup(const char *name, size_t length) {
+    uint32_t hash = HEADER_SEED;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)tolower((unsigned char)name[i])) * 16777619u;
+    }
+
+    HeaderId id = HeaderSlots[hash >> (32 - HEADER_BITS)];
+    if (id == HEADER_UNKNOWN || strlen(HeaderNames[id]) != length || strncasecmp(HeaderNames[id], name, length) != 0) {
+        return HEADER_UNKNOWN;
+    }
+
+    return id;
+}
+
+/**
+ * Return canonical name of well-known header.
+ *
+ * @param   id          HeaderId of well-known header.
+ * @return  Static string containing header name (or NULL if unknown).
+ **/
+const char * header_name(HeaderId id) {
+    return id < HEADER_NKNOWN ? HeaderNames[id] : NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,497 @@
+/* hpack.c: HTTP/2 Header Compression (RFC 7541) */
+
+#include "spidey.h"
+
+#include <string.h>
+
+/* Static Table (RFC 7541 Appendix A) */
+static const char *StaticTable[][2] = {
+    {NULL, NULL},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+#define STATIC_ENTRIES	(sizeof(StaticTable) / sizeof(StaticTable[0]) - 1)
+#define ENTRY_OVERHEAD	32
+
+/* Huffman Code (RFC 7541 Appendix B)
+ *
+ * The code is canonical, so only the length of each symbol's code is stored
+ * and the codes themselves are reconstructed by hpack_huffman_init.
+ */
+static const uint8_t HuffmanLengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+#define HUFFMAN_EOS	256
+#define HUFFMAN_MAX	30
+
+static uint32_t HuffmanFirst[HUFFMAN_MAX + 1];  /* First code of each length */
+static uint16_t HuffmanCount[HUFFMAN_MAX + 1];  /* Number of codes of each length */
+static uint16_t HuffmanOffset[HUFFMAN_MAX + 1]; /* Index of first symbol of each length */
+static uint16_t HuffmanSymbols[257];            /* Symbols ordered by code */
+
+/* Internal Declarations */
+static void hpack_huffman_init(void);
+static int  hpack_huffman_decode(const uint8_t *s, size_t length, char *out, size_t *outlen);
+static int  hpack_integer(const uint8_t **p, const uint8_t *end, int prefix, uint64_t *value);
+static char *hpack_string(const uint8_t **p, const uint8_t *end);
+static int  hpack_lookup(HpackTable *t, uint64_t index, const char **name, const char **value);
+static int  hpack_insert(HpackTable *t, const char *name, const char *value);
+static void hpack_evict(HpackTable *t, size_t size);
+static size_t hpack_put_integer(uint8_t *out, size_t size, uint8_t flags, int prefix, uint64_t value);
+
+/**
+ * Initialize HPACK decoding table.
+ *
+ * @param   t           HPACK table structure.
+ * @param   max_size    SETTINGS_HEADER_TABLE_SIZE advertised to the peer.
+ **/
+void hpack_init(HpackTable *t, size_t max_size) {
+    hpack_huffman_init();
+
+    t->capacity = max_size / ENTRY_OVERHEAD + 1;
+    t->entries  = calloc(t->capacity, sizeof(HpackEntry));
+    t->first    = 0;
+    t->count    = 0;
+    t->size     = 0;
+    t->max_size = max_size;
+    t->limit    = max_size;
+}
+
+/**
+ * Deallocate HPACK decoding table.
+ **/
+void hpack_free(HpackTable *t) {
+    hpack_evict(t, 0);
+    free(t->entries);
+    t->entries = NULL;
+}
+
+/**
+ * Decode HPACK header block.
+ *
+ * @param   t           HPACK table structure.
+ * @param   block       Complete header block.
+ * @param   length      Length of header block.
+ * @param   callback    Function called with each decoded name and value.
+ * @param   arg         Argument to callback.
+ * @return  -1 on compression error or if callback fails and 0 on success.
+ **/
+int hpack_decode(HpackTable *t, const uint8_t *block, size_t length, HpackCallback callback, void *arg) {
+    const uint8_t *p   = block;
+    const uint8_t *end = block + length;
+
+    while (p < end) {
+        uint64_t    index;
+        const char *name;
+        const char *value;
+
+        if (*p & 0x80) {
+            /* Indexed Header Field */
+            if (hpack_integer(&p, end, 7, &index) < 0 || index == 0 ||
+                hpack_lookup(t, index, &name, &value) < 0 || callback(arg, name, value) < 0) {
+                return -1;
+            }
+        } else if ((*p & 0xE0) == 0x20) {
+            /* Dynamic Table Size Update */
+            if (hpack_integer(&p, end, 5, &index) < 0 || index > t->limit) {
+                return -1;
+            }
+            t->max_size = index;
+            hpack_evict(t, t->max_size);
+        } else {
+            /* Literal Header Field (with, without, or never indexed) */
+            bool indexing = (*p & 0xC0) == 0x40;
+            char *lname  = NULL;
+            char *lvalue = NULL;
+            int   status = -1;
+
+            if (hpack_integer(&p, end, indexing ? 6 : 4, &index) < 0) {
+                return -1;
+            }
+
+            if (index == 0) {
+                name = lname = hpack_string(&p, end);
+            } else if (hpack_lookup(t, index, &name, &value) < 0) {
+                return -1;
+            }
+
+            if (name && (lvalue = hpack_string(&p, end))) {
+                status = 0;
+                if (indexing && hpack_insert(t, name, lvalue) < 0) {
+                    status = -1;
+                }
+                if (status == 0 && callback(arg, name, lvalue) < 0) {
+                    status = -1;
+                }
+            }
+
+            free(lname);
+            free(lvalue);
+            if (status < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Encode header field as literal without indexing.
+ *
+ * @param   out         Output buffer.
+ * @param   size        Size of output buffer.
+ * @param   name        Header name (lowercase).
+ * @param   value       Header value.
+ * @return  Number of bytes written (0 if the output buffer is too small).
+ *
+ * Responses are encoded without touching the peer's dynamic table: fields
+ * matching a static entry exactly use the indexed form and everything else
+ * is a literal, using a static name index where one exists.
+ **/
+size_t hpack_encode(uint8_t *out, size_t size, const char *name, const char *value) {
+    size_t name_index = 0;
+
+    for (size_t i = 1; i <= STATIC_ENTRIES; i++) {
+        if (streq(StaticTable[i][0], name)) {
+            if (streq(StaticTable[i][1], value)) {
+                return hpack_put_integer(out, size, 0x80, 7, i);
+            }
+            if (!name_index) {
+                name_index = i;
+            }
+        }
+    }
+
+    size_t n = hpack_put_integer(out, size, 0x00, 4, name_index);
+    if (!n) {
+        return 0;
+    }
+
+    if (!name_index) {
+        size_t length = strlen(name);
+        size_t m = hpack_put_integer(out + n, size - n, 0x00, 7, length);
+        if (!m || n + m + length > size) {
+            return 0;
+        }
+        memcpy(out + n + m, name, length);
+        n += m + length;
+    }
+
+    size_t length = strlen(value);
+    size_t m = hpack_put_integer(out + n, size - n, 0x00, 7, length);
+    if (!m || n + m + length > size) {
+        return 0;
+    }
+    memcpy(out + n + m, value, length);
+    return n + m + length;
+}
+
+/**
+ * Build canonical Huffman decoding tables from code lengths.
+ **/
+static void hpack_huffman_init(void) {
+    if (HuffmanCount[5]) {
+        return;
+    }
+
+    for (int symbol = 0; symbol <= HUFFMAN_EOS; symbol++) {
+        HuffmanCount[HuffmanLengths[symbol]]++;
+    }
+
+    uint32_t code   = 0;
+    uint16_t offset = 0;
+    for (int length = 1; length <= HUFFMAN_MAX; length++) {
+        HuffmanFirst[length]  = code;
+        HuffmanOffset[length] = offset;
+        code    = (code + HuffmanCount[length]) << 1;
+        offset += HuffmanCount[length];
+    }
+
+    uint16_t filled[HUFFMAN_MAX + 1] = {0};
+    for (int symbol = 0; symbol <= HUFFMAN_EOS; symbol++) {
+        int length = HuffmanLengths[symbol];
+        HuffmanSymbols[HuffmanOffset[length] + filled[length]++] = symbol;
+    }
+}
+
+/**
+ * Decode Huffman encoded string.
+ *
+ * @return  -1 on invalid code or padding and 0 on success.
+ **/
+static int hpack_huffman_decode(const uint8_t *s, size_t length, char *out, size_t *outlen) {
+    uint32_t code = 0;
+    int      bits = 0;
+
+    *outlen = 0;
+    for (size_t i = 0; i < length; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code = (code << 1) | ((s[i] >> bit) & 1);
+            bits++;
+
+            uint32_t index = code - HuffmanFirst[bits];
+            if (index < HuffmanCount[bits]) {
+                uint16_t symbol = HuffmanSymbols[HuffmanOffset[bits] + index];
+                if (symbol == HUFFMAN_EOS) {
+                    return -1;
+                }
+                out[(*outlen)++] = symbol;
+                code = 0;
+                bits = 0;
+            } else if (bits == HUFFMAN_MAX) {
+                return -1;
+            }
+        }
+    }
+
+    /* Padding must be a prefix of EOS (all ones) shorter than a byte */
+    if (bits > 7 || code != (1u << bits) - 1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Decode HPACK integer with specified prefix length.
+ **/
+static int hpack_integer(const uint8_t **p, const uint8_t *end, int prefix, uint64_t *value) {
+    uint64_t mask = (1 << prefix) - 1;
+
+    if (*p >= end) {
+        return -1;
+    }
+
+    *value = *(*p)++ & mask;
+    if (*value < mask) {
+        return 0;
+    }
+
+    for (int shift = 0; shift < 56; shift += 7) {
+        if (*p >= end) {
+            return -1;
+        }
+        uint8_t byte = *(*p)++;
+        *value += (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Decode HPACK string literal.
+ *
+ * @return  Newly allocated string (or NULL on error).
+ **/
+static char * hpack_string(const uint8_t **p, const uint8_t *end) {
+    uint64_t length;
+
+    if (*p >= end) {
+        return NULL;
+    }
+
+    bool huffman = **p & 0x80;
+    if (hpack_integer(p, end, 7, &length) < 0 || length > (uint64_t)(end - *p)) {
+        return NULL;
+    }
+
+    /* Huffman codes are at least 5 bits, so output is at most 8/5 of input */
+    char *s = malloc(huffman ? length * 8 / 5 + 1 : length + 1);
+    if (!s) {
+        return NULL;
+    }
+
+    size_t outlen = length;
+    if (huffman) {
+        if (hpack_huffman_decode(*p, length, s, &outlen) < 0) {
+            free(s);
+            return NULL;
+        }
+    } else {
+        memcpy(s, *p, length);
+    }
+
+    s[outlen] = '\0';
+    *p += length;
+    return s;
+}
+
+/**
+ * Look up static or dynamic table entry by index.
+ **/
+static int hpack_lookup(HpackTable *t, uint64_t index, const char **name, const char **value) {
+    if (index <= STATIC_ENTRIES) {
+        *name  = StaticTable[index][0];
+        *value = StaticTable[index][1];
+        return 0;
+    }
+
+    index -= STATIC_ENTRIES + 1;
+    if (index >= t->count) {
+        return -1;
+    }
+
+    HpackEntry *entry = &t->entries[(t->first + index) % t->capacity];
+    *name  = entry->name;
+    *value = entry->value;
+    return 0;
+}
+
+/**
+ * Insert entry at the front of the dynamic table, evicting as needed.
+ **/
+static int hpack_insert(HpackTable *t, const char *name, const char *value) {
+    size_t size = strlen(name) + strlen(value) + ENTRY_OVERHEAD;
+
+    /* An entry larger than the table empties it (RFC 7541 4.4) */
+    if (size > t->max_size) {
+        hpack_evict(t, 0);
+        return 0;
+    }
+
+    hpack_evict(t, t->max_size - size);
+
+    HpackEntry entry = {strdup(name), strdup(value), size};
+    if (!entry.name || !entry.value) {
+        free(entry.name);
+        free(entry.value);
+        return -1;
+    }
+
+    t->first = (t->first + t->capacity - 1) % t->capacity;
+    t->entries[t->first] = entry;
+    t->count++;
+    t->size += size;
+    return 0;
+}
+
+/**
+ * Evict oldest entries until the dynamic table size is at most size.
+ **/
+static void hpack_evict(HpackTable *t, size_t size) {
+    while (t->count > 0 && t->size > size) {
+        HpackEntry *entry = &t->entries[(t->first + t->count - 1) % t->capacity];
+        t->size -= entry->size;
+        free(entry->name);
+        free(entry->value);
+        t->count--;
+    }
+}
+
+/**
+ * Encode HPACK integer with specified prefix length and flag bits.
+ *
+ * @return  Number of bytes written (0 if output buffer is too small).
+ **/
+static size_t hpack_put_integer(uint8_t *out, size_t size, uint8_t flags, int prefix, uint64_t value) {
+    uint64_t mask = (1 << prefix) - 1;
+    size_t   n    = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    if (value < mask) {
+        out[n++] = flags | value;
+        return n;
+    }
+
+    out[n++] = flags | mask;
+    value -= mask;
+    while (value >= 0x80) {
+        if (n == size) {
+            return 0;
+        }
+        out[n++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+
+    if (n == size) {
+        return 0;
+    }
+    out[n++] = value;
+    return n;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
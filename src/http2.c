@@ -0,0 +1,1015 @@
+/* http2.c: HTTP/2 over Cleartext (h2c) */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <strings.h>
+
+#include <unistd.h>
+
+/* Constants */
+
+#define H2_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_REST		"SM\r\n\r\n"    /* Remainder after the request head */
+#define H2_HEADER_SIZE		9
+#define H2_MAX_FRAME_SIZE	16384
+#define H2_DEFAULT_WINDOW	65535
+#define H2_MAX_WINDOW		0x7FFFFFFF
+#define H2_MAX_STREAMS		100
+#define H2_TABLE_SIZE		4096
+#define H2_MAX_HEADER_BLOCK	65536           /* Largest header block (with CONTINUATION frames) */
+#define H2_RESPONSE_BUFFER	(1 << 20)       /* Response bytes captured in memory before spilling to a file */
+
+/* Frame types */
+enum {
+    H2_DATA = 0,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION,
+};
+
+/* Frame flags */
+#define H2_FLAG_END_STREAM	0x01
+#define H2_FLAG_ACK		0x01
+#define H2_FLAG_END_HEADERS	0x04
+#define H2_FLAG_PADDED		0x08
+#define H2_FLAG_PRIORITY	0x20
+
+/* Error codes */
+enum {
+    H2_NO_ERROR = 0,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR,
+    H2_ENHANCE_YOUR_CALM,
+};
+
+/* Settings */
+enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    H2_SETTINGS_ENABLE_PUSH,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE,
+    H2_SETTINGS_MAX_FRAME_SIZE,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE,
+};
+
+/* Structures */
+
+typedef struct stream Stream;
+struct stream {
+    uint32_t  id;                       /* Stream identifier */
+    int64_t   window;                   /* Send flow-control window */
+    Request  *request;                  /* Request being received (NULL once answered) */
+    uint8_t  *block;                    /* Header block fragments awaiting END_HEADERS */
+    size_t    blocklen;                 /* Length of header block fragments */
+    bool      closed;                   /* Whether END_STREAM was received */
+    bool      refused;                  /* Whether stream exceeded H2_MAX_STREAMS */
+    FILE     *upload;                   /* Request body received so far (NULL if none) */
+    size_t    uploaded;                 /* Length of request body */
+    char     *response;                 /* Captured response (NULL until answered) */
+    size_t    length;                   /* Length of captured response */
+    size_t    capacity;                 /* Allocated size of captured response */
+    FILE     *file;                     /* Rest of response after the captured part (NULL if none) */
+    size_t    filelength;               /* Length of rest of response */
+    size_t    sent;                     /* Offset of next response byte to send */
+    Stream   *next;                     /* Next stream on connection */
+};
+
+typedef struct {
+    Request    *r;                      /* Client connection */
+    HpackTable  decoder;                /* Request header decoding table */
+    Stream     *streams;                /* Open streams in arrival order */
+    size_t      nstreams;               /* Number of open streams */
+    int64_t     window;                 /* Connection send flow-control window */
+    int64_t     initial_window;         /* Peer SETTINGS_INITIAL_WINDOW_SIZE */
+    uint32_t    max_frame;              /* Largest DATA payload to send */
+    uint32_t    last_stream;            /* Highest stream identifier seen */
+    uint32_t    continuation;           /* Stream expecting CONTINUATION (0 if none) */
+    bool        goaway;                 /* Whether peer sent GOAWAY */
+    uint8_t     frame[H2_HEADER_SIZE + H2_MAX_FRAME_SIZE];  /* Frame being received */
+    uint8_t     data[H2_MAX_FRAME_SIZE];                    /* DATA payload read from a response file */
+} Connection;
+
+/* Internal Declarations */
+static int      h2_read_frame(Connection *c);
+static int      h2_read_exact(Connection *c, void *data, size_t size);
+static bool     h2_readable(Connection *c);
+static void     h2_write_frame(Connection *c, uint8_t type, uint8_t flags, uint32_t id, const void *payload, size_t length);
+static int      h2_goaway(Connection *c, uint32_t error);
+static void     h2_reset(Connection *c, Stream *s, uint32_t error);
+static int      h2_settings(Connection *c, const uint8_t *payload, size_t length);
+static int      h2_headers(Connection *c, Stream *s);
+static int      h2_header(void *arg, const char *name, const char *value);
+static int      h2_upload(Stream *s, const uint8_t *payload, size_t length);
+static ssize_t  h2_capture(void *cookie, const char *data, size_t size);
+static size_t   h2_head_length(const char *response, size_t length);
+static void     h2_respond(Connection *c, Stream *s);
+static bool     h2_send_data(Connection *c);
+static Stream * h2_stream_find(Connection *c, uint32_t id);
+static Stream * h2_stream_open(Connection *c, uint32_t id);
+static void     h2_stream_close(Connection *c, Stream *s);
+static size_t   h2_base64url_decode(const char *s, uint8_t *out, size_t size);
+
+/**
+ * Serve HTTP/2 connection.
+ *
+ * @param   r           HTTP Request structure of the connection.
+ * @param   upgrade     Whether the request asked to upgrade to h2c (otherwise
+ * it was the prior-knowledge connection preface).
+ * @return  Status of the HTTP/2 connection.
+ *
+ * Each stream is turned into its own Request and run through
+ * dispatch_request once its request body (spooled to a file) is complete,
+ * with the response captured.  Responses are then sent as HEADERS followed by
+ * DATA frames, one frame per stream in turn so concurrent streams share the
+ * connection, within the flow-control windows granted by the client.
+ *
+ * Handlers run one at a time, so only their bodies are multiplexed: files
+ * are sent straight from the file the handler opened, and any other response
+ * keeps its first H2_RESPONSE_BUFFER bytes in memory and the rest in a
+ * temporary file, so memory does not grow with response size.
+ **/
+Status http2_serve(Request *r, bool upgrade) {
+    Connection *c = calloc(1, sizeof(Connection));
+    if (!c) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    c->r              = r;
+    c->window         = H2_DEFAULT_WINDOW;
+    c->initial_window = H2_DEFAULT_WINDOW;
+    c->max_frame      = H2_MAX_FRAME_SIZE;
+    hpack_init(&c->decoder, H2_TABLE_SIZE);
+
+    /* Connection outlives RequestTimeout; idle and header deadlines apply */
+    timer_cancel(&Timers, &r->expiry);
+    alarm(0);
+
+    log("HTTP/2 connection from %s:%s (%s)", r->host, r->port, upgrade ? "upgrade" : "prior knowledge");
+
+    /* Upgraded request becomes stream 1 */
+    Stream *first = NULL;
+    if (upgrade) {
+        uint8_t settings[H2_MAX_FRAME_SIZE];
+        size_t  length = h2_base64url_decode(request_header(r, HEADER_HTTP2_SETTINGS), settings, sizeof(settings));
+        if (length % 6 || h2_settings(c, settings, length) < 0) {
+            hpack_free(&c->decoder);
+            free(c);
+            return HTTP_STATUS_BAD_REQUEST;
+        }
+
+        first = h2_stream_open(c, 1);
+        if (!first) {
+            hpack_free(&c->decoder);
+            free(c);
+            return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        }
+
+        fprintf(r->stream, "HTTP/1.1 101 Switching Protocols\r\n");
+        fprintf(r->stream, "Connection: Upgrade\r\n");
+        fprintf(r->stream, "Upgrade: h2c\r\n");
+        fprintf(r->stream, "\r\n");
+
+        first->closed = true;
+        first->request->method = r->method;
+        first->request->uri    = r->uri;
+        first->request->query  = r->query;
+        r->method = r->uri = r->query = NULL;
+        for (HeaderId id = 0; id < HEADER_NKNOWN; id++) {
+            if (id != HEADER_CONNECTION && id != HEADER_UPGRADE && id != HEADER_HTTP2_SETTINGS) {
+                first->request->known[id] = r->known[id];
+                r->known[id] = NULL;
+            }
+        }
+        first->request->headers  = r->headers;
+        first->request->nheaders = r->nheaders;
+        first->request->capacity = r->capacity;
+        r->headers  = NULL;
+        r->nheaders = r->capacity = 0;
+    }
+
+    /* Send server preface: SETTINGS */
+    uint8_t settings[6] = {0, H2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS};
+    h2_write_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    fflush(r->stream);
+
+    /* Read (rest of) client connection preface */
+    const char *preface = upgrade ? H2_PREFACE : H2_PREFACE_REST;
+    char        buffer[sizeof(H2_PREFACE)];
+    request_phase(r, TIMEOUT_HEADER);
+    if (h2_read_exact(c, buffer, strlen(preface)) < 0 || memcmp(buffer, preface, strlen(preface)) != 0) {
+        debug("Invalid HTTP/2 connection preface");
+        h2_goaway(c, H2_PROTOCOL_ERROR);
+    } else {
+        if (first) {
+            h2_respond(c, first);
+        }
+
+        /* Alternate between sending DATA and processing incoming frames */
+        while (true) {
+            bool progress = h2_send_data(c);
+            if (fflush(r->stream) != 0) {
+                break;
+            }
+
+            if (c->goaway && !c->nstreams) {
+                break;
+            }
+
+            if (progress && !h2_readable(c)) {
+                continue;
+            }
+
+            request_phase(r, c->nstreams ? TIMEOUT_HEADER : TIMEOUT_IDLE);
+            if (h2_read_frame(c) < 0) {
+                break;
+            }
+        }
+    }
+
+    fflush(r->stream);
+    while (c->streams) {
+        h2_stream_close(c, c->streams);
+    }
+    hpack_free(&c->decoder);
+    free(c);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Read and process one frame.
+ *
+ * @return  -1 if the connection should be closed and 0 otherwise.
+ **/
+static int h2_read_frame(Connection *c) {
+    uint8_t *f = c->frame;
+
+    if (h2_read_exact(c, f, H2_HEADER_SIZE) < 0) {
+        return -1;
+    }
+
+    uint32_t length = (f[0] << 16) | (f[1] << 8) | f[2];
+    uint8_t  type   = f[3];
+    uint8_t  flags  = f[4];
+    uint32_t id     = ((uint32_t)(f[5] & 0x7F) << 24) | (f[6] << 16) | (f[7] << 8) | f[8];
+
+    if (length > H2_MAX_FRAME_SIZE) {
+        return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+    }
+
+    if (h2_read_exact(c, f + H2_HEADER_SIZE, length) < 0) {
+        return -1;
+    }
+
+    uint8_t *payload = f + H2_HEADER_SIZE;
+    if (c->continuation && (type != H2_CONTINUATION || id != c->continuation)) {
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+    }
+
+    /* Strip padding and priority fields */
+    if ((type == H2_DATA || type == H2_HEADERS) && (flags & H2_FLAG_PADDED)) {
+        if (length < 1 || payload[0] >= length) {
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+        }
+        length -= payload[0] + 1;
+        payload++;
+    }
+
+    if (type == H2_HEADERS && (flags & H2_FLAG_PRIORITY)) {
+        if (length < 5) {
+            return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+        }
+        length  -= 5;
+        payload += 5;
+    }
+
+    Stream *s = id ? h2_stream_find(c, id) : NULL;
+    switch (type) {
+        case H2_DATA: {
+            uint32_t consumed = (f[0] << 16) | (f[1] << 8) | f[2];
+            if (!id) {
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            }
+
+            /* Request bodies are spooled to a file; give the window straight back */
+            if (consumed) {
+                uint8_t increment[4] = {consumed >> 24, consumed >> 16, consumed >> 8, consumed};
+                h2_write_frame(c, H2_WINDOW_UPDATE, 0, 0, increment, sizeof(increment));
+                if (s && !s->closed) {
+                    h2_write_frame(c, H2_WINDOW_UPDATE, 0, id, increment, sizeof(increment));
+                }
+            }
+
+            if (!s || s->closed) {
+                if (id > c->last_stream) {
+                    return h2_goaway(c, H2_PROTOCOL_ERROR);
+                }
+                break;
+            }
+
+            if (length && s->request && !s->refused && h2_upload(s, payload, length) < 0) {
+                h2_reset(c, s, H2_INTERNAL_ERROR);
+                break;
+            }
+
+            if (flags & H2_FLAG_END_STREAM) {
+                s->closed = true;
+                if (s->request && !s->block) {
+                    h2_respond(c, s);
+                }
+            }
+            break;
+        }
+
+        case H2_HEADERS:
+            if (!id || !(id & 1)) {
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            }
+
+            if (!s) {
+                if (id <= c->last_stream) {
+                    return h2_goaway(c, H2_STREAM_CLOSED);
+                }
+                c->last_stream = id;
+                s = h2_stream_open(c, id);
+                if (!s) {
+                    return h2_goaway(c, H2_INTERNAL_ERROR);
+                }
+            }
+
+            if (flags & H2_FLAG_END_STREAM) {
+                s->closed = true;
+            }
+            /* Fall through */
+
+        case H2_CONTINUATION:
+            /* CONTINUATION only follows a header block that did not end */
+            if (!s || (type == H2_CONTINUATION && c->continuation != id)) {
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            }
+
+            if (s->blocklen + length > H2_MAX_HEADER_BLOCK) {
+                return h2_goaway(c, H2_ENHANCE_YOUR_CALM);
+            }
+
+            uint8_t *block = realloc(s->block, s->blocklen + length + 1);
+            if (!block) {
+                return h2_goaway(c, H2_INTERNAL_ERROR);
+            }
+            memcpy(block + s->blocklen, payload, length);
+            s->block     = block;
+            s->blocklen += length;
+
+            if (flags & H2_FLAG_END_HEADERS) {
+                c->continuation = 0;
+                return h2_headers(c, s);
+            }
+            c->continuation = id;
+            break;
+
+        case H2_PRIORITY:
+            if (length != 5) {
+                return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+            }
+            break;
+
+        case H2_RST_STREAM:
+            if (!id || length != 4) {
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            }
+            if (s) {
+                h2_stream_close(c, s);
+            }
+            break;
+
+        case H2_SETTINGS:
+            if (id) {
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            }
+            if (flags & H2_FLAG_ACK) {
+                return length ? h2_goaway(c, H2_FRAME_SIZE_ERROR) : 0;
+            }
+            if (length % 6) {
+                return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+            }
+            if (h2_settings(c, payload, length) < 0) {
+                return -1;
+            }
+            h2_write_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+            break;
+
+        case H2_PING:
+            if (id || length != 8) {
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            }
+            if (!(flags & H2_FLAG_ACK)) {
+                h2_write_frame(c, H2_PING, H2_FLAG_ACK, 0, payload, length);
+            }
+            break;
+
+        case H2_GOAWAY:
+            c->goaway = true;
+            break;
+
+        case H2_WINDOW_UPDATE: {
+            if (length != 4) {
+                return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+            }
+
+            uint32_t increment = ((uint32_t)(payload[0] & 0x7F) << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+            if (!id) {
+                c->window += increment;
+                if (!increment || c->window > H2_MAX_WINDOW) {
+                    return h2_goaway(c, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+                }
+            } else if (s) {
+                s->window += increment;
+                if (!increment || s->window > H2_MAX_WINDOW) {
+                    h2_reset(c, s, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+                }
+            }
+            break;
+        }
+
+        case H2_PUSH_PROMISE:
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+
+        default:
+            /* Unknown frame types are ignored */
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * Read exactly size bytes from the client.
+ *
+ * @return  -1 on error, timeout, or end of stream and 0 on success.
+ **/
+static int h2_read_exact(Connection *c, void *data, size_t size) {
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t nread = request_read(c->r, (char *)data + total, size - total);
+        if (nread <= 0) {
+            return -1;
+        }
+        total += nread;
+    }
+
+    return 0;
+}
+
+/**
+ * Determine if client data can be read without blocking.
+ **/
+static bool h2_readable(Connection *c) {
+    struct pollfd pfd = {.fd = c->r->fd, .events = POLLIN};
+    return request_pending(c->r) || poll(&pfd, 1, 0) > 0;
+}
+
+/**
+ * Write frame to client stream.
+ **/
+static void h2_write_frame(Connection *c, uint8_t type, uint8_t flags, uint32_t id, const void *payload, size_t length) {
+    uint8_t header[H2_HEADER_SIZE] = {
+        length >> 16, length >> 8, length, type, flags,
+        (id >> 24) & 0x7F, id >> 16, id >> 8, id,
+    };
+
+    fwrite(header, 1, sizeof(header), c->r->stream);
+    if (length) {
+        fwrite(payload, 1, length, c->r->stream);
+    }
+}
+
+/**
+ * Send GOAWAY with specified error code.
+ *
+ * @return  -1 so callers can close the connection with return h2_goaway(...).
+ **/
+static int h2_goaway(Connection *c, uint32_t error) {
+    uint8_t payload[8] = {
+        (c->last_stream >> 24) & 0x7F, c->last_stream >> 16, c->last_stream >> 8, c->last_stream,
+        error >> 24, error >> 16, error >> 8, error,
+    };
+
+    debug("HTTP/2 GOAWAY error %u", error);
+    h2_write_frame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    fflush(c->r->stream);
+    return -1;
+}
+
+/**
+ * Reset and close stream with specified error code.
+ **/
+static void h2_reset(Connection *c, Stream *s, uint32_t error) {
+    uint8_t payload[4] = {error >> 24, error >> 16, error >> 8, error};
+
+    h2_write_frame(c, H2_RST_STREAM, 0, s->id, payload, sizeof(payload));
+    h2_stream_close(c, s);
+}
+
+/**
+ * Apply peer SETTINGS parameters.
+ *
+ * @return  -1 on connection error and 0 on success.
+ **/
+static int h2_settings(Connection *c, const uint8_t *payload, size_t length) {
+    for (size_t i = 0; i + 6 <= length; i += 6) {
+        uint16_t id    = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = ((uint32_t)payload[i + 2] << 24) | (payload[i + 3] << 16) | (payload[i + 4] << 8) | payload[i + 5];
+
+        switch (id) {
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return h2_goaway(c, H2_PROTOCOL_ERROR);
+                }
+                break;
+
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > H2_MAX_WINDOW) {
+                    return h2_goaway(c, H2_FLOW_CONTROL_ERROR);
+                }
+                for (Stream *s = c->streams; s; s = s->next) {
+                    s->window += (int64_t)value - c->initial_window;
+                }
+                c->initial_window = value;
+                break;
+
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_MAX_FRAME_SIZE || value > 0xFFFFFF) {
+                    return h2_goaway(c, H2_PROTOCOL_ERROR);
+                }
+                break;
+
+            default:
+                /* Responses never use the peer's dynamic table */
+                break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Decode completed header block of stream.
+ *
+ * @return  -1 on connection error and 0 on success.
+ **/
+static int h2_headers(Connection *c, Stream *s) {
+    int result = hpack_decode(&c->decoder, s->block, s->blocklen, h2_header, s);
+
+    free(s->block);
+    s->block    = NULL;
+    s->blocklen = 0;
+
+    if (result < 0) {
+        return h2_goaway(c, H2_COMPRESSION_ERROR);
+    }
+
+    if (s->refused) {
+        h2_reset(c, s, H2_REFUSED_STREAM);
+    } else if (s->closed && s->request) {
+        h2_respond(c, s);
+    }
+
+    return 0;
+}
+
+/**
+ * Record decoded header field in the stream's request.
+ **/
+static int h2_header(void *arg, const char *name, const char *value) {
+    Stream  *s = arg;
+    Request *r = s->request;
+
+    /* Trailers after the response and refused streams are only decoded */
+    if (!r || s->refused) {
+        return 0;
+    }
+
+    if (streq(name, ":method")) {
+        if (!r->method && !(r->method = strdup(value)))
+            return -1;
+    } else if (streq(name, ":path")) {
+        if (r->uri)
+            return 0;
+
+        const char *query = strchr(value, '?');
+        r->uri   = query ? strndup(value, query - value) : strdup(value);
+        r->query = strdup(query ? query + 1 : "");
+        if (!r->uri || !r->query)
+            return -1;
+    } else if (streq(name, ":authority")) {
+        return request_add_header(r, "Host", value);
+    } else if (name[0] != ':') {
+        return request_add_header(r, name, value);
+    }
+
+    return 0;
+}
+
+/**
+ * Append DATA payload to stream's request body.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * Bytes beyond BodyLimit are only counted, since the handlers refuse such a
+ * body by its length before reading any of it.
+ **/
+static int h2_upload(Stream *s, const uint8_t *payload, size_t length) {
+    s->uploaded += length;
+    if (s->uploaded > (size_t)BodyLimit) {
+        return 0;
+    }
+
+    if (!s->upload && !(s->upload = tmpfile())) {
+        return -1;
+    }
+    return fwrite(payload, 1, length, s->upload) == length ? 0 : -1;
+}
+
+/**
+ * Capture response bytes written by a handler.
+ *
+ * The first H2_RESPONSE_BUFFER bytes are kept in memory and anything after
+ * them goes to a temporary file, except that the write completing the head
+ * is kept whole so h2_respond finds the entire head in memory.
+ **/
+static ssize_t h2_capture(void *cookie, const char *data, size_t size) {
+    Stream *s     = cookie;
+    bool    spill = s->file || (s->length + size > H2_RESPONSE_BUFFER &&
+                                (s->length >= H2_RESPONSE_BUFFER || h2_head_length(s->response, s->length) < s->length));
+
+    if (!spill) {
+        if (s->length + size > s->capacity) {
+            size_t capacity = s->capacity ? s->capacity : BUFSIZ;
+            while (capacity < s->length + size) {
+                capacity *= 2;
+            }
+
+            char *response = realloc(s->response, capacity);
+            if (!response) {
+                return 0;
+            }
+            s->response = response;
+            s->capacity = capacity;
+        }
+
+        memcpy(s->response + s->length, data, size);
+        s->length += size;
+        return size;
+    }
+
+    if (!s->file && !(s->file = tmpfile())) {
+        return 0;
+    }
+    if (fwrite(data, 1, size, s->file) != size) {
+        return 0;
+    }
+    s->filelength += size;
+    return size;
+}
+
+/**
+ * Find length of response head (CGI scripts may use bare \n).
+ *
+ * @return  Offset of body (or length if the head is not complete).
+ **/
+static size_t h2_head_length(const char *response, size_t length) {
+    const char *end = response + length;
+    for (const char *p = response; length && (p = memchr(p, '\n', end - p)); p++) {
+        if (p + 1 < end && p[1] == '\n') {
+            return p + 2 - response;
+        }
+        if (p + 2 < end && p[1] == '\r' && p[2] == '\n') {
+            return p + 3 - response;
+        }
+    }
+    return length;
+}
+
+/**
+ * Dispatch stream request and send response headers.
+ *
+ * The spooled request body is handed to the handler as if it had arrived
+ * with a Content-Length (see request_recv).  The HTTP/1 response written by
+ * the handler is captured with h2_capture (or, for files, left in the file
+ * it opened), its status line and headers are re-encoded as an HTTP/2
+ * HEADERS frame, and the remaining body is left for h2_send_data.
+ **/
+static void h2_respond(Connection *c, Stream *s) {
+    Request *r = s->request;
+    s->request = NULL;
+
+    if (!r->method || !r->uri) {
+        free_request(r);
+        h2_reset(c, s, H2_PROTOCOL_ERROR);
+        return;
+    }
+
+    /* Hand spooled request body to handler */
+    if (s->uploaded) {
+        const char *declared = request_header(r, HEADER_CONTENT_LENGTH);
+        char        length[32];
+        snprintf(length, sizeof(length), "%zu", s->uploaded);
+        if (declared && !streq(declared, length)) {
+            free_request(r);
+            h2_reset(c, s, H2_PROTOCOL_ERROR);
+            return;
+        }
+        if ((!declared && request_add_header(r, "Content-Length", length) < 0) || (s->upload && fflush(s->upload) != 0)) {
+            free_request(r);
+            h2_reset(c, s, H2_INTERNAL_ERROR);
+            return;
+        }
+
+        if (s->upload) {
+            rewind(s->upload);
+        }
+        r->upload    = s->upload;
+        r->remaining = s->uploaded;
+        s->upload    = NULL;
+    }
+
+    /* Capture response of regular handler */
+    r->stream = fopencookie(s, "w", (cookie_io_functions_t){.write = h2_capture});
+    if (!r->stream) {
+        free_request(r);
+        h2_reset(c, s, H2_INTERNAL_ERROR);
+        return;
+    }
+
+    debug("HTTP/2 stream %u: %s %s", s->id, r->method, r->uri);
+    dispatch_request(r);
+    forking_release();
+    bool captured = fclose(r->stream) == 0;
+    r->stream = NULL;
+
+    /* Send body of file response from the file itself */
+    if (r->payload) {
+        struct stat st;
+        if (!s->file && fstat(fileno(r->payload), &st) == 0) {
+            s->file       = r->payload;
+            s->filelength = st.st_size;
+            r->payload    = NULL;
+        } else {
+            captured = false;
+        }
+    }
+    free_request(r);
+
+    if (!captured || (s->file && fflush(s->file) != 0)) {
+        h2_reset(c, s, H2_INTERNAL_ERROR);
+        return;
+    }
+
+    char *head = s->response;
+    char *end  = s->response + s->length;
+    char *body = s->response + h2_head_length(s->response, s->length);
+
+    /* Encode fields after room reserved for :status, which may come last */
+    size_t   size   = 2 * (body - head) + 64;
+    uint8_t *block  = malloc(size);
+    size_t   offset = 16;
+    size_t   length = offset;
+    char    *status = "200";
+    if (!block) {
+        h2_reset(c, s, H2_INTERNAL_ERROR);
+        return;
+    }
+
+    for (char *line = head, *next; line < body; line = next) {
+        char *eol = memchr(line, '\n', body - line);
+        next = eol + 1;
+        if (eol > line && eol[-1] == '\r') {
+            eol--;
+        }
+        *eol = '\0';
+
+        if (line == head && strncmp(line, "HTTP/", 5) == 0) {
+            status = skip_whitespace(skip_nonwhitespace(line));
+            status[strspn(status, "0123456789")] = '\0';
+            continue;
+        }
+
+        char *value = strchr(line, ':');
+        if (!value) {
+            continue;
+        }
+        *value++ = '\0';
+        value = skip_whitespace(value);
+        for (char *n = line; *n; n++) {
+            *n = tolower((unsigned char)*n);
+        }
+
+        if (streq(line, "status")) {
+            status = value;
+            status[strspn(status, "0123456789")] = '\0';
+        } else if (!streq(line, "connection") && !streq(line, "keep-alive") &&
+                   !streq(line, "transfer-encoding") && !streq(line, "upgrade") &&
+                   !streq(line, "content-length")) {
+            /* Connection-specific fields are not allowed in HTTP/2 */
+            length += hpack_encode(block + length, size - length, line, value);
+        }
+    }
+
+    char content_length[32];
+    snprintf(content_length, sizeof(content_length), "%zu", (size_t)(end - body) + s->filelength);
+    length += hpack_encode(block + length, size - length, "content-length", content_length);
+
+    uint8_t prefix[16];
+    size_t  prefixlen = hpack_encode(prefix, sizeof(prefix), ":status", status);
+    offset -= prefixlen;
+    memcpy(block + offset, prefix, prefixlen);
+
+    /* Send HEADERS (and CONTINUATION) frames */
+    bool empty = body == end && !s->filelength;
+    for (size_t sent = offset; sent < length; ) {
+        size_t  n     = length - sent > c->max_frame ? c->max_frame : length - sent;
+        uint8_t flags = (sent + n == length) ? H2_FLAG_END_HEADERS : 0;
+        if (sent == offset && empty) {
+            flags |= H2_FLAG_END_STREAM;
+        }
+        h2_write_frame(c, sent == offset ? H2_HEADERS : H2_CONTINUATION, flags, s->id, block + sent, n);
+        sent += n;
+    }
+    free(block);
+
+    s->sent = body - s->response;
+    if (empty) {
+        h2_stream_close(c, s);
+    }
+}
+
+/**
+ * Send next DATA frame of every stream with a response, within windows.
+ *
+ * @return  Whether or not any frame was sent.
+ **/
+static bool h2_send_data(Connection *c) {
+    bool progress = false;
+
+    for (Stream *s = c->streams, *next; s && c->window > 0; s = next) {
+        next = s->next;
+        if (s->request || s->block || s->window <= 0) {
+            continue;
+        }
+
+        size_t total = s->length + s->filelength;
+        size_t n     = total - s->sent;
+        if (n > c->max_frame)
+            n = c->max_frame;
+        if ((int64_t)n > s->window)
+            n = s->window;
+        if ((int64_t)n > c->window)
+            n = c->window;
+
+        /* Finish captured part first, then read the rest from its file */
+        const void *data = s->response + s->sent;
+        if (s->sent < s->length && s->sent + n > s->length) {
+            n = s->length - s->sent;
+        } else if (s->sent >= s->length) {
+            if (pread(fileno(s->file), c->data, n, s->sent - s->length) != (ssize_t)n) {
+                debug("HTTP/2 stream %u: unable to read response body", s->id);
+                h2_reset(c, s, H2_INTERNAL_ERROR);
+                progress = true;
+                continue;
+            }
+            data = c->data;
+        }
+
+        bool last = s->sent + n == total;
+        h2_write_frame(c, H2_DATA, last ? H2_FLAG_END_STREAM : 0, s->id, data, n);
+        s->sent   += n;
+        s->window -= n;
+        c->window -= n;
+        progress   = true;
+
+        if (last) {
+            h2_stream_close(c, s);
+        }
+    }
+
+    return progress;
+}
+
+/**
+ * Find open stream by identifier.
+ **/
+static Stream * h2_stream_find(Connection *c, uint32_t id) {
+    for (Stream *s = c->streams; s; s = s->next) {
+        if (s->id == id) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Open stream and append it to the connection.
+ *
+ * Streams beyond H2_MAX_STREAMS are still opened so their header block keeps
+ * the HPACK state in sync, but are refused once it has been decoded.
+ **/
+static Stream * h2_stream_open(Connection *c, uint32_t id) {
+    Stream  *s = calloc(1, sizeof(Stream));
+    Request *r = calloc(1, sizeof(Request));
+    if (!s || !r) {
+        free(s);
+        free(r);
+        return NULL;
+    }
+
+    r->fd = -1;
+    strcpy(r->host, c->r->host);
+    strcpy(r->port, c->r->port);
+
+    s->id      = id;
+    s->window  = c->initial_window;
+    s->request = r;
+    s->refused = c->nstreams >= H2_MAX_STREAMS;
+
+    Stream **tail = &c->streams;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = s;
+    c->nstreams++;
+    return s;
+}
+
+/**
+ * Remove stream from connection and deallocate it.
+ **/
+static void h2_stream_close(Connection *c, Stream *s) {
+    for (Stream **curr = &c->streams; *curr; curr = &(*curr)->next) {
+        if (*curr == s) {
+            *curr = s->next;
+            c->nstreams--;
+            break;
+        }
+    }
+
+    free_request(s->request);
+    free(s->block);
+    free(s->response);
+    if (s->upload) {
+        fclose(s->upload);
+    }
+    if (s->file) {
+        fclose(s->file);
+    }
+    free(s);
+}
+
+/**
+ * Decode base64url string (as used by the HTTP2-Settings header).
+ *
+ * @return  Number of bytes decoded (invalid characters end decoding).
+ **/
+static size_t h2_base64url_decode(const char *s, uint8_t *out, size_t size) {
+    static const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint32_t bits   = 0;
+    int      nbits  = 0;
+    size_t   length = 0;
+
+    for (; s && *s && *s != '='; s++) {
+        const char *c = strchr(alphabet, *s);
+        if (!c) {
+            break;
+        }
+
+        bits   = (bits << 6) | (c - alphabet);
+        nbits += 6;
+        if (nbits >= 8 && length < size) {
+            nbits -= 8;
+            out[length++] = bits >> nbits;
+        }
+    }
+
+    return length;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,359 @@
+/* inline.c: Inline Response Store */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+/* Constants */
+#define INLINE_BASIS	2166136261u     /* FNV-1a offset basis */
+#define INLINE_PROBES	8               /* Slots examined per lookup */
+#define INLINE_HEAD	(CACHE_MIMETYPE + 64)  /* Room for serialized headers */
+#define INLINE_RECHECK	1000            /* Milliseconds a checked entry is trusted without stat */
+
+/* Stored response */
+typedef struct {
+    uint32_t sequence;                  /* Seqlock sequence (odd while slot is written) */
+    uint32_t hash;                      /* Hash of key (0 if slot is empty) */
+    uint32_t referenced;                /* Clock bit (set by hits, cleared by eviction sweeps) */
+    uint32_t length;                    /* Bytes of response (headers and body) */
+    uint32_t mode;                      /* Mode of file */
+    uint64_t checked;                   /* Monotonic milliseconds file was last compared */
+    uint64_t device;                    /* Device of file */
+    uint64_t inode;                     /* Inode of file */
+    int64_t  size;                      /* Size of file */
+    int64_t  mtime;                     /* Modification time of file in nanoseconds */
+    int64_t  ctime;                     /* Status change time of file in nanoseconds */
+    char     key[CACHE_KEY];            /* Request URI */
+    char     path[CACHE_PATH];          /* Real path of URI */
+    char     mimetype[CACHE_MIMETYPE];  /* Mimetype of file */
+    char     response[];                /* Headers after the status line, then body */
+} InlineSlot;
+
+/* Global Variables */
+static uint8_t    *Inline         = NULL;  /* Shared slots (NULL if disabled) */
+static size_t      InlineMask     = 0;     /* Number of slots - 1 */
+static size_t      InlineSlotSize = 0;     /* Bytes per slot */
+static InlineSlot *InlineCopy     = NULL;  /* Slot copied out by the last lookup (per process) */
+
+/* Internal Declarations */
+static bool inline_check(InlineSlot *slot, uint32_t sequence, uint64_t now);
+static void inline_write(InlineSlot *slot, const InlineSlot *entry);
+
+/**
+ * Hash URI with 32-bit FNV-1a (never 0, which marks an empty slot).
+ **/
+static inline uint32_t inline_hash(const char *s) {
+    uint32_t hash = INLINE_BASIS;
+    for (; *s; s++) {
+        hash = (hash ^ (unsigned char)*s) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * Return slot of hash.
+ **/
+static inline InlineSlot *inline_slot(uint32_t hash) {
+    return (InlineSlot *)(Inline + (hash & InlineMask) * InlineSlotSize);
+}
+
+/**
+ * Map inline response store.
+ *
+ * Each slot holds one complete response of a file of up to InlineLimit bytes
+ * (capped at CACHE_BODY), and as many slots as fit in InlineBudget bytes (a
+ * power of two) are mapped shared before any process forks, like the shared
+ * cache.  Slots are only backed by memory once they are used.
+ **/
+void inline_init(void) {
+    if (InlineLimit <= 0 || InlineBudget <= 0) {
+        return;
+    }
+    if (InlineLimit > CACHE_BODY) {
+        InlineLimit = CACHE_BODY;
+    }
+
+    InlineSlotSize = (sizeof(InlineSlot) + INLINE_HEAD + InlineLimit + 63) & ~(size_t)63;
+    if (InlineSlotSize > (size_t)InlineBudget) {
+        log("Inline budget of %ld bytes holds no response of up to %ld bytes", InlineBudget, InlineLimit);
+        return;
+    }
+
+    size_t nslots = 1;
+    while (2 * nslots * InlineSlotSize <= (size_t)InlineBudget) {
+        nslots <<= 1;
+    }
+
+    InlineCopy = malloc(InlineSlotSize);
+    Inline     = mmap(NULL, nslots * InlineSlotSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (!InlineCopy || Inline == MAP_FAILED) {
+        log("Unable to mmap inline store: %s", strerror(errno));
+        free(InlineCopy);
+        Inline = NULL;
+        return;
+    }
+
+    InlineMask = nslots - 1;
+    debug("InlineEntries   = %zu of %zu bytes (files up to %ld bytes)", nslots, InlineSlotSize, InlineLimit);
+}
+
+/**
+ * Look up stored response of URI.
+ *
+ * @param   uri         Request URI.
+ * @param   length      Length of stored response.
+ * @return  Stored response (NULL if none), valid until the next lookup.
+ *
+ * Slots are copied out under their seqlock the same way cache_lookup reads
+ * the shared cache.  An entry checked within the last INLINE_RECHECK
+ * milliseconds is returned without touching the file; otherwise the file is
+ * stat'd once, and if its size, mode, mtime, ctime or inode changed the
+ * response is built again from the new contents (see inline_check).
+ **/
+const char *inline_lookup(const char *uri, size_t *length) {
+    if (!Inline) {
+        return NULL;
+    }
+
+    uint32_t hash = inline_hash(uri);
+    uint64_t now  = timer_now();
+    for (size_t i = 0; i < INLINE_PROBES; i++) {
+        InlineSlot *slot     = inline_slot(hash + i);
+        uint32_t    sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if ((sequence & 1) || __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash) {
+            continue;
+        }
+
+        memcpy(InlineCopy, slot, offsetof(InlineSlot, response));
+        if (InlineCopy->length <= InlineSlotSize - sizeof(InlineSlot)) {
+            memcpy(InlineCopy->response, slot->response, InlineCopy->length);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence ||
+            strncmp(InlineCopy->key, uri, CACHE_KEY) != 0) {
+            continue;
+        }
+
+        if (now - InlineCopy->checked >= INLINE_RECHECK && !inline_check(slot, sequence, now)) {
+            break;
+        }
+
+        __atomic_store_n(&slot->referenced, 1, __ATOMIC_RELAXED);
+        stats_add(inline_hits, 1);
+        *length = InlineCopy->length;
+        return InlineCopy->response;
+    }
+
+    stats_add(inline_misses, 1);
+    return NULL;
+}
+
+/**
+ * Store complete response of small file.
+ *
+ * @param   entry       Cache entry holding key, path, mimetype and whole body.
+ * @param   s           Status of file taken before its body was read.
+ * @return  Whether or not the response was stored.
+ *
+ * Slots are chosen and evicted the same way cache_store does, but entries do
+ * not expire; they are replaced when their file changes.
+ **/
+bool inline_store(const CacheEntry *entry, const struct stat *s) {
+    if (!Inline || entry->length < 0 || entry->length > InlineLimit || entry->length != s->st_size ||
+        strlen(entry->key) >= CACHE_KEY - 1 || strlen(entry->path) >= CACHE_PATH - 1) {
+        return false;
+    }
+
+    /* Serialize response into the process's copy */
+    InlineSlot *copy = InlineCopy;
+    snprintf(copy->key, sizeof(copy->key), "%s", entry->key);
+    snprintf(copy->path, sizeof(copy->path), "%s", entry->path);
+    snprintf(copy->mimetype, sizeof(copy->mimetype), "%s", entry->mimetype);
+    copy->hash       = inline_hash(copy->key);
+    copy->referenced = 0;
+    copy->checked    = timer_now();
+    copy->device     = s->st_dev;
+    copy->inode      = s->st_ino;
+    copy->size       = s->st_size;
+    copy->mtime      = s->st_mtim.tv_sec * 1000000000LL + s->st_mtim.tv_nsec;
+    copy->ctime      = s->st_ctim.tv_sec * 1000000000LL + s->st_ctim.tv_nsec;
+    copy->mode       = s->st_mode;
+
+    int head = snprintf(copy->response, INLINE_HEAD, "Content-Type: %s\r\nContent-Length: %lld\r\n\r\n", copy->mimetype, (long long)entry->length);
+    if (head < 0 || head >= INLINE_HEAD) {
+        return false;
+    }
+    memcpy(copy->response + head, entry->body, entry->length);
+    copy->length = head + entry->length;
+
+    /* Prefer the key's own slot, then a free slot */
+    InlineSlot *victim = NULL;
+    for (size_t i = 0; i < INLINE_PROBES; i++) {
+        InlineSlot *slot = inline_slot(copy->hash + i);
+        uint32_t    hash = __atomic_load_n(&slot->hash, __ATOMIC_RELAXED);
+        if (hash == copy->hash && strncmp(slot->key, copy->key, CACHE_KEY) == 0) {
+            victim = slot;
+            break;
+        }
+        if (!victim && hash == 0) {
+            victim = slot;
+        }
+    }
+
+    /* Otherwise evict with a clock sweep over the window */
+    if (!victim) {
+        for (size_t i = 0; i < INLINE_PROBES && !victim; i++) {
+            InlineSlot *slot = inline_slot(copy->hash + i);
+            if (!__atomic_exchange_n(&slot->referenced, 0, __ATOMIC_RELAXED)) {
+                victim = slot;
+            }
+        }
+        if (!victim) {
+            victim = inline_slot(copy->hash);
+        }
+    }
+
+    inline_write(victim, copy);
+    return true;
+}
+
+/**
+ * Send stored response with a single write.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   response    Stored response (see inline_lookup).
+ * @param   length      Length of stored response.
+ * @return  Status of the HTTP file request.
+ *
+ * Only the status line (which depends on the client's version and whether
+ * the connection is kept alive) is formatted per request; it goes out in one
+ * writev with the stored headers and body.  HTTP/2 streams and OpenSSL
+ * connections write through the request stream instead.
+ **/
+Status inline_serve(Request *r, const char *response, size_t length) {
+    debug("Handling Inline Request");
+    char   status[64];
+    size_t nstatus = format_status(r, "200 OK", true, status, sizeof(status));
+    struct iovec iov[] = {
+        {.iov_base = status, .iov_len = nstatus},
+        {.iov_base = (void *)response, .iov_len = length},
+    };
+
+    if (!request_zerocopy(r)) {
+        fwrite(iov[0].iov_base, 1, iov[0].iov_len, r->stream);
+        fwrite(iov[1].iov_base, 1, iov[1].iov_len, r->stream);
+        fflush(r->stream);
+        return HTTP_STATUS_OK;
+    }
+
+    fflush(r->stream);
+    for (int i = 0; i < 2; ) {
+        ssize_t nwritten = writev(r->fd, iov + i, 2 - i);
+        if (nwritten < 0) {
+            if (!request_timedout(r) && errno == EINTR) {
+                continue;
+            }
+            debug("writev failed: %s", strerror(errno));
+            r->keepalive = false;
+            break;
+        }
+
+        /* Advance past what was written */
+        while (i < 2 && (size_t)nwritten >= iov[i].iov_len) {
+            nwritten -= iov[i++].iov_len;
+        }
+        if (i < 2) {
+            iov[i].iov_base  = (char *)iov[i].iov_base + nwritten;
+            iov[i].iov_len  -= nwritten;
+        }
+    }
+
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Compare copied entry with its file, rebuilding it if the file changed.
+ *
+ * @param   slot        Slot the entry was copied from.
+ * @param   sequence    Sequence of slot when it was copied.
+ * @param   now         Current monotonic milliseconds.
+ * @return  Whether or not the copy (in InlineCopy) is current.
+ *
+ * A file that is gone, no longer small enough, or no longer one the file
+ * handler would serve (a readable, non-executable regular file) empties the
+ * slot, so the request falls through to the regular handlers.  Comparing the
+ * mode and ctime catches a chmod, which leaves the contents and mtime alone.
+ **/
+static bool inline_check(InlineSlot *slot, uint32_t sequence, uint64_t now) {
+    InlineSlot *copy = InlineCopy;
+    struct stat s;
+    if (stat(copy->path, &s) == 0 && (uint64_t)s.st_dev == copy->device && (uint64_t)s.st_ino == copy->inode &&
+        s.st_size == copy->size && s.st_mode == copy->mode &&
+        s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec == copy->mtime &&
+        s.st_ctim.tv_sec * 1000000000LL + s.st_ctim.tv_nsec == copy->ctime) {
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence) {
+            __atomic_store_n(&slot->checked, now, __ATOMIC_RELAXED);
+        }
+        return true;
+    }
+
+    /* Read changed file whole (status taken before reading, as stored) */
+    CacheEntry entry;
+    bool       current = false;
+    int        fd = open(copy->path, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &s) == 0 && S_ISREG(s.st_mode) && s.st_size <= InlineLimit &&
+        access(copy->path, R_OK) == 0 && access(copy->path, X_OK) != 0 &&
+        read(fd, entry.body, s.st_size) == s.st_size) {
+        snprintf(entry.key, sizeof(entry.key), "%s", copy->key);
+        snprintf(entry.path, sizeof(entry.path), "%s", copy->path);
+        snprintf(entry.mimetype, sizeof(entry.mimetype), "%s", copy->mimetype);
+        entry.length = s.st_size;
+        current      = inline_store(&entry, &s);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (current) {
+        stats_add(inline_refreshes, 1);
+        debug("Refreshed inline response of %s", copy->key);
+    } else {
+        InlineSlot empty = {0};
+        inline_write(slot, &empty);
+    }
+    return current;
+}
+
+/**
+ * Write entry into slot under its seqlock (skipped if another process holds it).
+ *
+ * The entries and bytes gauges follow what the slot held and now holds.
+ **/
+static void inline_write(InlineSlot *slot, const InlineSlot *entry) {
+    uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    if ((sequence & 1) || !__atomic_compare_exchange_n(&slot->sequence, &sequence, sequence + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (slot->hash) {
+        stats_add(inline_entries, -1);
+        stats_add(inline_bytes, -(size_t)slot->length);
+    }
+    if (entry->hash) {
+        stats_add(inline_entries, 1);
+        stats_add(inline_bytes, entry->length);
+    }
+
+    size_t length = offsetof(InlineSlot, response) + (entry->hash ? entry->length : 0);
+    memcpy((char *)slot + sizeof(slot->sequence), (const char *)entry + sizeof(entry->sequence), length - sizeof(entry->sequence));
+    __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,199 @@
+/* pack.c: Memory-Mapped Site Pack */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* Constants */
+
+#define PACK_BASIS	2166136261u     /* FNV-1a offset basis (bucket hash seed) */
+#define PACK_NONE	0xFFFFFFFFu     /* Empty slot */
+
+/* Global Variables */
+static const uint8_t    *Pack      = NULL;  /* Mapped pack file */
+static const PackHeader *PackHead  = NULL;  /* Pack header */
+static const uint32_t   *PackDisplacements = NULL;
+static const uint32_t   *PackSlots = NULL;
+static const PackEntry  *PackEntries = NULL;
+
+/**
+ * Hash URI with 32-bit FNV-1a starting from seed.
+ **/
+static inline uint32_t pack_hash(uint32_t seed, const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        seed = (seed ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return seed;
+}
+
+/**
+ * Map site pack and validate its tables.
+ *
+ * @param   path        Path to pack file built by bin/pack.py.
+ * @return  Whether or not the pack is usable.
+ *
+ * The pack consists of a PackHeader, the displacement of each hash bucket,
+ * the entry index of each slot, the PackEntry array, and then the URIs and
+ * precomputed responses.  Every offset is checked here once so lookups can
+ * trust the tables.
+ **/
+bool pack_open(const char *path) {
+    struct stat s;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &s) < 0) {
+        log("Unable to open pack %s: %s", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    size_t size = s.st_size;
+    const uint8_t *pack = size >= sizeof(PackHeader) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (pack == MAP_FAILED) {
+        log("Unable to mmap pack %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    const PackHeader *head = (const PackHeader *)pack;
+    size_t tables = sizeof(PackHeader) + sizeof(uint32_t) * ((size_t)head->nbuckets + head->nslots);
+    tables = (tables + 7) & ~(size_t)7;
+    if (memcmp(head->magic, PACK_MAGIC, sizeof(head->magic)) != 0 || head->version != PACK_VERSION ||
+        head->size != size || !head->nbuckets || !head->nslots ||
+        tables + sizeof(PackEntry) * (size_t)head->nentries > size) {
+        log("Invalid pack %s", path);
+        munmap((void *)pack, size);
+        return false;
+    }
+
+    const uint32_t  *slots   = (const uint32_t *)(pack + sizeof(PackHeader)) + head->nbuckets;
+    const PackEntry *entries = (const PackEntry *)(pack + tables);
+    for (uint32_t i = 0; i < head->nslots; i++) {
+        if (slots[i] != PACK_NONE && slots[i] >= head->nentries) {
+            log("Invalid pack %s: slot %u", path, i);
+            munmap((void *)pack, size);
+            return false;
+        }
+    }
+
+    /* Compare each term against what is left, so offsets cannot wrap around */
+    for (uint32_t i = 0; i < head->nentries; i++) {
+        bool valid = entries[i].uri <= size && entries[i].urilen <= size - entries[i].uri;
+        for (int v = 0; v < PACK_NVARIANTS; v++) {
+            const PackVariant *variant = &entries[i].variants[v];
+            valid = valid && variant->offset <= size && variant->head <= size - variant->offset &&
+                    variant->length <= size - variant->offset - variant->head;
+        }
+        if (!valid) {
+            log("Invalid pack %s: entry %u", path, i);
+            munmap((void *)pack, size);
+            return false;
+        }
+    }
+
+    Pack              = pack;
+    PackHead          = head;
+    PackDisplacements = (const uint32_t *)(pack + sizeof(PackHeader));
+    PackSlots         = slots;
+    PackEntries       = entries;
+
+    debug("PackPath        = %s (%u entries)", path, head->nentries);
+    return true;
+}
+
+/**
+ * Lookup pack entry of URI.
+ *
+ * @param   uri         URI to lookup.
+ * @param   length      Length of URI.
+ * @return  Pack entry (or NULL if the pack does not contain the URI).
+ *
+ * The first hash selects a bucket, whose displacement seeds a second hash
+ * that is unique within the pack, so a lookup is two hashes and one memcmp.
+ **/
+const PackEntry *pack_lookup(const char *uri, size_t length) {
+    if (!Pack) {
+        return NULL;
+    }
+
+    uint32_t bucket = pack_hash(PACK_BASIS, uri, length) % PackHead->nbuckets;
+    uint32_t slot   = pack_hash(PackDisplacements[bucket], uri, length) % PackHead->nslots;
+    uint32_t index  = PackSlots[slot];
+    if (index == PACK_NONE) {
+        return NULL;
+    }
+
+    const PackEntry *entry = &PackEntries[index];
+    if (entry->urilen != length || memcmp(Pack + entry->uri, uri, length) != 0) {
+        return NULL;
+    }
+
+    return entry;
+}
+
+/**
+ * Answer request from site pack.
+ *
+ * @param   r           HTTP Request structure (method and uri set).
+ * @param   entry       Pack entry of request URI (from pack_lookup).
+ * @return  Status of the HTTP pack request.
+ *
+ * The status line depends on the request (version and keep-alive), but the
+ * precomputed headers and body are contiguous in the mapping, so the whole
+ * response goes out with one writev straight from the page cache.  Requests
+ * whose socket needs more than that (HTTP/2 streams and connections encrypted
+ * by OpenSSL) are copied to the response stream.
+ **/
+Status pack_serve(Request *r, const PackEntry *entry) {
+    /* Prefer gzip variant when the client accepts it */
+    const char        *encoding = request_header(r, HEADER_ACCEPT_ENCODING);
+    const PackVariant *variant  = &entry->variants[PACK_IDENTITY];
+    if (encoding && strstr(encoding, "gzip") && entry->variants[PACK_GZIP].head) {
+        variant = &entry->variants[PACK_GZIP];
+    }
+
+    debug("Handling Pack Request");
+    char   status[64];
+    size_t nstatus = format_status(r, "200 OK", true, status, sizeof(status));
+    struct iovec iov[] = {
+        {.iov_base = status, .iov_len = nstatus},
+        {.iov_base = (void *)(Pack + variant->offset), .iov_len = variant->head + variant->length},
+    };
+
+    if (!request_zerocopy(r)) {
+        fwrite(iov[0].iov_base, 1, iov[0].iov_len, r->stream);
+        fwrite(iov[1].iov_base, 1, iov[1].iov_len, r->stream);
+        return HTTP_STATUS_OK;
+    }
+
+    fflush(r->stream);
+    for (int i = 0; i < 2; ) {
+        ssize_t nwritten = writev(r->fd, iov + i, 2 - i);
+        if (nwritten < 0) {
+            if (!request_timedout(r) && errno == EINTR) {
+                continue;
+            }
+            debug("writev failed: %s", strerror(errno));
+            r->keepalive = false;
+            break;
+        }
+
+        /* Advance past what was written */
+        while (i < 2 && (size_t)nwritten >= iov[i].iov_len) {
+            nwritten -= iov[i++].iov_len;
+        }
+        if (i < 2) {
+            iov[i].iov_base  = (char *)iov[i].iov_base + nwritten;
+            iov[i].iov_len  -= nwritten;
+        }
+    }
+
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,208 @@
+/* plugin.c: Handler Plugins */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+#define PLUGIN_MAX	64		/* Plugins loaded at once */
+#define PLUGIN_DEPTH	16		/* Directories nftw keeps open while scanning */
+
+typedef struct {
+    char         *prefix;               /* URI prefix routed to plugin (NULL if found under RootPath) */
+    char         *path;                 /* Path of shared object (real path once loaded) */
+    const Plugin *plugin;               /* Loaded interface (NULL until loaded) */
+} PluginEntry;
+
+/* Global Variables */
+static PluginEntry Plugins[PLUGIN_MAX];
+static size_t      NPlugins = 0;
+
+/* Internal Declarations */
+static const Plugin *plugin_load(const char *path);
+static int plugin_scan(const char *path, const struct stat *s, int type, struct FTW *ftw);
+
+/**
+ * Register plugin for URI prefix.
+ *
+ * @param   spec        prefix=path of shared object (e.g. /api=plugins/api.so).
+ * @return  Whether or not spec was valid.
+ *
+ * The plugin is loaded by plugin_init, once RootPath is known.
+ **/
+bool plugin_register(const char *spec) {
+    const char *equals = strchr(spec, '=');
+    if (spec[0] != '/' || !equals || !equals[1] || NPlugins == PLUGIN_MAX) {
+        return false;
+    }
+
+    Plugins[NPlugins].prefix = strndup(spec, equals - spec);
+    Plugins[NPlugins].path   = strdup(equals + 1);
+    if (!Plugins[NPlugins].prefix || !Plugins[NPlugins].path) {
+        return false;
+    }
+    NPlugins++;
+    return true;
+}
+
+/**
+ * Load registered plugins and every plugin under RootPath.
+ *
+ * @return  Whether or not every registered plugin was loaded.
+ *
+ * This runs in the parent before any process forks, so each shared object is
+ * opened once and every child and shard inherits it already initialized.
+ * Plugins under RootPath are executable files named *.so, the same files that
+ * would otherwise be run as CGI scripts.
+ **/
+bool plugin_init(void) {
+    for (size_t i = 0; i < NPlugins; i++) {
+        char real[PATH_MAX];
+        if (!realpath(Plugins[i].path, real) || !(Plugins[i].plugin = plugin_load(real))) {
+            log("Unable to load plugin %s for %s", Plugins[i].path, Plugins[i].prefix);
+            return false;
+        }
+        free(Plugins[i].path);
+        Plugins[i].path = strdup(real);
+        debug("Plugin          = %s for %s", Plugins[i].path, Plugins[i].prefix);
+    }
+
+    size_t registered = NPlugins;
+    if (nftw(RootPath, plugin_scan, PLUGIN_DEPTH, FTW_PHYS) < 0) {
+        log("Unable to scan %s for plugins: %s", RootPath, strerror(errno));
+    }
+    if (NPlugins > 0) {
+        log("Loaded %zu plugins (%zu registered, %zu under %s)", NPlugins, registered, NPlugins - registered, RootPath);
+    }
+    return true;
+}
+
+/**
+ * Determine if path names a plugin (rather than a CGI script).
+ **/
+bool plugin_path(const char *path) {
+    size_t length = strlen(path);
+    size_t suffix = strlen(PLUGIN_SUFFIX);
+    return length > suffix && streq(path + length - suffix, PLUGIN_SUFFIX);
+}
+
+/**
+ * Find plugin registered for URI.
+ *
+ * @param   uri         Request URI (without query).
+ * @return  Plugin of the longest matching prefix (or NULL if none).
+ *
+ * A prefix matches the URI itself and anything below it, so /api routes /api
+ * and /api/users but not /apiary.
+ **/
+const Plugin *plugin_route(const char *uri) {
+    const PluginEntry *best   = NULL;
+    size_t             longest = 0;
+
+    for (size_t i = 0; i < NPlugins; i++) {
+        const char *prefix = Plugins[i].prefix;
+        if (!prefix) {
+            continue;
+        }
+
+        size_t length = strlen(prefix);
+        if (length > longest && strncmp(uri, prefix, length) == 0 &&
+            (uri[length] == '\0' || uri[length] == '/' || prefix[length - 1] == '/')) {
+            best    = &Plugins[i];
+            longest = length;
+        }
+    }
+
+    return best ? best->plugin : NULL;
+}
+
+/**
+ * Find plugin of shared object under RootPath.
+ *
+ * @param   path        Real path of shared object.
+ * @return  Loaded plugin (or NULL if it cannot be loaded).
+ *
+ * Plugins added after startup are loaded on first use, and stay loaded for
+ * the lifetime of the process that loaded them.
+ **/
+const Plugin *plugin_find(const char *path) {
+    for (size_t i = 0; i < NPlugins; i++) {
+        if (!Plugins[i].prefix && streq(Plugins[i].path, path)) {
+            return Plugins[i].plugin;
+        }
+    }
+
+    const Plugin *plugin = plugin_load(path);
+    if (plugin && NPlugins < PLUGIN_MAX && (Plugins[NPlugins].path = strdup(path))) {
+        Plugins[NPlugins].prefix = NULL;
+        Plugins[NPlugins].plugin = plugin;
+        NPlugins++;
+    }
+    return plugin;
+}
+
+/**
+ * Open shared object and initialize its plugin.
+ *
+ * @param   path        Path of shared object.
+ * @return  Plugin interface (or NULL on error).
+ *
+ * Symbols are resolved immediately so a plugin with missing symbols is
+ * rejected here rather than in the middle of a request.
+ **/
+static const Plugin *plugin_load(const char *path) {
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        log("Unable to dlopen %s: %s", path, dlerror());
+        return NULL;
+    }
+
+    const Plugin *plugin = dlsym(handle, PLUGIN_SYMBOL);
+    if (!plugin || plugin->version != PLUGIN_VERSION || !plugin->handle) {
+        log("%s is not a version %d plugin", path, PLUGIN_VERSION);
+        dlclose(handle);
+        return NULL;
+    }
+
+    if (plugin->init && !plugin->init()) {
+        log("Plugin %s failed to initialize", plugin->name ? plugin->name : path);
+        dlclose(handle);
+        return NULL;
+    }
+
+    debug("Loaded plugin %s from %s", plugin->name ? plugin->name : "(unnamed)", path);
+    return plugin;
+}
+
+/**
+ * Load plugin found while scanning RootPath.
+ **/
+static int plugin_scan(const char *path, const struct stat *s, int type, struct FTW *ftw) {
+    if (type != FTW_F || !S_ISREG(s->st_mode) || !plugin_path(path) || access(path, R_OK | X_OK) != 0) {
+        return 0;
+    }
+    if (NPlugins == PLUGIN_MAX) {
+        log("Too many plugins; %s is loaded on first use", path);
+        return 0;
+    }
+
+    char real[PATH_MAX];
+    const Plugin *plugin = realpath(path, real) ? plugin_load(real) : NULL;
+    if (plugin && (Plugins[NPlugins].path = strdup(real))) {
+        Plugins[NPlugins].prefix = NULL;
+        Plugins[NPlugins].plugin = plugin;
+        NPlugins++;
+    }
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,17 +1,41 @@
 /* request.c: HTTP Request Functions */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+/* Constants */
+#define REQUEST_MAX_LINES   128         /* Maximum number of lines in request head */
+#define REQUEST_SPLICE      (1 << 16)   /* Maximum bytes moved by one splice */
+#define REQUEST_PROXY_V1    107         /* Longest PROXY protocol version 1 header */
+
 Request * accept_request(int sfd);
 void free_request(Request *r);
 int parse_request(Request *r);
-int parse_request_method(Request *r);
-int parse_request_headers(Request *r);
+int parse_request_head(Request *r, size_t *lines, size_t *nlines);
+int parse_request_method(Request *r, char *line, size_t length);
+int parse_request_headers(Request *r, size_t *lines, size_t n);
+int parse_request_body(Request *r);
+int request_line(Request *r, char **line);
+int request_chunk_size(Request *r);
+int parse_request_proxy(Request *r);
+int request_wait(Request *r);
+ssize_t request_recv(Request *r, void *data, size_t size);
+void request_expire(Timer *t, void *arg);
 
 /**
  * Accept request from server socket.
@@ -24,16 +48,20 @@ int parse_request_headers(Request *r);
  *  1. Allocates a request struct initialized to 0.
  *  2. Initializes the headers list in the request struct.
  *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
+ *  4. Looks up the client information and stores it in the request struct
+ *     (for Unix domain sockets, the peer's credentials until a PROXY
+ *     header names the real client, see parse_request_proxy).
+ *  5. Opens the client socket stream for the request struct (secure
+ *     connections open theirs after the TLS handshake, see tls_accept;
+ *     Unix domain sockets are always plain, the proxy terminates TLS).
  *  6. Returns the request struct.
  *
  * The returned request struct must be deallocated using free_request.
  **/
 Request * accept_request(int sfd) {
     // Initializing socket struct
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
 
     /* Allocate request struct (zeroed) */
     Request *r = calloc(1, sizeof(Request));
@@ -43,28 +71,58 @@ Request * accept_request(int sfd) {
     }
 
     /* Accept a client */
-    r->fd = accept(sfd, &raddr, &rlen);
+    trace_start(r);
+    trace_begin(r, accept);
+    r->fd = accept(sfd, (struct sockaddr *)&raddr, &rlen);
+    trace_end(r, accept);
     if (r->fd < 0){
         debug("Unable to accept: %s", strerror(errno));
         goto fail;
     }
 
     /* Lookup client information */
-    int status = getnameinfo(&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV);
-    if (status < 0){
-        debug("Unable to getnameinfo: %s", gai_strerror(status));
-        goto fail;
+    trace_begin(r, getnameinfo);
+    r->local = raddr.ss_family == AF_UNIX;
+    if (r->local) {
+        struct ucred cred;
+        socklen_t    clen = sizeof(cred);
+        if (getsockopt(r->fd, SOL_SOCKET, SO_PEERCRED, &cred, &clen) < 0) {
+            debug("Unable to get peer credentials: %s", strerror(errno));
+            goto fail;
+        }
+        snprintf(r->host, sizeof(r->host), "uid %u", (unsigned)cred.uid);
+        snprintf(r->port, sizeof(r->port), "%d", (int)cred.pid);
+    } else {
+        int status = getnameinfo((struct sockaddr *)&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV);
+        if (status != 0){
+            debug("Unable to getnameinfo: %s", gai_strerror(status));
+            goto fail;
+        }
     }
+    trace_end(r, getnameinfo);
 
     /* Open socket stream */
-    r->stream = fdopen(r->fd, "w+");
-    if (!r->stream){
+    bool secure = CertificatePath && !r->local;
+    r->stream = secure ? NULL : fdopen(r->fd, "w");
+    if (!r->stream && !secure){
         debug("Unable to fdopen: %s", strerror(errno));
         goto fail;        
     }
 
+    /* Start request deadlines */
+    r->deadline.callback = request_expire;
+    r->deadline.arg      = r;
+    r->expiry.callback   = request_expire;
+    r->expiry.arg        = r;
+    if (RequestTimeout > 0) {
+        timer_add(&Timers, &r->expiry, RequestTimeout);
+    }
+    request_phase(r, TIMEOUT_IDLE);
+
     // Successful request!
+    stats_add(accepted, 1);
     log("Accepted request from %s:%s", r->host, r->port);
+    trace_commit(r);
     return r;
 
 fail:
@@ -80,7 +138,8 @@ fail:
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
+ *  1. Closes the request socket stream, any TLS session, and the file
+ *     descriptor.
  *  2. Frees all allocated strings in request struct.
  *  3. Frees all of the headers (including any allocated fields).
  *  4. Frees request struct.
@@ -91,12 +150,25 @@ void free_request(Request *r) {
     	return;
     }
 
-    /* Close socket or fd */
+    /* Cancel pending deadlines and write trace of request */
+    timer_cancel(&Timers, &r->deadline);
+    timer_cancel(&Timers, &r->expiry);
+    trace_finish(r);
+
+    /* Close socket or fd (a TLS stream leaves the socket open for close_notify) */
+    bool owned = r->stream && !r->tls;
     if (r->stream)
         fclose(r->stream);
-    else if (r->fd >= 0)
+    tls_close(r);
+    if (!owned && r->fd >= 0)
         close(r->fd);
 
+    /* Close request and response body files of HTTP/2 stream */
+    if (r->upload)
+        fclose(r->upload);
+    if (r->payload)
+        fclose(r->payload);
+
     /* Free allocated strings */
     free(r->method);
     free(r->uri);
@@ -104,44 +176,299 @@ void free_request(Request *r) {
     free(r->query);
 
     /* Free headers */
-    Header *next;
-    Header *curr = r->headers;
-    while(curr) {
-        next = curr->next;
-        free(curr->name);
-        free(curr->data);
-
-        free(curr);
+    for (size_t i = 0; i < HEADER_NKNOWN; i++) {
+        free(r->known[i]);
+    }
 
-        curr = next;
+    for (size_t i = 0; i < r->nheaders; i++) {
+        free(r->headers[i].name);
+        free(r->headers[i].data);
     }
+    free(r->headers);
 
     /* Free request */
     free(r);
 }
 
+/**
+ * Prepare request structure for the next request on a persistent connection.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * The response is flushed, everything parsed from the previous request is
+ * released, and any pipelined bytes are moved to the front of the buffer.
+ * The request deadline restarts and the connection goes back to idle.
+ **/
+int request_reset(Request *r) {
+    if (fflush(r->stream) != 0) {
+        return -1;
+    }
+    trace_finish(r);
+
+    /* Free allocated strings */
+    free(r->method);
+    free(r->uri);
+    free(r->path);
+    free(r->query);
+    r->method = r->uri = r->path = r->query = NULL;
+
+    /* Free headers (keeping the unknown headers array) */
+    for (size_t i = 0; i < HEADER_NKNOWN; i++) {
+        free(r->known[i]);
+        r->known[i] = NULL;
+    }
+
+    for (size_t i = 0; i < r->nheaders; i++) {
+        free(r->headers[i].name);
+        free(r->headers[i].data);
+    }
+    r->nheaders = 0;
+
+    /* Keep pipelined bytes */
+    memmove(r->buffer, r->buffer + r->consumed, r->buffered - r->consumed);
+    r->buffered -= r->consumed;
+    r->consumed  = 0;
+
+    r->version   = 0;
+    r->keepalive = false;
+    r->chunked   = false;
+    r->remaining = 0;
+    r->received  = 0;
+    r->timeout   = TIMEOUT_NONE;
+    r->served++;
+    trace_start(r);
+
+    /* Restart request deadlines */
+    if (RequestTimeout > 0) {
+        timer_add(&Timers, &r->expiry, RequestTimeout);
+    }
+    request_phase(r, TIMEOUT_IDLE);
+    return 0;
+}
+
 /**
  * Parse HTTP Request.
  *
  * @param   r           Request structure.
  * @return  -1 on error and 0 on success.
  *
- * This function first parses the request method, any query, and then the
- * headers, returning 0 on success, and -1 on error.
+ * This function first reads the request head (request line and headers) into
+ * the request buffer, then parses the request method, any query, the headers,
+ * and how the body is framed, returning 0 on success, and -1 on error.  The
+ * body itself is left for request_body.
  **/
 int parse_request(Request *r) {
+    size_t lines[REQUEST_MAX_LINES + 1];
+    size_t nlines;
+
+    /* Read PROXY header of a connection relayed over a Unix domain socket */
+    if (r->local && !r->served && parse_request_proxy(r) == -1) {
+        debug("Read proxy header fail");
+        return -1;
+    }
+
+    /* Read HTTP Request Head */
+    if (parse_request_head(r, lines, &nlines) == -1) {
+        debug("Read head fail");
+        return -1;
+    }
+    capture_request(r, r->buffer + lines[0], r->consumed - lines[0]);
+
     /* Parse HTTP Request Method */
-    if (parse_request_method(r) == -1) {
+    if (parse_request_method(r, r->buffer + lines[0], lines[1] - lines[0]) == -1) {
         debug("Parse method fail");
         return -1;
     }
 
     /* Parse HTTP Requet Headers*/
-    if (parse_request_headers(r) == -1) {
+    if (parse_request_headers(r, lines + 1, nlines - 1) == -1) {
         debug("Parse headers fail");
         return -1;
     }
 
+    /* Parse HTTP Request Body framing */
+    if (parse_request_body(r) == -1) {
+        debug("Parse body fail");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Read HTTP Request Head.
+ *
+ * @param   r           Request structure.
+ * @param   lines       Array to store offset of the start of each line.
+ * @param   nlines      Pointer to store number of lines (excluding the blank
+ * line); lines[nlines] is the offset of the blank line.
+ * @return  -1 on error and 0 on success.
+ *
+ * This receives from the client socket into the request buffer until the
+ * blank line terminating the head arrives, using the vectorized scanner to
+ * find line ends.  Any bytes after the head stay buffered (r->consumed marks
+ * the end of the head).
+ **/
+int parse_request_head(Request *r, size_t *lines, size_t *nlines) {
+    size_t scanned = r->consumed;
+    size_t start   = r->consumed;
+
+    /* Wait for request to arrive and then start header deadline */
+    if (r->buffered == r->consumed && request_wait(r) < 0) {
+        return -1;
+    }
+    request_phase(r, TIMEOUT_HEADER);
+
+    *nlines = 0;
+    while (true) {
+        /* Find line ends in newly received bytes */
+        while (scanned < r->buffered) {
+            size_t eol = scanned + scan_delimiter(r->buffer + scanned, r->buffered - scanned, "\n");
+            if (eol == r->buffered) {
+                scanned = eol;
+                break;
+            }
+
+            size_t length = eol - start;
+            if (length == 0 || (length == 1 && r->buffer[start] == '\r')) {
+                /* Ignore empty lines before request line (RFC 7230 3.5) */
+                if (*nlines == 0) {
+                    start = scanned = eol + 1;
+                    continue;
+                }
+
+                lines[*nlines] = start;
+                r->consumed    = eol + 1;
+                return 0;
+            }
+
+            if (*nlines == REQUEST_MAX_LINES) {
+                debug("Too many header lines");
+                return -1;
+            }
+
+            lines[(*nlines)++] = start;
+            start = scanned = eol + 1;
+        }
+
+        /* Receive more of the head */
+        if (r->buffered == sizeof(r->buffer)) {
+            debug("Request head too large");
+            return -1;
+        }
+
+        ssize_t nread = request_recv(r, r->buffer + r->buffered, sizeof(r->buffer) - r->buffered);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            if (nread < 0) {
+                request_timedout(r);
+            }
+            return -1;
+        }
+        r->buffered += nread;
+    }
+}
+
+/**
+ * Read PROXY protocol header (version 1 or 2) if the connection starts with one.
+ *
+ * @param   r           Request structure (Unix domain socket, first request).
+ * @return  -1 on error and 0 on success (with or without a header).
+ *
+ * A reverse proxy on the same host may prefix the connection with the address
+ * of the client it relays, which then replaces the peer credentials in host
+ * and port.  Only Unix domain connections are checked, since only local
+ * processes can reach them.  Bytes are received only while they still match
+ * a header signature, so a plain request is never waited on, and the header
+ * is consumed before the request head is parsed.
+ **/
+int parse_request_proxy(Request *r) {
+    static const char v1[] = "PROXY ";
+    static const char v2[] = "\r\n\r\n\0\r\nQUIT\n";
+
+    if (r->buffered == r->consumed && request_wait(r) < 0) {
+        return -1;
+    }
+    request_phase(r, TIMEOUT_HEADER);
+
+    while (true) {
+        char  *data   = r->buffer + r->consumed;
+        size_t length = r->buffered - r->consumed;
+
+        if (length > 0 && data[0] == v1[0]) {
+            /* PROXY TCP4|TCP6|UNKNOWN source destination sport dport\r\n */
+            if (memcmp(data, v1, length < sizeof(v1) - 1 ? length : sizeof(v1) - 1) != 0) {
+                return 0;
+            }
+
+            char *eol = memchr(data, '\n', length < REQUEST_PROXY_V1 ? length : REQUEST_PROXY_V1);
+            if (eol) {
+                char     protocol[8], source[INET6_ADDRSTRLEN], destination[INET6_ADDRSTRLEN];
+                unsigned sport, dport;
+                *eol = '\0';
+                if (sscanf(data, "PROXY %7s %45s %45s %u %u", protocol, source, destination, &sport, &dport) == 5 &&
+                    (streq(protocol, "TCP4") || streq(protocol, "TCP6"))) {
+                    snprintf(r->host, sizeof(r->host), "%s", source);
+                    snprintf(r->port, sizeof(r->port), "%u", sport);
+                } else if (strncmp(data, "PROXY UNKNOWN", 13) != 0) {
+                    debug("Invalid PROXY header");
+                    return -1;
+                }
+                r->consumed += eol + 1 - data;
+                break;
+            }
+            if (length >= REQUEST_PROXY_V1) {
+                debug("PROXY header too long");
+                return -1;
+            }
+        } else if (length > 0 && data[0] == v2[0]) {
+            /* Signature, version and command, family, length, addresses */
+            if (memcmp(data, v2, length < sizeof(v2) - 1 ? length : sizeof(v2) - 1) != 0) {
+                return 0;
+            }
+
+            if (length >= 16) {
+                size_t         size   = 16 + (((uint8_t)data[14] << 8) | (uint8_t)data[15]);
+                const uint8_t *header = (const uint8_t *)data;
+                if ((header[12] >> 4) != 2 || size > sizeof(r->buffer)) {
+                    debug("Invalid PROXY header");
+                    return -1;
+                }
+
+                if (length >= size) {
+                    if ((header[12] & 0xf) == 1 && header[13] == 0x11 && size >= 16 + 12) {
+                        inet_ntop(AF_INET, header + 16, r->host, sizeof(r->host));
+                        snprintf(r->port, sizeof(r->port), "%u", (header[24] << 8) | header[25]);
+                    } else if ((header[12] & 0xf) == 1 && header[13] == 0x21 && size >= 16 + 36) {
+                        inet_ntop(AF_INET6, header + 16, r->host, sizeof(r->host));
+                        snprintf(r->port, sizeof(r->port), "%u", (header[48] << 8) | header[49]);
+                    }
+                    r->consumed += size;
+                    break;
+                }
+            }
+        } else if (length > 0) {
+            return 0;
+        }
+
+        /* Receive more of the header */
+        ssize_t nread = request_recv(r, r->buffer + r->buffered, sizeof(r->buffer) - r->buffered);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            if (nread < 0) {
+                request_timedout(r);
+            }
+            return -1;
+        }
+        r->buffered += nread;
+    }
+
+    debug("Proxied request from %s:%s", r->host, r->port);
     return 0;
 }
 
@@ -149,6 +476,8 @@ int parse_request(Request *r) {
  * Parse HTTP Request Method and URI.
  *
  * @param   r           Request structure.
+ * @param   line        Request line (terminated by \n).
+ * @param   length      Length of request line.
  * @return  -1 on error and 0 on success.
  *
  * HTTP Requests come in the form
@@ -160,40 +489,55 @@ int parse_request(Request *r) {
  *  GET / HTTP/1.1
  *  GET /cgi.script?q=foo HTTP/1.0
  *
- * This function extracts the method, uri, and query (if it exists).
+ * This function extracts the method, uri, query (if it exists), and version.
  **/
-int parse_request_method(Request *r) {
-    char buffer[BUFSIZ];
-    char *method = NULL;
-    char *uri = NULL;
-    char *query = NULL;
-
-    /* Read line from socket */
-    fgets(buffer, BUFSIZ, r->stream);
-
-    /* Parse method and uri */
-    method = strtok(buffer, WHITESPACE);
-    uri    = strtok(NULL, WHITESPACE);
-    if (!method || !uri) {
+int parse_request_method(Request *r, char *line, size_t length) {
+    /* Parse method (must be a token followed by a space) */
+    size_t mlength = scan_token(line, length);
+    if (mlength == 0 || line[mlength] != ' ') {
+        return -1;
+    }
+
+    /* Parse uri (up to next whitespace) */
+    char  *uri     = line + mlength + 1;
+    size_t ulength = scan_delimiter(uri, length - mlength - 1, " \t\r\n");
+    if (ulength == 0) {
         return -1;
     }
 
+    /* Parse version (defaults to HTTP/1.0 when absent or malformed) */
+    char  *protocol = uri + ulength;
+    char  *end      = line + length;
+    while (protocol < end && (*protocol == ' ' || *protocol == '\t'))
+        protocol++;
+    r->version = 10;
+    if (end - protocol >= 8 && strncmp(protocol, "HTTP/", 5) == 0 &&
+        isdigit(protocol[5]) && protocol[6] == '.' && isdigit(protocol[7])) {
+        r->version = (protocol[5] - '0') * 10 + (protocol[7] - '0');
+    }
+
     /* Parse query from uri */
-    query = strchr(uri, '?');
-    if (!query)
-        query = "";
-    else
-        *query++ = '\0';
-   
+    char  *query   = memchr(uri, '?', ulength);
+    size_t qlength = 0;
+    if (query) {
+        qlength = uri + ulength - query - 1;
+        ulength = query - uri;
+        query++;
+    }
+
     /* Record method, uri, and query in request struct */
-    r->method = strdup(method);
-    r->uri    = strdup(uri);
-    r->query = strdup(query);
+    r->method = strndup(line, mlength);
+    r->uri    = strndup(uri, ulength);
+    r->query  = query ? strndup(query, qlength) : strdup("");
+    if (!r->method || !r->uri || !r->query) {
+        return -1;
+    }
 
     // Debugging
     debug("HTTP METHOD: %s", r->method);
     debug("HTTP URI:    %s", r->uri);
     debug("HTTP QUERY:  %s", r->query);
+    debug("HTTP VERSION: %u.%u", r->version / 10, r->version % 10);
 
     return 0;
 }
@@ -202,6 +546,9 @@ int parse_request_method(Request *r) {
  * Parse HTTP Request Headers.
  *
  * @param   r           Request structure.
+ * @param   lines       Offsets of header lines in request buffer (lines[n] is
+ * the offset of the terminating blank line).
+ * @param   n           Number of header lines.
  * @return  -1 on error and 0 on success.
  *
  * HTTP Headers come in the form:
@@ -217,55 +564,540 @@ int parse_request_method(Request *r) {
  *  Accept-Encoding: gzip, deflate
  *  Connection: keep-alive
  *
- * This function parses the stream from the request socket using the following
+ * This function parses the lines of the request head using the following
  * pseudo-code:
  *
- *  while (buffer = read_from_socket() and buffer is not empty):
- *      name, data  = buffer.split(':')
- *      header      = new Header(name, data)
- *      headers.append(header)
+ *  for line in lines:
+ *      name, data  = line.split(':')
+ *      if name is well-known:
+ *          known[header_lookup(name)] = data
+ *      else:
+ *          headers.append(Header(name, data))
+ *
+ * Names must consist entirely of token characters.  Repeated well-known
+ * headers are combined into one comma separated value (semicolon separated
+ * for Cookie).
  **/
-int parse_request_headers(Request *r) {
-    Header *curr = NULL;
-    char buffer[BUFSIZ];
-    char *name;
-    char *data;
-
-    /* Parse headers from socket */
-    while (fgets(buffer, BUFSIZ, r->stream) && strlen(buffer) > 2){
-        // Getting header info
-        chomp(buffer);
-        name = skip_whitespace(buffer);
-        data = strchr(name, ':');
-       
-        if (!data) {
-            debug("!data triggered in parse_request_headers: name:%s, data:%s", name, data);
+int parse_request_headers(Request *r, size_t *lines, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        char  *name   = r->buffer + lines[i];
+        char  *end    = r->buffer + lines[i + 1] - 1;
+        size_t length = scan_token(name, end - name);
+
+        if (length == 0 || name[length] != ':') {
+            debug("Invalid header line: %.*s", (int)(end - name), name);
             return -1;
         }
-        
-        // Advancing pointer and stuff to .split the line
-        *data++ = '\0';
-        data = skip_whitespace(data);
-
-        // Allocating Header
-        curr = malloc(sizeof(Header));
-        if (!curr)
-            return -1;
 
-        // Setting header and appending it
-        curr->name = strdup(name);
-        curr->data = strdup(data);
-        curr->next = r->headers;
-        r->headers = curr;
-    }
+        // Splitting name and data, then trimming whitespace around data
+        char *data = name + length + 1;
+        name[length] = '\0';
+        while (data < end && (*data == ' ' || *data == '\t'))
+            data++;
+        while (end > data && isspace(end[-1]))
+            end--;
+        *end = '\0';
 
+        if (request_add_header(r, name, data) < 0)
+            return -1;
+    }
 
 #ifndef NDEBUG
-    for (Header *header = r->headers; header; header = header->next) {
-    	debug("HTTP HEADER %s = %s", header->name, header->data);
+    for (HeaderId id = 0; id < HEADER_NKNOWN; id++) {
+        if (r->known[id])
+            debug("HTTP HEADER %s = %s", header_name(id), r->known[id]);
+    }
+    for (size_t i = 0; i < r->nheaders; i++) {
+    	debug("HTTP HEADER %s = %s", r->headers[i].name, r->headers[i].data);
     }
 #endif
     return 0;
 }
 
+/**
+ * Parse HTTP Request Body framing.
+ *
+ * @param   r           Request structure (headers parsed).
+ * @return  -1 on error and 0 on success.
+ *
+ * A body is either delimited by Content-Length or sent with chunked
+ * Transfer-Encoding.  Other transfer codings are not supported, and a request
+ * with both headers is rejected rather than guessing which one an upstream
+ * proxy honored (RFC 7230 3.3.3).
+ **/
+int parse_request_body(Request *r) {
+    const char *length   = request_header(r, HEADER_CONTENT_LENGTH);
+    const char *encoding = request_header(r, HEADER_TRANSFER_ENCODING);
+
+    if (encoding) {
+        if (length || strcasecmp(encoding, "chunked") != 0) {
+            debug("Unsupported body framing: %s", encoding);
+            return -1;
+        }
+        r->chunked = true;
+        return 0;
+    }
+
+    if (length) {
+        char *end;
+        errno = 0;
+        unsigned long long value = strtoull(length, &end, 10);
+        if (!isdigit(*length) || *end || errno || value > SSIZE_MAX) {
+            debug("Invalid Content-Length: %s", length);
+            return -1;
+        }
+        r->remaining = value;
+    }
+
+    return 0;
+}
+
+/**
+ * Record request header.
+ *
+ * @param   r           Request structure.
+ * @param   name        Header name.
+ * @param   data        Header data.
+ * @return  -1 on error and 0 on success.
+ *
+ * Well-known headers are stored by HeaderId for constant time lookup, while
+ * the rest are appended to the unknown headers array.
+ **/
+int request_add_header(Request *r, const char *name, const char *data) {
+    HeaderId id = header_lookup(name, strlen(name));
+
+    if (id != HEADER_UNKNOWN) {
+        char *value = NULL;
+        if (r->known[id]) {
+            const char *separator = (id == HEADER_COOKIE) ? "; " : ", ";
+            if (asprintf(&value, "%s%s%s", r->known[id], separator, data) < 0)
+                return -1;
+        } else if (!(value = strdup(data))) {
+            return -1;
+        }
+
+        free(r->known[id]);
+        r->known[id] = value;
+        return 0;
+    }
+
+    if (r->nheaders == r->capacity) {
+        size_t  capacity = r->capacity ? 2 * r->capacity : 8;
+        Header *headers  = realloc(r->headers, capacity * sizeof(Header));
+        if (!headers)
+            return -1;
+
+        r->headers  = headers;
+        r->capacity = capacity;
+    }
+
+    Header *header = &r->headers[r->nheaders];
+    header->name = strdup(name);
+    header->data = strdup(data);
+    if (!header->name || !header->data) {
+        free(header->name);
+        free(header->data);
+        return -1;
+    }
+
+    r->nheaders++;
+    return 0;
+}
+
+/**
+ * Return data of well-known request header.
+ *
+ * @param   r           Request structure.
+ * @param   id          HeaderId of well-known header.
+ * @return  Header data (or NULL if header was not sent).
+ **/
+const char * request_header(Request *r, HeaderId id) {
+    return id < HEADER_NKNOWN ? r->known[id] : NULL;
+}
+
+/**
+ * Read bytes sent by client after the request head.
+ *
+ * @param   r           Request structure.
+ * @param   data        Buffer to read into.
+ * @param   size        Maximum number of bytes to read.
+ * @return  Number of bytes read (0 on end of stream), or -1 on error.
+ *
+ * Bytes already received into the request buffer are returned first, then
+ * the socket is read directly.
+ **/
+ssize_t request_read(Request *r, void *data, size_t size) {
+    if (r->consumed < r->buffered) {
+        size_t n = r->buffered - r->consumed;
+        if (n > size)
+            n = size;
+        memcpy(data, r->buffer + r->consumed, n);
+        r->consumed += n;
+        return n;
+    }
+
+    ssize_t nread;
+    do {
+        nread = request_recv(r, data, size);
+    } while (nread < 0 && errno == EINTR);
+
+    if (nread < 0)
+        request_timedout(r);
+    return nread;
+}
+
+/**
+ * Receive bytes from client socket.
+ *
+ * @param   r           Request structure.
+ * @param   data        Buffer to receive into.
+ * @param   size        Maximum number of bytes to receive.
+ * @return  Number of bytes received (0 on end of stream), or -1 on error.
+ *
+ * Secure connections are decrypted by OpenSSL unless the kernel already does.
+ * HTTP/2 streams have no socket of their own and receive their spooled
+ * request body instead.
+ **/
+ssize_t request_recv(Request *r, void *data, size_t size) {
+    if (r->upload) {
+        size_t nread = fread(data, 1, size, r->upload);
+        return ferror(r->upload) ? -1 : (ssize_t)nread;
+    }
+    if (r->tls && !r->ktls_recv) {
+        return tls_recv(r, data, size);
+    }
+    return recv(r->fd, data, size, 0);
+}
+
+/**
+ * Determine if received bytes are waiting to be read without the socket.
+ **/
+bool request_pending(Request *r) {
+    return r->consumed < r->buffered || tls_pending(r);
+}
+
+/**
+ * Determine if bytes written straight to the client socket (with writev,
+ * sendfile, or splice) reach the client as they are.
+ *
+ * That holds for plain connections and for secure connections whose writes
+ * the kernel encrypts, but not for HTTP/2 streams or OpenSSL encryption.
+ **/
+bool request_zerocopy(Request *r) {
+    return r->fd >= 0 && (!r->tls || r->ktls_send);
+}
+
+/**
+ * Forward request body into pipe (or file).
+ *
+ * @param   r           Request structure.
+ * @param   pfd         Write end of pipe, or a file descriptor of any other
+ * kind, which the body reaches through the request buffer.
+ * @return  Number of body bytes forwarded, or -1 on error (errno is EFBIG if
+ * the body exceeds BodyLimit).
+ *
+ * Body bytes that arrived with the head are written from the request buffer,
+ * and the rest is spliced from the socket into the pipe without passing
+ * through user space (unless OpenSSL decrypts it, in which case it passes
+ * through the request buffer).  Chunked bodies are decoded on the way, so the reader
+ * only sees the payload.  On success the body has been consumed and any
+ * pipelined request remains buffered.
+ **/
+ssize_t request_body(Request *r, int pfd) {
+    size_t      forwarded = 0;
+    struct stat s;
+    bool        spliced   = r->fd >= 0 && !(r->tls && !r->ktls_recv) && fstat(pfd, &s) == 0 && S_ISFIFO(s.st_mode);
+
+    while (r->chunked || r->remaining) {
+        /* Read next chunk size (0 ends the body) */
+        if (!r->remaining && request_chunk_size(r) < 0) {
+            return -1;
+        }
+
+        if (r->received + r->remaining > (size_t)BodyLimit) {
+            debug("Request body exceeds %ld bytes", BodyLimit);
+            errno = EFBIG;
+            return -1;
+        }
+
+        while (r->remaining) {
+            ssize_t nmoved;
+            size_t  nbuffered = r->buffered - r->consumed;
+            if (nbuffered) {
+                nmoved = write(pfd, r->buffer + r->consumed, nbuffered < r->remaining ? nbuffered : r->remaining);
+                if (nmoved > 0) {
+                    r->consumed += nmoved;
+                }
+            } else if (!spliced) {
+                r->buffered = r->consumed = 0;
+                nmoved = request_recv(r, r->buffer, sizeof(r->buffer));
+                if (nmoved > 0) {
+                    r->buffered = nmoved;
+                    continue;
+                }
+                if (nmoved == 0) {
+                    debug("Request body truncated");
+                    return -1;
+                }
+            } else {
+                nmoved = splice(r->fd, NULL, pfd, NULL, r->remaining < REQUEST_SPLICE ? r->remaining : REQUEST_SPLICE, SPLICE_F_MOVE);
+                if (nmoved == 0) {
+                    debug("Request body truncated");
+                    return -1;
+                }
+            }
+
+            if (nmoved < 0) {
+                if (!request_timedout(r) && errno == EINTR) {
+                    continue;
+                }
+                debug("Unable to forward request body: %s", strerror(errno));
+                return -1;
+            }
+
+            r->remaining -= nmoved;
+            r->received  += nmoved;
+            forwarded    += nmoved;
+        }
+
+        /* Chunk data is followed by CRLF */
+        char *line;
+        if (r->chunked && (request_line(r, &line) < 0 || *line)) {
+            debug("Invalid chunk terminator");
+            return -1;
+        }
+    }
+
+    return forwarded;
+}
+
+/**
+ * Read line of request body framing.
+ *
+ * @param   r           Request structure.
+ * @param   line        Pointer to store line (in request buffer, without
+ * CRLF and NUL terminated).
+ * @return  -1 on error and 0 on success.
+ *
+ * The head has already been parsed, so the buffer is compacted to make room
+ * when a line has not fully arrived.
+ **/
+int request_line(Request *r, char **line) {
+    while (true) {
+        char *start = r->buffer + r->consumed;
+        char *eol   = memchr(start, '\n', r->buffered - r->consumed);
+        if (eol) {
+            r->consumed = eol + 1 - r->buffer;
+            if (eol > start && eol[-1] == '\r') {
+                eol--;
+            }
+            *eol  = '\0';
+            *line = start;
+            return 0;
+        }
+
+        memmove(r->buffer, start, r->buffered - r->consumed);
+        r->buffered -= r->consumed;
+        r->consumed  = 0;
+        if (r->buffered == sizeof(r->buffer)) {
+            debug("Request body line too long");
+            return -1;
+        }
+
+        ssize_t nread = request_recv(r, r->buffer + r->buffered, sizeof(r->buffer) - r->buffered);
+        if (nread < 0 && !request_timedout(r) && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return -1;
+        }
+        r->buffered += nread;
+    }
+}
+
+/**
+ * Read size line of next request body chunk.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * Chunk extensions are ignored.  The last chunk's trailer fields are skipped
+ * and end the chunked body.
+ **/
+int request_chunk_size(Request *r) {
+    char *line;
+    char *end;
+
+    if (request_line(r, &line) < 0) {
+        return -1;
+    }
+
+    errno = 0;
+    unsigned long long size = strtoull(line, &end, 16);
+    if (!isxdigit(*line) || (*end && *end != ';' && *end != ' ' && *end != '\t') || errno || size > SSIZE_MAX) {
+        debug("Invalid chunk size: %s", line);
+        return -1;
+    }
+
+    if (size) {
+        r->remaining = size;
+        return 0;
+    }
+
+    /* Skip trailer fields up to the blank line */
+    do {
+        if (request_line(r, &line) < 0) {
+            return -1;
+        }
+    } while (*line);
+
+    r->chunked = false;
+    return 0;
+}
+
+/**
+ * Write chunk of response body with chunked transfer encoding.
+ *
+ * @param   r           Request structure.
+ * @param   data        Chunk data.
+ * @param   size        Size of chunk (0 writes the last chunk).
+ *
+ * Callers coalesce output into reasonably sized chunks; errors surface when
+ * the response stream is flushed.
+ **/
+void request_chunk(Request *r, const void *data, size_t size) {
+    fprintf(r->stream, "%zx\r\n", size);
+    if (size)
+        fwrite(data, 1, size, r->stream);
+    fprintf(r->stream, "\r\n");
+}
+
+/**
+ * Enter request phase and apply its deadline.
+ *
+ * @param   r           Request structure.
+ * @param   phase       Phase the request is entering.
+ *
+ * The idle and header phases arm the deadline timer with IdleTimeout and
+ * HeaderTimeout respectively, while the write phase cancels it.  The socket
+ * receive timeout is then set to whichever of the phase and request deadlines
+ * comes first, and the send timeout to WriteTimeout (capped by the request
+ * deadline), so blocking stream I/O returns once a deadline passes.
+ **/
+void request_phase(Request *r, Timeout phase) {
+    long msecs = 0;
+
+    r->phase = phase;
+    switch (phase) {
+        case TIMEOUT_IDLE:   msecs = IdleTimeout; break;
+        case TIMEOUT_HEADER: msecs = HeaderTimeout; break;
+        default:             break;
+    }
+
+    if (msecs > 0) {
+        timer_add(&Timers, &r->deadline, msecs);
+    } else {
+        timer_cancel(&Timers, &r->deadline);
+    }
+
+    long rcvtimeo = timer_remaining(&r->deadline);
+    long sndtimeo = WriteTimeout;
+    long expiry   = timer_remaining(&r->expiry);
+    if (expiry > 0 && (rcvtimeo <= 0 || expiry < rcvtimeo)) {
+        rcvtimeo = expiry;
+    }
+    if (expiry > 0 && (sndtimeo <= 0 || expiry < sndtimeo)) {
+        sndtimeo = expiry;
+    }
+
+    struct timeval rcvtv = {.tv_sec = rcvtimeo / 1000, .tv_usec = (rcvtimeo % 1000) * 1000};
+    struct timeval sndtv = {.tv_sec = sndtimeo / 1000, .tv_usec = (sndtimeo % 1000) * 1000};
+    setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &rcvtv, sizeof(rcvtv));
+    setsockopt(r->fd, SOL_SOCKET, SO_SNDTIMEO, &sndtv, sizeof(sndtv));
+}
+
+/**
+ * Determine if a failed socket operation was due to an expired deadline.
+ *
+ * @param   r           Request structure.
+ * @return  Whether or not a request deadline has expired.
+ *
+ * This advances the timer wheel so any expired deadlines are recorded.  If
+ * the kernel timed out the operation slightly before the wheel ticked over,
+ * the timeout is attributed to the current phase.
+ **/
+bool request_timedout(Request *r) {
+    int saved = errno;
+
+    timer_advance(&Timers);
+    if (r->timeout == TIMEOUT_NONE && (saved == EAGAIN || saved == EWOULDBLOCK)) {
+        r->timeout = r->phase;
+        stats_add(timeouts[r->phase], 1);
+    }
+
+    if (r->timeout != TIMEOUT_NONE) {
+        debug("Request from %s:%s timed out in phase %d", r->host, r->port, r->timeout);
+    }
+
+    errno = saved;
+    return r->timeout != TIMEOUT_NONE;
+}
+
+/**
+ * Wait for request data to arrive on client socket.
+ *
+ * @param   r           Request structure.
+ * @return  -1 if deadline expired or on error and 0 on success.
+ **/
+int request_wait(Request *r) {
+    if (tls_pending(r)) {
+        return 0;
+    }
+
+    struct pollfd pfd = {.fd = r->fd, .events = POLLIN};
+    long msecs = timer_remaining(&r->deadline);
+    long expiry = timer_remaining(&r->expiry);
+    if (expiry > 0 && (msecs <= 0 || expiry < msecs)) {
+        msecs = expiry;
+    }
+
+    int result;
+    do {
+        /* Give idle persistent connections of a draining server only a
+         * short grace to send their next request */
+        long wait = msecs;
+        if (r->phase == TIMEOUT_IDLE && r->served && restart_draining() && (wait <= 0 || wait > RESTART_GRACE)) {
+            wait = RESTART_GRACE;
+        }
+
+        result = poll(&pfd, 1, wait > 0 ? (int)wait : -1);
+        if (result == 0 && wait != msecs) {
+            debug("Closing idle connection from %s:%s to drain", r->host, r->port);
+            return -1;
+        }
+    } while (result < 0 && errno == EINTR);
+
+    if (result == 0) {
+        errno = EAGAIN;
+        request_timedout(r);
+        return -1;
+    }
+
+    return result < 0 ? -1 : 0;
+}
+
+/**
+ * Record expired request deadline.
+ *
+ * @param   t           Expired timer.
+ * @param   arg         Request structure.
+ **/
+void request_expire(Timer *t, void *arg) {
+    Request *r = arg;
+    if (r->timeout == TIMEOUT_NONE) {
+        r->timeout = (t == &r->expiry) ? TIMEOUT_REQUEST : r->phase;
+        stats_add(timeouts[r->timeout], 1);
+    }
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
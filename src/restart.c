@@ -0,0 +1,386 @@
+/* restart.c: Hot Restart */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+#define RESTART_ENV	"SPIDEY_RESTART"	/* Environment variable with handoff socket of new server */
+#define RESTART_FD	3		/* Handoff socket descriptor in new server */
+#define RESTART_MAX	1024		/* Listeners handed off at once */
+#define RESTART_BATCH	253		/* Listeners per message (the kernel's SCM_MAX_FD) */
+#define RESTART_NAME	128		/* Longest listen address handed off (with NUL) */
+#define RESTART_TIMEOUT	60000		/* Milliseconds new server may take to become ready */
+
+/* Global Variables */
+static char * const          *RestartArguments = NULL;  /* Command line to exec */
+static pid_t                  RestartLeader    = 0;     /* Process that hands off listeners */
+static volatile sig_atomic_t  RestartRequested = 0;     /* Whether SIGUSR2 arrived */
+static bool                   Draining         = false; /* Whether this process stopped accepting */
+static int                    HandoffFd        = -1;    /* Socket to new (or old) server */
+static uint64_t               HandoffStarted   = 0;     /* Monotonic milliseconds handoff began */
+
+static int                    Inherited[RESTART_MAX];   /* Listeners received from old server */
+static char                  *InheritedNames[RESTART_MAX];  /* Listen address of each (allocated) */
+static size_t                 NInherited       = 0;
+
+/* Internal Declarations */
+static bool restart_begin(const int *listeners, size_t nlisteners);
+static void restart_fail(const char *reason);
+
+/**
+ * Record SIGUSR2 (handled by restart_check in the server loops).
+ **/
+static void restart_signal(int signum) {
+    RestartRequested = 1;
+}
+
+/**
+ * Install SIGUSR2 handler and remember how the server was started.
+ *
+ * @param   argv        Command line of server (executed again on restart).
+ *
+ * The handler does not restart interrupted calls, so a server waiting in
+ * poll or waitpid notices the signal right away.  Processes forked later
+ * inherit the handler, where the signal means "drain" instead.
+ **/
+void restart_init(char *argv[]) {
+    RestartArguments = argv;
+    RestartLeader    = getpid();
+
+    struct sigaction action = {.sa_handler = restart_signal};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, NULL);
+}
+
+/**
+ * Receive listeners from the old server (if this process is its restart).
+ *
+ * The old server passes its listening sockets with SCM_RIGHTS, each labeled
+ * with its listen address, so they are taken over by restart_listener instead
+ * of being bound again and connections waiting in their backlogs are kept.
+ * They arrive in messages of at most RESTART_BATCH descriptors, each starting
+ * with a byte that tells whether another message follows.
+ **/
+void restart_inherit(void) {
+    const char *handoff = getenv(RESTART_ENV);
+    if (!handoff) {
+        return;
+    }
+    HandoffFd = atoi(handoff);
+    unsetenv(RESTART_ENV);
+
+    bool more = true;
+    while (more) {
+        char            names[1 + RESTART_BATCH * RESTART_NAME + 1];
+        char            control[CMSG_SPACE(RESTART_BATCH * sizeof(int))];
+        struct iovec    iov = {.iov_base = names, .iov_len = sizeof(names) - 1};
+        struct msghdr   msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+        ssize_t         nread;
+
+        do {
+            nread = recvmsg(HandoffFd, &msg, MSG_CMSG_CLOEXEC);
+        } while (nread < 0 && errno == EINTR);
+
+        if (nread <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            log("Unable to receive listeners from old server");
+            break;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        size_t          nfds = 0;
+        int             fds[RESTART_BATCH];
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+
+        /* Listen addresses are NUL separated, one per descriptor */
+        names[nread] = '\0';
+        more         = names[0];
+        char  *name  = names + 1;
+        size_t i     = 0;
+        for (; i < nfds && name < names + nread && NInherited < RESTART_MAX; i++) {
+            if (!(InheritedNames[NInherited] = strdup(name))) {
+                break;
+            }
+            Inherited[NInherited++] = fds[i];
+            name += strlen(name) + 1;
+        }
+        for (; i < nfds; i++) {
+            close(fds[i]);
+        }
+    }
+    log("Inherited %zu listeners from old server", NInherited);
+}
+
+/**
+ * Take over inherited listener of address.
+ *
+ * @param   address     Listen address (see socket_listen).
+ * @return  Inherited listener (or -1 if none is left for address).
+ *
+ * The old server may hand off several listeners of the same address (one per
+ * shard), which are taken in the order it sent them.
+ **/
+int restart_listener(const char *address) {
+    for (size_t i = 0; i < NInherited; i++) {
+        if (Inherited[i] >= 0 && streq(InheritedNames[i], address)) {
+            int fd = Inherited[i];
+            Inherited[i] = -1;
+            fcntl(fd, F_SETFD, 0);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Tell old server this one is about to accept, and wait for it to let go.
+ *
+ * @return  Whether or not this server may start (false if the old server gave
+ * up on the handoff, so it keeps serving alone).
+ *
+ * Inherited listeners that were not taken (addresses no longer listened on)
+ * are closed here.
+ **/
+bool restart_ready(void) {
+    for (size_t i = 0; i < NInherited; i++) {
+        if (Inherited[i] >= 0) {
+            log("Closing inherited listener %s", InheritedNames[i]);
+            close(Inherited[i]);
+            Inherited[i] = -1;
+        }
+        free(InheritedNames[i]);
+    }
+    NInherited = 0;
+
+    if (HandoffFd < 0) {
+        return true;
+    }
+
+    pid_t   pid = getpid();
+    char    ack = 0;
+    ssize_t nread;
+    bool    ready = write(HandoffFd, &pid, sizeof(pid)) == sizeof(pid);
+    do {
+        nread = ready ? read(HandoffFd, &ack, 1) : -1;
+    } while (nread < 0 && errno == EINTR);
+
+    close(HandoffFd);
+    HandoffFd = -1;
+    return nread == 1;
+}
+
+/**
+ * Start, continue, or finish hot restart.
+ *
+ * @param   listeners   Listeners of this process (shard-major; the listen
+ * address of listener i is Addresses[i % NAddresses]).
+ * @param   nlisteners  Number of listeners.
+ * @param   msecs       Milliseconds to wait for the new server (-1 until it
+ * is ready or RESTART_TIMEOUT passes, 0 to only check).
+ * @return  Whether this process should stop accepting and drain.
+ *
+ * On SIGUSR2 the server that was started (the leader) forks, and the child
+ * forks again and executes the same command line, so the new server picks up
+ * a newly installed binary and is not a child of the old one.  The leader
+ * sends it every listener over a Unix socket pair, keeps serving while it
+ * starts up (loading plugins and warming caches), and stops accepting once
+ * the new server reports that it is ready.  If the new server exits or takes
+ * longer than RESTART_TIMEOUT, the handoff is abandoned and the old server
+ * carries on.  In any other process (shards), SIGUSR2 from the leader means
+ * the handoff completed and it is time to drain.
+ **/
+bool restart_check(const int *listeners, size_t nlisteners, long msecs) {
+    if (Draining) {
+        return true;
+    }
+
+    if (RestartRequested) {
+        RestartRequested = 0;
+        if (getpid() != RestartLeader) {
+            Draining = true;
+            return true;
+        }
+        if (HandoffFd < 0 && !restart_begin(listeners, nlisteners)) {
+            return false;
+        }
+    }
+    if (HandoffFd < 0) {
+        return false;
+    }
+
+    /* Wait for new server to report it is ready */
+    while (true) {
+        long remaining = RESTART_TIMEOUT - (long)(timer_now() - HandoffStarted);
+        if (remaining <= 0) {
+            restart_fail("did not become ready in time");
+            return false;
+        }
+
+        struct pollfd pfd = {.fd = HandoffFd, .events = POLLIN};
+        int result = poll(&pfd, 1, msecs < 0 || msecs > remaining ? remaining : msecs);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result == 0 && msecs >= 0) {
+            return false;
+        }
+        if (result > 0) {
+            break;
+        }
+    }
+
+    pid_t pid;
+    char  ack = 1;
+    if (read(HandoffFd, &pid, sizeof(pid)) != sizeof(pid) || write(HandoffFd, &ack, 1) != 1) {
+        restart_fail("exited before becoming ready");
+        return false;
+    }
+
+    close(HandoffFd);
+    HandoffFd = -1;
+    Draining  = true;
+    log("New server %d is ready; draining", pid);
+    return true;
+}
+
+/**
+ * Return socket to poll for the new server becoming ready (-1 if none).
+ *
+ * Servers that wait in poll add it to their set and call restart_check once
+ * it is readable.
+ **/
+int restart_fd(void) {
+    return getpid() == RestartLeader ? HandoffFd : -1;
+}
+
+/**
+ * Determine if this process is draining (stop keeping connections alive).
+ **/
+bool restart_draining(void) {
+    return Draining || (RestartRequested && getpid() != RestartLeader);
+}
+
+/**
+ * Execute new server and hand it the listeners.
+ *
+ * @return  Whether or not the handoff started.
+ **/
+static bool restart_begin(const int *listeners, size_t nlisteners) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0) {
+        log("Unable to restart: socketpair: %s", strerror(errno));
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* Detach from old server, keep only standard streams and handoff */
+        if (fork() != 0) {
+            _exit(EXIT_SUCCESS);
+        }
+
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        for (int signum = 1; signum < NSIG; signum++) {
+            signal(signum, SIG_DFL);
+        }
+
+        char handoff[16];
+        snprintf(handoff, sizeof(handoff), "%d", RESTART_FD);
+        if (dup2(pair[1], RESTART_FD) < 0 || setenv(RESTART_ENV, handoff, 1) < 0) {
+            _exit(EXIT_FAILURE);
+        }
+        closefrom(RESTART_FD + 1);
+        execvp(RestartArguments[0], RestartArguments);
+        _exit(EXIT_FAILURE);
+    }
+
+    close(pair[1]);
+    if (pid < 0) {
+        log("Unable to restart: fork: %s", strerror(errno));
+        close(pair[0]);
+        return false;
+    }
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+
+    /* Find each distinct listener and its address */
+    int         fds[RESTART_MAX];
+    const char *labels[RESTART_MAX];
+    size_t      nfds = 0;
+    for (size_t i = 0; i < nlisteners && nfds < RESTART_MAX; i++) {
+        bool duplicate = false;
+        for (size_t j = 0; j < nfds && !duplicate; j++) {
+            duplicate = fds[j] == listeners[i];
+        }
+
+        const char *name = Addresses[i % NAddresses];
+        if (duplicate || strlen(name) >= RESTART_NAME) {
+            continue;
+        }
+        labels[nfds] = name;
+        fds[nfds++]  = listeners[i];
+    }
+
+    /* Send them in batches, each listener labeled with its address */
+    HandoffFd      = pair[0];
+    HandoffStarted = timer_now();
+    size_t sent    = 0;
+    do {
+        size_t n      = nfds - sent < RESTART_BATCH ? nfds - sent : RESTART_BATCH;
+        char   names[1 + RESTART_BATCH * RESTART_NAME];
+        size_t nnames = 1;
+        names[0] = sent + n < nfds;
+        for (size_t i = sent; i < sent + n; i++) {
+            size_t length = strlen(labels[i]) + 1;
+            memcpy(names + nnames, labels[i], length);
+            nnames += length;
+        }
+
+        char            control[CMSG_SPACE(RESTART_BATCH * sizeof(int))] = {0};
+        struct iovec    iov = {.iov_base = names, .iov_len = nnames};
+        struct msghdr   msg = {.msg_iov = &iov, .msg_iovlen = 1};
+        if (n) {
+            msg.msg_control    = control;
+            msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type  = SCM_RIGHTS;
+            cmsg->cmsg_len   = CMSG_LEN(n * sizeof(int));
+            memcpy(CMSG_DATA(cmsg), fds + sent, n * sizeof(int));
+        }
+
+        if (sendmsg(HandoffFd, &msg, MSG_NOSIGNAL) < 0) {
+            restart_fail(strerror(errno));
+            return false;
+        }
+        sent += n;
+    } while (sent < nfds);
+
+    log("Restarting: handed %zu listeners to new server", nfds);
+    return true;
+}
+
+/**
+ * Abandon handoff and keep serving.
+ **/
+static void restart_fail(const char *reason) {
+    log("Restart failed: new server %s", reason);
+    close(HandoffFd);
+    HandoffFd = -1;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,230 @@
+/* scan.c: Vectorized Request Scanning */
+
+#include "spidey.h"
+
+#include <string.h>
+
+#include <immintrin.h>
+
+/* Internal Declarations */
+static size_t scan_delimiter_scalar(const char *s, size_t n, const char *set);
+static size_t scan_token_scalar(const char *s, size_t n);
+static size_t scan_delimiter_sse42(const char *s, size_t n, const char *set);
+static size_t scan_token_sse42(const char *s, size_t n);
+static size_t scan_delimiter_avx2(const char *s, size_t n, const char *set);
+static size_t scan_token_avx2(const char *s, size_t n);
+
+/* Global Variables */
+const Scanner Scanners[] = {
+    {"avx2",   scan_delimiter_avx2,   scan_token_avx2},
+    {"sse4.2", scan_delimiter_sse42,  scan_token_sse42},
+    {"scalar", scan_delimiter_scalar, scan_token_scalar},
+    {NULL,     NULL,                  NULL},
+};
+
+const Scanner *Scan = &Scanners[2];     /**< Selected scanner */
+
+/* Token Tables
+ *
+ * HTTP tokens (RFC 7230 tchar) are ALPHA / DIGIT and "!#$%&'*+-.^_`|~".  The
+ * vectorized scanners classify a byte with two 16-entry shuffle lookups: the
+ * high nibble selects one bit (nibbles 2 through 7 only, so anything outside
+ * of 0x20-0x7F is rejected), and the low nibble table has that bit set for
+ * each valid character.
+ */
+static bool    TokenTable[256];
+static uint8_t TokenLow[32]  __attribute__((aligned(32)));
+static uint8_t TokenHigh[32] __attribute__((aligned(32)));
+
+/**
+ * Build token tables and select fastest scanner supported by the CPU.
+ **/
+void scan_init(void) {
+    const char *specials = "!#$%&'*+-.^_`|~";
+
+    for (int c = 0; c < 256; c++) {
+        TokenTable[c] = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                        (c >= 'A' && c <= 'Z') || (c && strchr(specials, c));
+    }
+
+    memset(TokenLow, 0, sizeof(TokenLow));
+    memset(TokenHigh, 0, sizeof(TokenHigh));
+    for (int c = 0x20; c < 0x80; c++) {
+        uint8_t bit = 1 << ((c >> 4) - 2);
+        TokenHigh[c >> 4] = TokenHigh[(c >> 4) + 16] = bit;
+        if (TokenTable[c]) {
+            TokenLow[c & 0xF] |= bit;
+            TokenLow[(c & 0xF) + 16] |= bit;
+        }
+    }
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        Scan = &Scanners[0];
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        Scan = &Scanners[1];
+    } else {
+        Scan = &Scanners[2];
+    }
+
+    debug("Scanner         = %s", Scan->name);
+}
+
+/**
+ * Select scanner by name.
+ *
+ * @param   name        Name of scanner (avx2, sse4.2, or scalar).
+ * @return  Whether or not the scanner exists and is supported by the CPU.
+ **/
+bool scan_select(const char *name) {
+    for (const Scanner *scanner = Scanners; scanner->name; scanner++) {
+        if (streq(scanner->name, name)) {
+            if ((streq(name, "avx2") && !__builtin_cpu_supports("avx2")) ||
+                (streq(name, "sse4.2") && !__builtin_cpu_supports("sse4.2"))) {
+                return false;
+            }
+            Scan = scanner;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Scalar Scanners */
+
+/**
+ * Return offset of first byte of s that is in set (or n if there is none).
+ **/
+static size_t scan_delimiter_scalar(const char *s, size_t n, const char *set) {
+    for (size_t i = 0; i < n; i++) {
+        for (const char *c = set; *c; c++) {
+            if (s[i] == *c) {
+                return i;
+            }
+        }
+    }
+    return n;
+}
+
+/**
+ * Return offset of first byte of s that is not a token character (or n).
+ **/
+static size_t scan_token_scalar(const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (!TokenTable[(unsigned char)s[i]]) {
+            return i;
+        }
+    }
+    return n;
+}
+
+/* SSE4.2 Scanners */
+
+__attribute__((target("sse4.2")))
+static inline size_t scan_delimiter_sse42(const char *s, size_t n, const char *set) {
+    char    needles[16] = {0};
+    int     count = strlen(set);
+    size_t  i = 0;
+
+    /* pcmpestri compares against at most 16 needles */
+    if (count > 16) {
+        return scan_delimiter_scalar(s, n, set);
+    }
+    memcpy(needles, set, count);
+    __m128i set128 = _mm_loadu_si128((const __m128i *)needles);
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(s + i));
+        int index = _mm_cmpestri(set128, count, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (index < 16) {
+            return i + index;
+        }
+    }
+
+    /* Finish with one overlapping load ending at s + n */
+    if (i < n && n >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(s + n - 16));
+        int index = _mm_cmpestri(set128, count, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        return index < 16 ? n - 16 + index : n;
+    }
+
+    return i + scan_delimiter_scalar(s + i, n - i, set);
+}
+
+__attribute__((target("sse4.2")))
+static inline size_t scan_token_sse42(const char *s, size_t n) {
+    const __m128i low  = _mm_load_si128((const __m128i *)TokenLow);
+    const __m128i high = _mm_load_si128((const __m128i *)TokenHigh);
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+
+    while (i < n && n >= 16) {
+        /* Last iteration overlaps the previous one to end exactly at s + n */
+        size_t  offset = i + 16 <= n ? i : n - 16;
+        __m128i chunk  = _mm_loadu_si128((const __m128i *)(s + offset));
+        __m128i lo     = _mm_shuffle_epi8(low, _mm_and_si128(chunk, mask));
+        __m128i hi     = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(chunk, 4), mask));
+        __m128i bad    = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+        unsigned bits  = _mm_movemask_epi8(bad) & (0xFFFFu << (i - offset));
+        if (bits) {
+            return offset + __builtin_ctz(bits);
+        }
+        i = offset + 16;
+    }
+
+    return i + scan_token_scalar(s + i, n - i);
+}
+
+/* AVX2 Scanners */
+
+__attribute__((target("avx2")))
+static size_t scan_delimiter_avx2(const char *s, size_t n, const char *set) {
+    size_t  count = strlen(set);
+    size_t  i = 0;
+
+    /* Sets of up to four delimiters (all the parser uses) repeat the last one */
+    if (count == 0 || count > 4) {
+        return scan_delimiter_sse42(s, n, set);
+    }
+
+    const __m256i d0 = _mm256_set1_epi8(set[0]);
+    const __m256i d1 = _mm256_set1_epi8(set[count > 1 ? 1 : 0]);
+    const __m256i d2 = _mm256_set1_epi8(set[count > 2 ? 2 : 0]);
+    const __m256i d3 = _mm256_set1_epi8(set[count > 3 ? 3 : 0]);
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i found = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, d0), _mm256_cmpeq_epi8(chunk, d1)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, d2), _mm256_cmpeq_epi8(chunk, d3)));
+        unsigned bits = _mm256_movemask_epi8(found);
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+
+    /* Shorter inputs and tails are cheaper with 16 byte vectors */
+    return i + scan_delimiter_sse42(s + i, n - i, set);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_token_avx2(const char *s, size_t n) {
+    const __m256i low  = _mm256_load_si256((const __m256i *)TokenLow);
+    const __m256i high = _mm256_load_si256((const __m256i *)TokenHigh);
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i lo    = _mm256_shuffle_epi8(low, _mm256_and_si256(chunk, mask));
+        __m256i hi    = _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), mask));
+        __m256i bad   = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+        unsigned bits = _mm256_movemask_epi8(bad);
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+
+    return i + scan_token_sse42(s + i, n - i);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
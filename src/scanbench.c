@@ -0,0 +1,137 @@
+/* scanbench.c: Request Scanner Benchmark */
+
+#include "spidey.h"
+
+#include <string.h>
+
+/* Sample Requests
+ *
+ * Request heads captured from desktop and mobile browsers, ranging from about
+ * 500 to 2000 bytes.
+ */
+static const char *Samples[] = {
+    "GET /html/index.html HTTP/1.1\r\n"
+    "Host: localhost:9898\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "\r\n",
+
+    "GET /images/a.png HTTP/1.1\r\n"
+    "Host: spidey.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Referer: https://spidey.example.com/html/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,es;q=0.8\r\n"
+    "Cookie: _ga=GA1.1.1234567890.1697000000; session=eyJ1c2VyIjoicGV0ZXIiLCJyb2xlIjoiYWRtaW4ifQ.ZSxkYw.abcdefghijklmnopqrstuvwxyz012345; theme=dark\r\n"
+    "\r\n",
+
+    "GET /scripts/hello.py?user=peter&lang=en&ref=newsletter HTTP/1.1\r\n"
+    "Host: spidey.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?1\r\n"
+    "sec-ch-ua-platform: \"Android\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (Linux; Android 10; K) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Mobile Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: https://spidey.example.com/scripts/hello.py\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,de;q=0.8,fr;q=0.7\r\n"
+    "Cookie: _ga=GA1.1.1234567890.1697000000; _ga_ABCDEF1234=GS1.1.1697000000.3.1.1697000100.0.0.0; "
+    "session=eyJ1c2VyIjoicGV0ZXIiLCJyb2xlIjoiYWRtaW4iLCJleHAiOjE2OTcwMDAwMDAsImlhdCI6MTY5Njk5OTAwMH0.ZSxkYw.abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ; "
+    "preferences=%7B%22theme%22%3A%22dark%22%2C%22fontSize%22%3A14%2C%22sidebar%22%3Atrue%7D; "
+    "csrftoken=Zm9vYmFyYmF6cXV4cXV1eGNvcmdlZ3JhdWx0Z2FycGx5d2FsZG9mcmVkcGx1Z3h5enp5dGhvcg; "
+    "tracking=1a2b3c4d5e6f7a8b9c0d1e2f3a4b5c6d7e8f9a0b1c2d3e4f5a6b7c8d9e0f1a2b3c4d5e6f7a8b9c0d1e2f\r\n"
+    "If-None-Match: \"5f3e2d1c-4b5a-6978-8a9b-0c1d2e3f4a5b\"\r\n"
+    "If-Modified-Since: Wed, 18 Oct 2023 07:28:00 GMT\r\n"
+    "\r\n",
+};
+
+/**
+ * Scan request head the way parse_request does.
+ *
+ * @param   head        Request head.
+ * @param   length      Length of request head.
+ * @return  Number of header lines found (to defeat dead code elimination).
+ **/
+static size_t scan_head(const char *head, size_t length) {
+    size_t lines = 0;
+    size_t start = 0;
+
+    while (start < length) {
+        size_t eol = start + scan_delimiter(head + start, length - start, "\n");
+        if (lines == 0) {
+            size_t method = scan_token(head, eol);
+            scan_delimiter(head + method + 1, eol - method - 1, " \t\r\n");
+        } else if (eol - start > 1) {
+            size_t name = scan_token(head + start, eol - start);
+            lines += head[start + name] == ':';
+        }
+        lines++;
+        start = eol + 1;
+    }
+
+    return lines;
+}
+
+/**
+ * Benchmark scanner selected by name over all samples.
+ **/
+static void benchmark(const char *name, size_t iterations) {
+    if (!scan_select(name)) {
+        printf("%-8s unsupported\n", name);
+        return;
+    }
+
+    for (size_t s = 0; s < sizeof(Samples) / sizeof(Samples[0]); s++) {
+        size_t   length = strlen(Samples[s]);
+        size_t   total  = 0;
+        uint64_t start  = timer_now();
+
+        for (size_t i = 0; i < iterations; i++) {
+            total += scan_head(Samples[s], length);
+            __asm__ volatile("" : : "r"(total) : "memory");
+        }
+
+        double elapsed = (timer_now() - start) / 1000.0;
+        printf("%-8s %5zu bytes %8.1f ns/request %8.2f GB/s\n", name, length,
+            elapsed * 1e9 / iterations, (double)length * iterations / elapsed / 1e9);
+    }
+}
+
+/**
+ * Benchmark all available scanners.
+ **/
+int main(int argc, char *argv[]) {
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+    scan_init();
+    for (const Scanner *scanner = Scanners; scanner->name; scanner++) {
+        benchmark(scanner->name, iterations);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
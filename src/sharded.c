@@ -0,0 +1,234 @@
+/* sharded.c: Sharded HTTP Server */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+
+#include <linux/filter.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+#define SHARDED_MAX	((BPF_MAXINSNS - 3) / 2)   /* Shards the steering program can map */
+
+/* Internal Declarations */
+static void sharded_steer(int sfd, const int *cpus, long nshards);
+static pid_t sharded_spawn(long shard, int cpu, const int *listeners, size_t nsfds, long nshards);
+static long sharded_divide(long limit, long nshards);
+
+/**
+ * Run one forking server per CPU, each pinned to its CPU with its own
+ * listener.
+ *
+ * @param   sfds        Server socket file descriptors (first shard's listeners).
+ * @param   nsfds       Number of server sockets.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * Every worker binds its own SO_REUSEPORT listener to each TCP address, and a
+ * classic BPF program on each reuseport group steers each connection to the
+ * listener of the CPU that processed its packets, so a connection is
+ * accepted, handled, and counted on the core whose caches already hold it.
+ * Unix domain listeners cannot form such groups, so every worker polls the
+ * same one and whichever accepts first handles the connection.  ShardCount workers
+ * are started (one per CPU in the affinity mask if 0), and children, pending,
+ * and handler limits are divided between them.  The parent only restarts
+ * workers that exit and dumps statistics on SIGUSR1.
+ *
+ * On SIGUSR2 the parent hands every shard's listeners to a new server (see
+ * restart_check), which takes over each reuseport group in shard order, and
+ * then waits for its workers to drain instead of restarting them.
+ **/
+int sharded_server(const int *sfds, size_t nsfds) {
+    cpu_set_t mask;
+    int       cpus[CPU_SETSIZE];
+    long      ncpus = 0;
+
+    /* Determine CPUs this server may run on */
+    if (sched_getaffinity(0, sizeof(mask), &mask) < 0) {
+        fatal("Unable to get CPU affinity: %s", strerror(errno));
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &mask)) {
+            cpus[ncpus++] = cpu;
+        }
+    }
+
+    long nshards = ShardCount ? ShardCount : ncpus;
+    if (nshards > SHARDED_MAX) {
+        nshards = SHARDED_MAX;
+    }
+
+    /* Open listeners of each shard (reuseport group order is shard order) */
+    int *listeners = calloc(nshards * nsfds, sizeof(int));
+    int *shardcpus = calloc(nshards, sizeof(int));
+    if (!listeners || !shardcpus) {
+        fatal("Unable to allocate shards: %s", strerror(errno));
+    }
+
+    for (long shard = 0; shard < nshards; shard++) {
+        shardcpus[shard] = cpus[shard % ncpus];
+        for (size_t i = 0; i < nsfds; i++) {
+            int *listener = &listeners[shard * nsfds + i];
+            if (shard == 0 || socket_unix(Addresses[i])) {
+                *listener = sfds[i];
+            } else if ((*listener = restart_listener(Addresses[i])) < 0 &&
+                       (*listener = socket_listen(Addresses[i])) < 0) {
+                fatal("Unable to listen on %s for shard %ld", Addresses[i], shard);
+            }
+        }
+    }
+    if (!restart_ready()) {
+        fatal("Old server gave up restart; exiting");
+    }
+    for (size_t i = 0; i < nsfds; i++) {
+        if (!socket_unix(Addresses[i])) {
+            sharded_steer(sfds[i], shardcpus, nshards);
+        }
+    }
+
+    /* Divide limits between shards */
+    MaxChildren = sharded_divide(MaxChildren, nshards);
+    MaxPending  = sharded_divide(MaxPending, nshards);
+    for (Handler handler = 0; handler < HANDLER_NTYPES; handler++) {
+        HandlerLimits[handler] = sharded_divide(HandlerLimits[handler], nshards);
+    }
+
+    /* Start workers */
+    pid_t *pids = calloc(nshards, sizeof(pid_t));
+    if (!pids) {
+        fatal("Unable to allocate shards: %s", strerror(errno));
+    }
+
+    stats_shards(nshards);
+    for (long shard = 0; shard < nshards; shard++) {
+        pids[shard] = sharded_spawn(shard, shardcpus[shard], listeners, nsfds, nshards);
+    }
+
+    /* Restart workers that exit */
+    while (true) {
+        int   status;
+        pid_t pid = waitpid(-1, &status, 0);
+        stats_check();
+        if (pid < 0) {
+            if (errno != EINTR) {
+                fatal("Unable to wait for shards: %s", strerror(errno));
+            }
+            if (restart_check(listeners, nshards * nsfds, -1)) {
+                break;
+            }
+            continue;
+        }
+
+        for (long shard = 0; shard < nshards; shard++) {
+            if (pids[shard] == pid) {
+                log("Shard %ld exited with status %d; restarting", shard, status);
+                sleep(1);
+                pids[shard] = sharded_spawn(shard, shardcpus[shard], listeners, nsfds, nshards);
+                break;
+            }
+        }
+    }
+
+    /* Hand off: stop listening and let every worker drain */
+    for (long shard = 0; shard < nshards; shard++) {
+        for (size_t i = 0; i < nsfds; i++) {
+            if (shard == 0 || listeners[shard * nsfds + i] != sfds[i]) {
+                close(listeners[shard * nsfds + i]);
+            }
+        }
+        kill(pids[shard], SIGUSR2);
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR);
+
+    log("Drained all shards; exiting");
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Attach reuseport program that maps CPU to shard.
+ *
+ * @param   sfd         Any listener in the reuseport group.
+ * @param   cpus        CPU of each shard.
+ * @param   nshards     Number of shards.
+ *
+ * The program returns the index of the first shard on the CPU that received
+ * the connection, and falls back to CPU modulo shards for CPUs without one.
+ * If the kernel refuses the program, connections are hashed as before.
+ **/
+static void sharded_steer(int sfd, const int *cpus, long nshards) {
+    struct sock_filter code[2 * SHARDED_MAX + 3];
+    size_t             n = 0;
+
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (long shard = 0; shard < nshards; shard++) {
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[shard], 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, shard);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nshards);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    struct sock_fprog program = {.len = n, .filter = code};
+    if (setsockopt(sfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0) {
+        log("Unable to attach reuseport program: %s", strerror(errno));
+    }
+}
+
+/**
+ * Fork worker of shard.
+ *
+ * @param   shard       Shard to run.
+ * @param   cpu         CPU to pin the worker (and its children) to.
+ * @param   listeners   Listeners of each shard (nsfds per shard).
+ * @param   nsfds       Number of listeners per shard.
+ * @param   nshards     Number of shards.
+ * @return  Process id of worker.
+ **/
+static pid_t sharded_spawn(long shard, int cpu, const int *listeners, size_t nsfds, long nshards) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        fatal("Unable to fork shard %ld: %s", shard, strerror(errno));
+    }
+    if (pid > 0) {
+        return pid;
+    }
+
+    /* Exit with the parent rather than keep serving unsupervised */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    if (sched_setaffinity(0, sizeof(mask), &mask) < 0) {
+        log("Unable to pin shard %ld to CPU %d: %s", shard, cpu, strerror(errno));
+    }
+
+    /* Accept only from this shard's listeners (and the shared ones) */
+    const int *own = &listeners[shard * nsfds];
+    for (long other = 0; other < nshards; other++) {
+        for (size_t i = 0; other != shard && i < nsfds; i++) {
+            if (listeners[other * nsfds + i] != own[i]) {
+                close(listeners[other * nsfds + i]);
+            }
+        }
+    }
+
+    stats_select(shard);
+    log("Shard %ld listening on CPU %d", shard, cpu);
+    exit(forking_server(own, nsfds));
+}
+
+/**
+ * Return share of limit for each shard (0 stays unlimited).
+ **/
+static long sharded_divide(long limit, long nshards) {
+    return limit > 0 ? (limit + nshards - 1) / nshards : limit;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
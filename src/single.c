@@ -5,28 +5,68 @@
 #include <errno.h>
 #include <string.h>
 
+#include <poll.h>
 #include <unistd.h>
 
 /**
  * Handle one HTTP request at a time.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   sfds        Server socket file descriptors.
+ * @param   nsfds       Number of server sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * The server returns once a hot restart hands its listeners to a new server,
+ * since it holds no connection between requests.
  **/
-int single_server(int sfd) {
-    /* Accept and handle HTTP request */
+int single_server(const int *sfds, size_t nsfds) {
+    struct pollfd pfds[SOCKET_ADDRESSES + 1];
+    size_t        next = 0;
+
+    for (size_t i = 0; i < nsfds; i++) {
+        pfds[i] = (struct pollfd){.fd = sfds[i], .events = POLLIN};
+    }
+
+    /* Accept and handle HTTP request (one per connection so an idle client
+     * cannot stall the server) */
     Status result;
+    KeepAliveRequests = 1;
     while (true) {
+        /* Stop once the new server of a hot restart accepts */
+        if (restart_check(sfds, nsfds, 0)) {
+            break;
+        }
+
+        /* Wait for a connection on any listener, taking turns between them */
+        pfds[nsfds] = (struct pollfd){.fd = restart_fd(), .events = POLLIN};
+        if (poll(pfds, nsfds + 1, -1) <= 0) {
+            stats_check();
+            continue;
+        }
+
+        int sfd = -1;
+        for (size_t n = 0; n < nsfds && sfd < 0; n++, next = (next + 1) % nsfds) {
+            if (pfds[next].revents & POLLIN) {
+                sfd = pfds[next].fd;
+            }
+        }
+        if (sfd < 0) {
+            continue;
+        }
+
     	/* Accept request */
         Request *request = accept_request(sfd);
+        stats_check();
         if (!request){
-            log("Unable to accept request: %s", strerror(errno));
+            if (errno != EINTR && errno != EAGAIN)
+                log("Unable to accept request: %s", strerror(errno));
             continue;
         }
 
 	/* Handle request */
         result = handle_request(request);
-        if (result != HTTP_STATUS_OK){
+        if (result == HTTP_STATUS_REQUEST_TIMEOUT){
+            log("Request from %s:%s timed out", request->host, request->port);
+        } else if (result != HTTP_STATUS_OK){
             log("Unable to handle request: %s", strerror(errno));
         }
 
@@ -34,7 +74,10 @@ int single_server(int sfd) {
         free_request(request);
     }
 
-    /* Close server socket */
+    /* Close server sockets */
+    for (size_t i = 0; i < nsfds; i++) {
+        close(sfds[i]);
+    }
     return EXIT_SUCCESS;
 }
 
@@ -3,22 +3,40 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+/* Internal Declarations */
+static int socket_listen_unix(const char *path);
+
 /**
- * Allocate socket, bind it, and listen to specified port.
+ * Allocate socket, bind it, and listen to specified address.
+ *
+ * @param   address     Port number, or unix:path of a Unix domain socket
+ * (unix:@name for an abstract socket).
+ * @return  Allocated server socket file descriptor (non-blocking).
  *
- * @param   port        Port number to bind to and listen on.
- * @return  Allocated server socket file descriptor.
+ * Listeners are non-blocking because a server may poll several of them, and a
+ * Unix domain listener is shared by every shard, so another process may win
+ * the connection between poll and accept.
  **/
-int socket_listen(const char *port) {
+int socket_listen(const char *address) {
+    if (socket_unix(address)) {
+        return socket_listen_unix(address + strlen(SOCKET_UNIX));
+    }
+
+    const char *port = address;
+
     /* Lookup server address information */
 
     struct addrinfo *results;
@@ -63,6 +81,57 @@ int socket_listen(const char *port) {
     }
 
     freeaddrinfo(results);
+    if (socket_fd >= 0) {
+        fcntl(socket_fd, F_SETFL, O_NONBLOCK);
+    }
+    return socket_fd;
+}
+
+/**
+ * Determine if address names a Unix domain socket.
+ **/
+bool socket_unix(const char *address) {
+    return strncmp(address, SOCKET_UNIX, strlen(SOCKET_UNIX)) == 0;
+}
+
+/**
+ * Allocate Unix domain socket, bind it to path, and listen.
+ *
+ * @param   path        Filesystem path, or @name of an abstract socket.
+ * @return  Allocated server socket file descriptor (non-blocking).
+ *
+ * A socket file left behind by an earlier server is replaced; any other file
+ * at path is an error.
+ **/
+static int socket_listen_unix(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    size_t length = strlen(path);
+    if (length == 0 || length >= sizeof(addr.sun_path)) {
+        fprintf(stdout, "Error message: socket path %s\n", path);
+        return -1;
+    }
+
+    memcpy(addr.sun_path, path, length);
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+    } else {
+        struct stat s;
+        if (lstat(path, &s) == 0 && S_ISSOCK(s.st_mode)) {
+            unlink(path);
+        }
+    }
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (socket_fd < 0) {
+        return -1;
+    }
+
+    if (bind(socket_fd, (struct sockaddr *)&addr, offsetof(struct sockaddr_un, sun_path) + length) < 0 ||
+        listen(socket_fd, SOMAXCONN) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+
     return socket_fd;
 }
 
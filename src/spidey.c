@@ -3,16 +3,52 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
 
 #include <unistd.h>
 
+/* Named numeric setting of -l and -o */
+typedef struct {
+    const char *name;                   /* Name of setting */
+    long       *value;                  /* Variable set */
+    long        minimum;                /* Smallest value accepted */
+} Setting;
+
 /* Global Variables */
 char *Port	      = "9898";
+char *Addresses[SOCKET_ADDRESSES];
+size_t NAddresses     = 0;
 char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath	      = "www";
+char *PackPath	      = NULL;
+long  IdleTimeout     = 15000;
+long  HeaderTimeout   = 10000;
+long  WriteTimeout    = 30000;
+long  RequestTimeout  = 300000;
+long  MaxChildren     = 256;
+long  MaxPending      = 128;
+long  HandlerLimits[HANDLER_NTYPES] = {0, 0, 64, 0};
+long  RetryAfter      = 1;
+long  BrowsePageSize  = 1000;
+long  KeepAliveRequests = 100;
+long  BodyLimit       = 8 << 20;
+long  ShardCount      = 0;
+char *TracePath	      = NULL;
+char *CapturePath     = NULL;
+long  TraceRate       = 1;
+char *CertificatePath = NULL;
+long  CacheEntries    = 1024;
+long  CacheTTL        = 5;
+long  InlineLimit     = 4096;
+long  InlineBudget    = 4 << 20;
+long  SendQuantum     = 256 << 10;
+long  Bandwidth       = 0;
+long  ClientBandwidth = 0;
+char *WarmPath	      = NULL;
+long  WarmLimit       = 1000;
 
 /**
  * Display usage message and exit with specified status code.
@@ -21,17 +57,150 @@ char *RootPath	      = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hcClLmMoPprStTW]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -c mode       Single, Forking, or Sharded mode\n");
+    fprintf(stderr, "    -C path       Capture request heads for replay (see bin/replay.py)\n");
+    fprintf(stderr, "    -l limits     Server limits (children=N,pending=N,browse=N,file=N,cgi=N,plugin=N,retry=S,page=N,requests=N,body=N,shards=N,sample=N)\n");
+    fprintf(stderr, "    -L prefix=so  Route URI prefix to handler plugin (repeatable, see plugins/)\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
-    fprintf(stderr, "    -p port       Port to listen on\n");
+    fprintf(stderr, "    -o settings   Cache, transmit and warm-up settings (cache=N,ttl=S,inline=N,inlinemem=N,quantum=N,bandwidth=N,rate=N,warm=N)\n");
+    fprintf(stderr, "    -P path       Site pack to serve files from (see bin/pack.py)\n");
+    fprintf(stderr, "    -p port       Port or unix:path (unix:@name is abstract) to listen on (repeatable)\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -S path       Serve HTTPS with PEM certificate and key (see bin/mkcert.sh)\n");
+    fprintf(stderr, "    -t timeouts   Header,idle,write,request timeouts in seconds (0 disables)\n");
+    fprintf(stderr, "    -T path       Write Chrome trace events of request phases (make TRACE=1)\n");
+    fprintf(stderr, "    -W path       Warm caches at startup from access profile (capture log or URI list)\n");
     exit(status);
 }
 
+/**
+ * Parse timeouts option.
+ *
+ * @param   s           Comma separated header,idle,write,request seconds.
+ * @return  true if parsing was successful, false if there was an error.
+ *
+ * Trailing fields may be omitted to keep their defaults.
+ **/
+bool parse_timeouts(const char *s) {
+    long  *timeouts[] = {&HeaderTimeout, &IdleTimeout, &WriteTimeout, &RequestTimeout};
+    char  *end;
+
+    for (size_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]) && *s; i++) {
+        double seconds = strtod(s, &end);
+        if (end == s || seconds < 0 || (*end && *end != ',')) {
+            return false;
+        }
+
+        *timeouts[i] = (long)(seconds * 1000);
+        s = *end ? end + 1 : end;
+    }
+
+    return true;
+}
+
+/**
+ * Parse comma separated list of name=value settings.
+ *
+ * @param   s           Comma separated list of name=value settings.
+ * @param   settings    Recognized names with the variable and minimum of each.
+ * @param   nsettings   Number of recognized names.
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_settings(const char *s, const Setting *settings, size_t nsettings) {
+    char *end;
+
+    while (*s) {
+        size_t i;
+        size_t length = strcspn(s, "=");
+        for (i = 0; i < nsettings; i++) {
+            if (strlen(settings[i].name) == length && strncmp(settings[i].name, s, length) == 0) {
+                break;
+            }
+        }
+
+        if (i == nsettings || s[length] != '=') {
+            return false;
+        }
+
+        s += length + 1;
+        long value = strtol(s, &end, 10);
+        if (end == s || value < settings[i].minimum || (*end && *end != ',')) {
+            return false;
+        }
+
+        *settings[i].value = value;
+        s = *end ? end + 1 : end;
+    }
+
+    return true;
+}
+
+/**
+ * Parse limits option.
+ *
+ * @param   s           Comma separated list of name=value limits.
+ * @return  true if parsing was successful, false if there was an error.
+ *
+ * Recognized names are children, pending, browse, file, cgi, plugin, retry,
+ * page (directory listing entries per page), requests (per persistent
+ * connection, 1 disables keep-alive), body (bytes of request body a CGI
+ * script or plugin may receive), shards (sharded workers, 0 is one per
+ * CPU), and sample (trace one in N requests).  A handler limit of 0 means
+ * the handler is only bounded by children.
+ **/
+bool parse_limits(const char *s) {
+    const Setting limits[] = {
+        {"children", &MaxChildren,                   1},
+        {"pending",  &MaxPending,                    0},
+        {"browse",   &HandlerLimits[HANDLER_BROWSE], 0},
+        {"file",     &HandlerLimits[HANDLER_FILE],   0},
+        {"cgi",      &HandlerLimits[HANDLER_CGI],    0},
+        {"plugin",   &HandlerLimits[HANDLER_PLUGIN], 0},
+        {"retry",    &RetryAfter,                    0},
+        {"page",     &BrowsePageSize,                1},
+        {"requests", &KeepAliveRequests,             1},
+        {"body",     &BodyLimit,                     0},
+        {"shards",   &ShardCount,                    0},
+        {"sample",   &TraceRate,                     1},
+    };
+
+    return parse_settings(s, limits, sizeof(limits) / sizeof(limits[0]));
+}
+
+/**
+ * Parse tuning option.
+ *
+ * @param   s           Comma separated list of name=value settings.
+ * @return  true if parsing was successful, false if there was an error.
+ *
+ * Recognized names are cache (shared cache entries, 0 disables it), ttl
+ * (seconds a cache entry stays valid), inline (largest file in bytes served
+ * from a stored complete response, 0 disables it), inlinemem (bytes of
+ * memory for stored responses), quantum (bytes per scheduled slice),
+ * bandwidth (bytes per second shared by responses larger than a quantum),
+ * rate (bytes per second of such responses per client address), and warm
+ * (most requested URIs of the access profile warmed at startup).  A
+ * bandwidth or rate of 0 is unlimited.
+ **/
+bool parse_tuning(const char *s) {
+    const Setting tuning[] = {
+        {"cache",     &CacheEntries,    0},
+        {"ttl",       &CacheTTL,        0},
+        {"inline",    &InlineLimit,     0},
+        {"inlinemem", &InlineBudget,    0},
+        {"quantum",   &SendQuantum,     BUFSIZ},
+        {"bandwidth", &Bandwidth,       0},
+        {"rate",      &ClientBandwidth, 0},
+        {"warm",      &WarmLimit,       0},
+    };
+
+    return parse_settings(s, tuning, sizeof(tuning) / sizeof(tuning[0]));
+}
+
 /**
  * Parse command-line options.
  *
@@ -40,8 +209,9 @@ void usage(const char *progname, int status) {
  * @param   mode        Pointer to ServerMode variable.
  * @return  true if parsing was successful, false if there was an error.
  *
- * This should set the mode, MimeTypesPath, DefaultMimeType, Port, and RootPath
- * if specified.
+ * This should set the mode, MimeTypesPath, DefaultMimeType, Addresses,
+ * RootPath, and CertificatePath if specified.  Each -p adds a listener, and
+ * Port becomes the first TCP one.
  */
 bool parse_options(int argc, char *argv[], ServerMode *mode) {
     int argind = 1;
@@ -53,32 +223,84 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
 	    	    *mode = SINGLE;
                 } else if (streq(argv[argind], "forking")) {
 	    	    *mode = FORKING;
+	    	} else if (streq(argv[argind], "sharded")) {
+	    	    *mode = SHARDED;
 	    	} else {
 	    	    return false;
 	    	}
 	    	argind++;
 	    	break;
+	    case 'C':
+	    	CapturePath = argv[argind++];
+	    	break;
 	    case 'h':
 	    	usage(argv[0], EXIT_SUCCESS);
 	    	break;
+	    case 'l':
+	    	if (!parse_limits(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'L':
+	    	if (!plugin_register(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
 	    case 'm':
 	    	MimeTypesPath = argv[argind++];
 	    	break;
 	    case 'M':
 	    	DefaultMimeType = argv[argind++];
 	    	break;
+	    case 'o':
+	    	if (!parse_tuning(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'P':
+	    	PackPath = argv[argind++];
+	    	break;
 	    case 'p':
-	    	Port = argv[argind++];
+	    	if (NAddresses == SOCKET_ADDRESSES) {
+	    	    return false;
+	    	}
+	    	Addresses[NAddresses++] = argv[argind++];
 	    	break;
 	    case 'r':
 	    	RootPath = argv[argind++];
 	    	break;
+	    case 'S':
+	    	CertificatePath = argv[argind++];
+	    	break;
+	    case 't':
+	    	if (!parse_timeouts(argv[argind++])) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'T':
+	    	TracePath = argv[argind++];
+	    	break;
+	    case 'W':
+	    	WarmPath = argv[argind++];
+	    	break;
 	    default:
 	        return false;
 	    	break;
 	}
     }
 
+    /* Listen on default port unless told otherwise */
+    if (NAddresses == 0) {
+        Addresses[NAddresses++] = Port;
+    }
+    Port = "0";
+    for (size_t i = 0; i < NAddresses; i++) {
+        if (!socket_unix(Addresses[i])) {
+            Port = Addresses[i];
+            break;
+        }
+    }
+
     return true;
 }
 
@@ -96,29 +318,89 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    /* Listen to server socket */
-    int server_fd = socket_listen(Port);
-    
-    if (server_fd < 0){
-        debug("socket_listen: FAILURE");
-        return EXIT_FAILURE;
+    /* Restart on SIGUSR2, taking over listeners if this is a restart */
+    restart_init(argv);
+    restart_inherit();
+
+    /* Listen to server sockets */
+    int server_fds[SOCKET_ADDRESSES];
+    for (size_t i = 0; i < NAddresses; i++) {
+        server_fds[i] = restart_listener(Addresses[i]);
+        if (server_fds[i] < 0) {
+            server_fds[i] = socket_listen(Addresses[i]);
+        }
+        if (server_fds[i] < 0){
+            debug("socket_listen %s: FAILURE", Addresses[i]);
+            return EXIT_FAILURE;
+        }
+
+        if (socket_unix(Addresses[i])) {
+            log("Listening on %s", Addresses[i]);
+        } else {
+            log("Listening on port %s%s", Addresses[i], CertificatePath ? " (HTTPS)" : "");
+        }
     }
 
     /* Determine real RootPath */
-    log("Listening on port %s", Port);
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : mode == FORKING ? "Forking" : "Sharded");
+    debug("Timeouts        = header %ld, idle %ld, write %ld, request %ld ms", HeaderTimeout, IdleTimeout, WriteTimeout, RequestTimeout);
     char buffer[BUFSIZ];
     RootPath = realpath(RootPath, buffer);
 
+    /* Load handler plugins (before forking, so each is opened once) */
+    if (!plugin_init()) {
+        return EXIT_FAILURE;
+    }
+
+    /* Initialize scanner, timers, statistics, tracing, capture, caches and
+     * transmit scheduler */
+    scan_init();
+    timer_init(&Timers);
+    stats_init();
+    trace_init();
+    capture_init();
+    cache_init();
+    inline_init();
+    transmit_init();
+
+    /* Map site pack */
+    if (PackPath && !pack_open(PackPath)) {
+        return EXIT_FAILURE;
+    }
+
+    /* Load certificate (before forking, so every process shares the context) */
+    if (CertificatePath && !tls_init(CertificatePath)) {
+        fprintf(stderr, "Unable to load certificate %s\n", CertificatePath);
+        return EXIT_FAILURE;
+    }
+
+    /* Warm caches before accepting connections */
+    if (WarmPath) {
+        warm_start(WarmPath);
+    }
+
+    /* Report writes to closed sockets and CGI pipes as EPIPE */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Take over from old server (sharded_server first claims the listeners
+     * of its other shards) */
+    if (mode != SHARDED && !restart_ready()) {
+        log("Old server gave up restart; exiting");
+        return EXIT_FAILURE;
+    }
+
     /* Start either forking or single HTTP server */
     if(mode == SINGLE) {
-        status = single_server(server_fd);
+        status = single_server(server_fds, NAddresses);
     }
     else if(mode == FORKING) {
-        status = forking_server(server_fd);
+        status = forking_server(server_fds, NAddresses);
+    }
+    else if(mode == SHARDED) {
+        status = sharded_server(server_fds, NAddresses);
     }
     else {
         debug("Mode Unknown");
@@ -0,0 +1,153 @@
+/* stats.c: Server Statistics */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Global Variables */
+static Stats LocalStatistics;
+Stats *Statistics = &LocalStatistics;   /**< Statistics of this process's shard */
+
+static Stats *Unsharded = &LocalStatistics; /* Statistics before sharding */
+static Stats *Shards    = NULL;         /* Shared statistics of each shard */
+static long   NShards   = 0;
+
+static volatile sig_atomic_t StatsRequested = 0;
+
+/**
+ * Record that a statistics dump was requested.
+ **/
+static void stats_signal(int signum) {
+    StatsRequested = 1;
+}
+
+/**
+ * Allocate shared statistics and install SIGUSR1 handler.
+ *
+ * The counters live in an anonymous shared mapping so that forked children
+ * update the same counters as the parent.  Sending SIGUSR1 to the server
+ * dumps the counters to stderr.
+ **/
+void stats_init(void) {
+    Stats *shared = mmap(NULL, sizeof(Stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        log("Unable to mmap statistics: %s", strerror(errno));
+    } else {
+        Statistics = Unsharded = shared;
+    }
+
+    /* No SA_RESTART so a blocked accept returns and the dump happens promptly */
+    struct sigaction action = {.sa_handler = stats_signal};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+/**
+ * Allocate shared statistics for each shard.
+ *
+ * @param   nshards     Number of shards.
+ *
+ * Each shard counts into its own cache-line aligned Stats, so workers on
+ * different CPUs never contend for the same line.  Counters recorded so far
+ * stay in the unsharded statistics and are included in the totals.
+ **/
+void stats_shards(long nshards) {
+    Stats *shards = mmap(NULL, nshards * sizeof(Stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shards == MAP_FAILED) {
+        log("Unable to mmap shard statistics: %s", strerror(errno));
+        return;
+    }
+
+    Shards  = shards;
+    NShards = nshards;
+}
+
+/**
+ * Count into statistics of shard.
+ *
+ * @param   shard       Shard of this process.
+ **/
+void stats_select(long shard) {
+    if (shard < NShards) {
+        Statistics = &Shards[shard];
+    }
+}
+
+/**
+ * Dump statistics if requested since the last check.
+ **/
+void stats_check(void) {
+    if (StatsRequested) {
+        StatsRequested = 0;
+        stats_dump(stderr);
+    }
+}
+
+/**
+ * Add counters of one Stats to another.
+ **/
+static void stats_sum(Stats *total, const Stats *s) {
+    total->accepted += __atomic_load_n(&s->accepted, __ATOMIC_RELAXED);
+    total->handled  += __atomic_load_n(&s->handled, __ATOMIC_RELAXED);
+    for (int i = 0; i < TIMEOUT_NTYPES; i++) {
+        total->timeouts[i] += __atomic_load_n(&s->timeouts[i], __ATOMIC_RELAXED);
+    }
+    total->queued   += __atomic_load_n(&s->queued, __ATOMIC_RELAXED);
+    total->shed     += __atomic_load_n(&s->shed, __ATOMIC_RELAXED);
+    total->cache_hits      += __atomic_load_n(&s->cache_hits, __ATOMIC_RELAXED);
+    total->cache_misses    += __atomic_load_n(&s->cache_misses, __ATOMIC_RELAXED);
+    total->cache_evictions += __atomic_load_n(&s->cache_evictions, __ATOMIC_RELAXED);
+    total->throttled       += __atomic_load_n(&s->throttled, __ATOMIC_RELAXED);
+    total->inline_hits      += __atomic_load_n(&s->inline_hits, __ATOMIC_RELAXED);
+    total->inline_misses    += __atomic_load_n(&s->inline_misses, __ATOMIC_RELAXED);
+    total->inline_refreshes += __atomic_load_n(&s->inline_refreshes, __ATOMIC_RELAXED);
+    total->inline_entries   += __atomic_load_n(&s->inline_entries, __ATOMIC_RELAXED);
+    total->inline_bytes     += __atomic_load_n(&s->inline_bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write statistics to stream.
+ *
+ * @param   stream      Stream to write to.
+ *
+ * Counters are totals over all shards, followed by how the accepted
+ * connections and handled requests are distributed over the shards.
+ **/
+void stats_dump(FILE *stream) {
+    Stats total = {0};
+    stats_sum(&total, Unsharded);
+    for (long shard = 0; shard < NShards; shard++) {
+        stats_sum(&total, &Shards[shard]);
+    }
+
+    fprintf(stream, "accepted         %zu\n", total.accepted);
+    fprintf(stream, "handled          %zu\n", total.handled);
+    fprintf(stream, "timeouts.idle    %zu\n", total.timeouts[TIMEOUT_IDLE]);
+    fprintf(stream, "timeouts.header  %zu\n", total.timeouts[TIMEOUT_HEADER]);
+    fprintf(stream, "timeouts.write   %zu\n", total.timeouts[TIMEOUT_WRITE]);
+    fprintf(stream, "timeouts.request %zu\n", total.timeouts[TIMEOUT_REQUEST]);
+    fprintf(stream, "queued           %zu\n", total.queued);
+    fprintf(stream, "shed             %zu\n", total.shed);
+    fprintf(stream, "cache.hits       %zu\n", total.cache_hits);
+    fprintf(stream, "cache.misses     %zu\n", total.cache_misses);
+    fprintf(stream, "cache.evictions  %zu\n", total.cache_evictions);
+    fprintf(stream, "throttled        %zu\n", total.throttled);
+    fprintf(stream, "inline.hits      %zu\n", total.inline_hits);
+    fprintf(stream, "inline.misses    %zu\n", total.inline_misses);
+    fprintf(stream, "inline.refreshes %zu\n", total.inline_refreshes);
+    fprintf(stream, "inline.entries   %zu\n", total.inline_entries);
+    fprintf(stream, "inline.bytes     %zu\n", total.inline_bytes);
+
+    for (long shard = 0; shard < NShards; shard++) {
+        size_t accepted = __atomic_load_n(&Shards[shard].accepted, __ATOMIC_RELAXED);
+        size_t handled  = __atomic_load_n(&Shards[shard].handled, __ATOMIC_RELAXED);
+        fprintf(stream, "shard.%-10ld accepted %zu (%.1f%%) handled %zu\n", shard,
+            accepted, total.accepted ? 100.0 * accepted / total.accepted : 0.0, handled);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
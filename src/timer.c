@@ -0,0 +1,216 @@
+/* timer.c: Hierarchical Timer Wheel */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+/* Global Variables */
+TimerWheel Timers;                      /**< Per-process timer wheel */
+
+/* Internal Declarations */
+static void timer_link(TimerWheel *w, Timer *t);
+static void timer_cascade(TimerWheel *w, int level);
+
+/**
+ * Return current monotonic time in milliseconds.
+ **/
+uint64_t timer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Initialize timer wheel.
+ *
+ * @param   w           Timer wheel structure.
+ *
+ * Every slot is an empty circular list whose head is a sentinel Timer, so
+ * linking and unlinking never need to special case the ends of a list.
+ **/
+void timer_init(TimerWheel *w) {
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            Timer *head = &w->slots[level][slot];
+            head->next = head;
+            head->prev = head;
+        }
+    }
+
+    w->current = timer_now() / TIMER_TICK_MS;
+    w->count   = 0;
+}
+
+/**
+ * Schedule timer to fire after specified number of milliseconds.
+ *
+ * @param   w           Timer wheel structure.
+ * @param   t           Timer to schedule (rescheduled if already pending).
+ * @param   msecs       Milliseconds from now until expiration.
+ *
+ * This is O(1): the timer is placed in the slot of the coarsest level that
+ * still resolves its expiration and is moved to finer levels as the wheel
+ * turns.
+ **/
+void timer_add(TimerWheel *w, Timer *t, uint64_t msecs) {
+    timer_cancel(w, t);
+
+    /* Fast forward idle wheel so the new timer is relative to now */
+    uint64_t now = timer_now() / TIMER_TICK_MS;
+    if (w->count == 0 && now > w->current) {
+        w->current = now;
+    }
+
+    t->expires = now + (msecs + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (t->expires <= w->current) {
+        t->expires = w->current + 1;
+    }
+
+    timer_link(w, t);
+    w->count++;
+}
+
+/**
+ * Cancel pending timer.
+ *
+ * @param   w           Timer wheel structure.
+ * @param   t           Timer to cancel (ignored if not pending).
+ **/
+void timer_cancel(TimerWheel *w, Timer *t) {
+    if (!t->next) {
+        return;
+    }
+
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+    w->count--;
+}
+
+/**
+ * Advance timer wheel to current time and fire expired timers.
+ *
+ * @param   w           Timer wheel structure.
+ * @return  Number of timers that fired.
+ *
+ * Each timer is unlinked before its callback runs, so callbacks may safely
+ * reschedule or free their own timer.
+ **/
+size_t timer_advance(TimerWheel *w) {
+    uint64_t now   = timer_now() / TIMER_TICK_MS;
+    size_t   fired = 0;
+
+    while (w->current < now) {
+        if (w->count == 0) {
+            w->current = now;
+            break;
+        }
+
+        w->current++;
+        if ((w->current & TIMER_MASK) == 0) {
+            timer_cascade(w, 1);
+        }
+
+        Timer *head = &w->slots[0][w->current & TIMER_MASK];
+        while (head->next != head) {
+            Timer *t = head->next;
+            timer_cancel(w, t);
+            t->callback(t, t->arg);
+            fired++;
+        }
+    }
+
+    return fired;
+}
+
+/**
+ * Return milliseconds until next pending timer could fire.
+ *
+ * @param   w           Timer wheel structure.
+ * @return  -1 if no timers are pending, otherwise a poll(2) style timeout.
+ *
+ * Only the finest level is scanned; when nothing is found there the caller is
+ * simply woken up after one revolution to let the wheel cascade.
+ **/
+int timer_timeout(TimerWheel *w) {
+    if (w->count == 0) {
+        return -1;
+    }
+
+    uint64_t now = timer_now() / TIMER_TICK_MS;
+    for (uint64_t tick = w->current + 1; tick <= w->current + TIMER_SLOTS; tick++) {
+        Timer *head = &w->slots[0][tick & TIMER_MASK];
+        if (head->next != head) {
+            return tick <= now ? 0 : (int)((tick - now) * TIMER_TICK_MS);
+        }
+    }
+
+    return TIMER_SLOTS * TIMER_TICK_MS;
+}
+
+/**
+ * Return milliseconds remaining until timer expires.
+ *
+ * @param   t           Timer.
+ * @return  0 if timer is not pending, otherwise remaining milliseconds (at
+ * least 1).
+ **/
+long timer_remaining(Timer *t) {
+    if (!t->next) {
+        return 0;
+    }
+
+    long remaining = (long)(t->expires * TIMER_TICK_MS - timer_now());
+    return remaining > 0 ? remaining : 1;
+}
+
+/**
+ * Insert timer into the slot matching its expiration.
+ **/
+static void timer_link(TimerWheel *w, Timer *t) {
+    uint64_t delta = t->expires - w->current;
+    int      level = 0;
+
+    while (level < TIMER_LEVELS - 1 && delta >= (1ULL << ((level + 1) * TIMER_BITS))) {
+        level++;
+    }
+
+    /* Clamp timers beyond the range of the wheel to the last slot */
+    uint64_t expires = t->expires;
+    if (level == TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_LEVELS * TIMER_BITS))) {
+        expires = w->current + (1ULL << (TIMER_LEVELS * TIMER_BITS)) - 1;
+    }
+
+    Timer *head = &w->slots[level][(expires >> (level * TIMER_BITS)) & TIMER_MASK];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/**
+ * Move timers from the current slot of a coarse level down to finer levels.
+ **/
+static void timer_cascade(TimerWheel *w, int level) {
+    if (level >= TIMER_LEVELS) {
+        return;
+    }
+
+    size_t index = (w->current >> (level * TIMER_BITS)) & TIMER_MASK;
+    if (index == 0) {
+        timer_cascade(w, level + 1);
+    }
+
+    Timer *head = &w->slots[level][index];
+    while (head->next != head) {
+        Timer *t = head->next;
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        timer_link(w, t);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,252 @@
+/* tls.c: TLS Termination */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+/* Constants */
+#define TLS_RECORD	16384		/* Largest TLS record payload */
+
+/* Global Variables */
+static SSL_CTX *TlsContext = NULL;      /* Shared by every connection (and process) */
+
+/* Internal Declarations */
+static int tls_select_protocol(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg);
+static ssize_t tls_stream_write(void *cookie, const char *data, size_t size);
+static int tls_stream_close(void *cookie);
+static void tls_error(const char *operation);
+
+/**
+ * Create TLS context from certificate and private key.
+ *
+ * @param   path        PEM file with certificate chain and private key.
+ * @return  Whether or not the context was created.
+ *
+ * The context is created before any process forks, so its session ticket keys
+ * are shared by every child and shard, and a client resumes its session
+ * whichever process accepts the next connection (a per-process session cache
+ * would die with the child).  Kernel TLS is requested, so OpenSSL hands the
+ * negotiated keys to the socket when the kernel supports the cipher.
+ **/
+bool tls_init(const char *path) {
+    TlsContext = SSL_CTX_new(TLS_server_method());
+    if (!TlsContext) {
+        tls_error("SSL_CTX_new");
+        return false;
+    }
+
+    SSL_CTX_set_min_proto_version(TlsContext, TLS1_2_VERSION);
+    SSL_CTX_set_options(TlsContext, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_session_cache_mode(TlsContext, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(TlsContext, (const unsigned char *)"spidey", 6);
+    SSL_CTX_set_alpn_select_cb(TlsContext, tls_select_protocol, NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(TlsContext, path) != 1 ||
+        SSL_CTX_use_PrivateKey_file(TlsContext, path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(TlsContext) != 1) {
+        tls_error(path);
+        SSL_CTX_free(TlsContext);
+        TlsContext = NULL;
+        return false;
+    }
+
+    debug("CertificatePath = %s", path);
+    return true;
+}
+
+/**
+ * Negotiate TLS on client socket and open its response stream.
+ *
+ * @param   r           Request structure (stream not yet opened).
+ * @return  -1 on error and 0 on success.
+ *
+ * The handshake runs under the header deadline.  Afterwards, each direction
+ * the kernel took over is used through the socket directly, so responses can
+ * still be sent with sendfile, writev, and splice; otherwise records are
+ * encrypted or decrypted by OpenSSL in user space.  The response stream always
+ * goes through tls_stream_write so closing it leaves the socket open for the
+ * close_notify alert.
+ **/
+int tls_accept(Request *r) {
+    static const cookie_io_functions_t functions = {
+        .write = tls_stream_write,
+        .close = tls_stream_close,
+    };
+
+    request_phase(r, TIMEOUT_HEADER);
+    r->tls = SSL_new(TlsContext);
+    if (!r->tls || SSL_set_fd(r->tls, r->fd) != 1) {
+        tls_error("SSL_new");
+        return -1;
+    }
+
+    ERR_clear_error();
+    int result = SSL_accept(r->tls);
+    if (result != 1) {
+        if (SSL_get_error(r->tls, result) == SSL_ERROR_SYSCALL && errno) {
+            request_timedout(r);
+            debug("TLS handshake with %s:%s failed: %s", r->host, r->port, strerror(errno));
+        } else {
+            tls_error("SSL_accept");
+        }
+        return -1;
+    }
+
+    r->ktls_send = BIO_get_ktls_send(SSL_get_wbio(r->tls));
+    r->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(r->tls));
+    debug("Negotiated %s %s with %s:%s%s (kernel send %d, receive %d)",
+        SSL_get_version(r->tls), SSL_get_cipher_name(r->tls), r->host, r->port,
+        SSL_session_reused(r->tls) ? " (resumed)" : "", r->ktls_send, r->ktls_recv);
+
+    /* Open response stream (buffering whole records) */
+    r->stream = fopencookie(r, "w", functions);
+    if (!r->stream || setvbuf(r->stream, NULL, _IOFBF, TLS_RECORD) != 0) {
+        debug("Unable to fopencookie: %s", strerror(errno));
+        return -1;
+    }
+
+    request_phase(r, TIMEOUT_IDLE);
+    return 0;
+}
+
+/**
+ * Receive decrypted bytes from client.
+ *
+ * @param   r           Request structure.
+ * @param   data        Buffer to store bytes.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes received, 0 when the client closed, or -1 on
+ * error (with errno of the failed socket read, so timeouts read as EAGAIN).
+ **/
+ssize_t tls_recv(Request *r, void *data, size_t size) {
+    ERR_clear_error();
+    errno = 0;
+
+    int nread = SSL_read(r->tls, data, size > INT32_MAX ? INT32_MAX : size);
+    if (nread > 0) {
+        return nread;
+    }
+
+    switch (SSL_get_error(r->tls, nread)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+        case SSL_ERROR_SYSCALL:
+            if (!errno) {
+                errno = EPROTO;
+            }
+            return -1;
+        default:
+            tls_error("SSL_read");
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+/**
+ * Determine if decrypted bytes are waiting inside OpenSSL.
+ *
+ * Such bytes have already left the socket, so polling it would not see them.
+ **/
+bool tls_pending(Request *r) {
+    return r->tls && !r->ktls_recv && SSL_pending(r->tls) > 0;
+}
+
+/**
+ * Send close_notify and release TLS session.
+ *
+ * @param   r           Request structure (response stream already closed).
+ **/
+void tls_close(Request *r) {
+    if (!r->tls) {
+        return;
+    }
+
+    if (SSL_is_init_finished(r->tls)) {
+        ERR_clear_error();
+        SSL_shutdown(r->tls);
+    }
+    SSL_free(r->tls);
+    r->tls = NULL;
+}
+
+/**
+ * Choose application protocol: HTTP/2 when the client offers it, otherwise
+ * HTTP/1.1.
+ **/
+static int tls_select_protocol(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg) {
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+
+    if (SSL_select_next_proto((unsigned char **)out, outlen, protocols, sizeof(protocols) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Write response bytes, encrypted by the kernel or by OpenSSL.
+ *
+ * @return  Number of bytes written (all of them) or -1 on error.
+ **/
+static ssize_t tls_stream_write(void *cookie, const char *data, size_t size) {
+    Request *r       = cookie;
+    size_t   written = 0;
+
+    while (written < size) {
+        ssize_t nwritten;
+        if (r->ktls_send) {
+            nwritten = write(r->fd, data + written, size - written);
+        } else {
+            ERR_clear_error();
+            errno    = 0;
+            nwritten = SSL_write(r->tls, data + written, size - written > INT32_MAX ? INT32_MAX : size - written);
+            if (nwritten <= 0) {
+                if (SSL_get_error(r->tls, nwritten) == SSL_ERROR_SSL) {
+                    tls_error("SSL_write");
+                }
+                if (!errno) {
+                    errno = EPROTO;
+                }
+                nwritten = -1;
+            }
+        }
+
+        if (nwritten < 0) {
+            if (errno == EINTR && !request_timedout(r)) {
+                continue;
+            }
+            return -1;
+        }
+        written += nwritten;
+    }
+
+    return written;
+}
+
+/**
+ * Close response stream without closing the socket (see tls_close).
+ **/
+static int tls_stream_close(void *cookie) {
+    return 0;
+}
+
+/**
+ * Log OpenSSL error queue.
+ **/
+static void tls_error(const char *operation) {
+    unsigned long error = ERR_get_error();
+    char          message[256];
+
+    ERR_error_string_n(error, message, sizeof(message));
+    debug("%s failed: %s", operation, error ? message : "unknown error");
+    ERR_clear_error();
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
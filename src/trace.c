@@ -0,0 +1,151 @@
+/* trace.c: Request Phase Tracing */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+/* Constants */
+#define TRACE_EVENTS	256             /* Spans buffered per process */
+#define TRACE_DETAIL	96              /* Bytes of detail kept per span */
+#define TRACE_LINE	(TRACE_DETAIL * 2 + 192)  /* Bytes of one formatted span */
+
+/* Global Variables */
+#ifdef TRACE
+static int TraceFd = -1;                /* Trace event file (O_APPEND, shared by all processes) */
+#endif
+
+/**
+ * Open trace event file.
+ *
+ * The file is a Chrome trace event JSON array (loadable by chrome://tracing
+ * and Perfetto), which may omit its closing bracket, so every process can
+ * append complete events with a single write and no coordination.
+ **/
+void trace_init(void) {
+    if (!TracePath) {
+        return;
+    }
+
+#ifdef TRACE
+    TraceFd = open(TracePath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (TraceFd < 0 || write(TraceFd, "[\n", 2) != 2) {
+        fatal("Unable to open trace %s: %s", TracePath, strerror(errno));
+    }
+    debug("TracePath       = %s (1 in %ld requests)", TracePath, TraceRate);
+#else
+    log("Tracing is not compiled in (build with make TRACE=1); ignoring %s", TracePath);
+#endif
+}
+
+#ifdef TRACE
+
+typedef struct {
+    const char *name;                   /* Span name (static string) */
+    uint64_t    start;                  /* Monotonic nanoseconds span started */
+    uint64_t    end;                    /* Monotonic nanoseconds span ended */
+    char        detail[TRACE_DETAIL];   /* Request URI (empty if none) */
+} TraceEvent;
+
+static TraceEvent TraceEvents[TRACE_EVENTS];    /* Spans not yet written */
+static size_t     TraceCount = 0;
+
+/**
+ * Return monotonic time in nanoseconds.
+ **/
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Determine whether to trace the next request.
+ *
+ * @return  Whether or not the request is sampled.
+ *
+ * One in TraceRate requests is sampled at random.  The generator is reseeded
+ * whenever the process changes, so forked children do not all make the same
+ * choices.
+ **/
+bool trace_sample(void) {
+    static pid_t seeded = 0;
+
+    if (TraceFd < 0) {
+        return false;
+    }
+    if (TraceRate <= 1) {
+        return true;
+    }
+
+    pid_t pid = getpid();
+    if (pid != seeded) {
+        srandom(pid ^ trace_now());
+        seeded = pid;
+    }
+    return random() % TraceRate == 0;
+}
+
+/**
+ * Record span that ends now.
+ *
+ * @param   name        Span name (must be a static string).
+ * @param   start       Monotonic nanoseconds span started.
+ * @param   detail      Detail to attach (or NULL).
+ **/
+void trace_record(const char *name, uint64_t start, const char *detail) {
+    if (TraceCount == TRACE_EVENTS) {
+        trace_flush();
+    }
+
+    TraceEvent *e = &TraceEvents[TraceCount++];
+    e->name  = name;
+    e->start = start;
+    e->end   = trace_now();
+    snprintf(e->detail, sizeof(e->detail), "%s", detail ? detail : "");
+}
+
+/**
+ * Write buffered spans to trace event file.
+ *
+ * Spans are formatted as complete ("X") events of this process and appended
+ * with one write.
+ **/
+void trace_flush(void) {
+    static char buffer[TRACE_EVENTS * TRACE_LINE];
+    size_t      length = 0;
+    pid_t       pid    = getpid();
+
+    for (size_t i = 0; i < TraceCount; i++) {
+        TraceEvent *e = &TraceEvents[i];
+        char        detail[2 * TRACE_DETAIL];
+        size_t      n = 0;
+
+        /* Escape detail as JSON string */
+        for (const char *c = e->detail; *c; c++) {
+            if (*c == '"' || *c == '\\') {
+                detail[n++] = '\\';
+                detail[n++] = *c;
+            } else if ((unsigned char)*c >= ' ') {
+                detail[n++] = *c;
+            }
+        }
+        detail[n] = '\0';
+
+        length += snprintf(buffer + length, sizeof(buffer) - length,
+            "{\"name\":\"%s\",\"cat\":\"spidey\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d%s%s%s},\n",
+            e->name, e->start / 1000.0, (e->end - e->start) / 1000.0, pid, pid,
+            n ? ",\"args\":{\"uri\":\"" : "", detail, n ? "\"}" : "");
+    }
+    TraceCount = 0;
+
+    if (length && write(TraceFd, buffer, length) < 0) {
+        debug("Unable to write trace: %s", strerror(errno));
+    }
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,398 @@
+/* transmit.c: Transmit Scheduler */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+#define TRANSMIT_FLOWS		256     /* Large transfers scheduled at once */
+#define TRANSMIT_CLIENTS	1024    /* Clients rate limited at once (power of two) */
+#define TRANSMIT_PROBES		8       /* Client slots examined per lookup */
+#define TRANSMIT_IDLE		60000   /* Milliseconds before an idle client slot is reused */
+
+typedef struct {
+    pid_t   pid;                        /* Process sending (0 if free) */
+    bool    waiting;                    /* Whether flow waits for a grant */
+    bool    visited;                    /* Whether deficit was topped up this round */
+    size_t  want;                       /* Bytes flow wants to send */
+    size_t  granted;                    /* Bytes granted (0 until scheduled) */
+    int64_t deficit;                    /* Deficit round robin counter */
+} TransmitFlow;
+
+typedef struct {
+    char     host[NI_MAXHOST];          /* Client address (empty if free) */
+    double   tokens;                    /* Bytes client may send now */
+    uint64_t refilled;                  /* Monotonic milliseconds of last refill */
+} TransmitClient;
+
+typedef struct {
+    pthread_mutex_t lock;               /* Process-shared (robust) lock of everything below */
+    pthread_cond_t  changed;            /* Signaled when slices are granted or flows stop waiting */
+    size_t          cursor;             /* Flow whose turn it is */
+    double          tokens;             /* Bytes of Bandwidth available now */
+    uint64_t        refilled;           /* Monotonic milliseconds of last refill */
+    TransmitFlow    flows[TRANSMIT_FLOWS];
+    TransmitClient  clients[TRANSMIT_CLIENTS];
+} Transmit;
+
+/* Global Variables */
+static Transmit *Scheduler = NULL;      /* Shared scheduler (NULL if disabled) */
+
+/* Internal Declarations */
+static void transmit_lock(void);
+static long transmit_schedule(uint64_t now);
+static long transmit_client(Request *r, size_t want, uint64_t now);
+static bool transmit_sleep(Request *r, long msecs);
+static bool transmit_wait(Request *r, long msecs);
+
+/**
+ * Map shared scheduler.
+ *
+ * The scheduler is only needed when Bandwidth or ClientBandwidth limits
+ * transfers, and is created before any process forks so that every child and
+ * shard schedules against the same state.
+ **/
+void transmit_init(void) {
+    if (Bandwidth <= 0 && ClientBandwidth <= 0) {
+        return;
+    }
+
+    Transmit *t = mmap(NULL, sizeof(Transmit), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (t == MAP_FAILED) {
+        log("Unable to mmap transmit scheduler: %s", strerror(errno));
+        return;
+    }
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&t->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    pthread_condattr_t condition;
+    pthread_condattr_init(&condition);
+    pthread_condattr_setpshared(&condition, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&condition, CLOCK_MONOTONIC);
+    pthread_cond_init(&t->changed, &condition);
+    pthread_condattr_destroy(&condition);
+
+    t->tokens   = SendQuantum;
+    t->refilled = timer_now();
+    Scheduler   = t;
+    debug("Transmit        = quantum %ld, bandwidth %ld, client %ld bytes/s", SendQuantum, Bandwidth, ClientBandwidth);
+}
+
+/**
+ * Register large transfer with the scheduler.
+ *
+ * @param   r           Request structure.
+ * @param   size        Bytes the response body will send.
+ * @return  Flow of transfer, or -1 if it is sent unscheduled.
+ *
+ * Responses of up to SendQuantum bytes are never scheduled, so small requests
+ * keep their latency however many large downloads are in progress.  Neither
+ * are HTTP/2 streams (which have no socket of their own), since their
+ * connection interleaves the DATA frames of all of them.  Flows left behind
+ * by processes that died are reclaimed here, when a free one is needed.
+ **/
+long transmit_begin(Request *r, size_t size) {
+    if (!Scheduler || r->fd < 0 || size <= (size_t)SendQuantum) {
+        return -1;
+    }
+
+    long flow = -1;
+    transmit_lock();
+    for (long i = 0; i < TRANSMIT_FLOWS; i++) {
+        TransmitFlow *f = &Scheduler->flows[i];
+        if (f->pid == 0 || (kill(f->pid, 0) < 0 && errno == ESRCH)) {
+            *f   = (TransmitFlow){.pid = getpid()};
+            flow = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&Scheduler->lock);
+
+    if (flow < 0) {
+        debug("No transmit flow free for %s:%s; sending unscheduled", r->host, r->port);
+    }
+    return flow;
+}
+
+/**
+ * Wait until flow may send its next slice.
+ *
+ * @param   r           Request structure.
+ * @param   flow        Flow of transfer (from transmit_begin).
+ * @param   want        Bytes left to send.
+ * @return  Bytes that may be sent now (0 if a request deadline expired
+ * while waiting).
+ *
+ * Unscheduled transfers may send everything at once.  A scheduled transfer
+ * first waits for its client's token bucket (ClientBandwidth), so a rate
+ * limited client never holds up anyone else, and then for a grant of the
+ * shared Bandwidth in deficit round robin order over all waiting flows: each
+ * round tops up a flow's deficit by SendQuantum and grants it a slice of at
+ * most its deficit.  Since a flow never asks for more than SendQuantum, every
+ * slice is a full quantum except the last of a transfer, so this is plain
+ * round robin with equal turns: each large transfer gets the same share of
+ * Bandwidth whatever its size, and the deficit only keeps a flow that was
+ * passed over from losing its turn.
+ *
+ * Waiting processes sleep on a process-shared condition variable until a
+ * slice is granted, a flow stops waiting, or enough tokens accumulate for the
+ * flow whose turn it is.
+ **/
+size_t transmit_grant(Request *r, long flow, size_t want) {
+    if (flow < 0) {
+        return want;
+    }
+    if (want > (size_t)SendQuantum) {
+        want = SendQuantum;
+    }
+
+    /* Wait for client's rate limit */
+    long msecs;
+    while ((msecs = transmit_client(r, want, timer_now())) > 0) {
+        stats_add(throttled, 1);
+        if (!transmit_sleep(r, msecs)) {
+            return 0;
+        }
+    }
+    if (Bandwidth <= 0) {
+        return want;
+    }
+
+    /* Wait for grant of shared bandwidth */
+    TransmitFlow *f = &Scheduler->flows[flow];
+    transmit_lock();
+    f->want    = want;
+    f->granted = 0;
+    f->waiting = true;
+    while (true) {
+        msecs = transmit_schedule(timer_now());
+        if (f->granted) {
+            break;
+        }
+
+        stats_add(throttled, 1);
+        if (!transmit_wait(r, msecs)) {
+            f->waiting = false;
+            pthread_cond_broadcast(&Scheduler->changed);
+            pthread_mutex_unlock(&Scheduler->lock);
+            return 0;
+        }
+    }
+    want = f->granted;
+    pthread_mutex_unlock(&Scheduler->lock);
+    return want;
+}
+
+/**
+ * Release flow of finished transfer.
+ *
+ * @param   flow        Flow of transfer (from transmit_begin, may be -1).
+ **/
+void transmit_end(long flow) {
+    if (flow < 0) {
+        return;
+    }
+
+    transmit_lock();
+    Scheduler->flows[flow].pid = 0;
+    pthread_cond_broadcast(&Scheduler->changed);
+    pthread_mutex_unlock(&Scheduler->lock);
+}
+
+/**
+ * Lock scheduler, recovering it if the previous owner died holding it.
+ **/
+static void transmit_lock(void) {
+    if (pthread_mutex_lock(&Scheduler->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&Scheduler->lock);
+    }
+}
+
+/**
+ * Grant slices to waiting flows in deficit round robin order (scheduler
+ * locked).
+ *
+ * @param   now         Monotonic milliseconds.
+ * @return  Milliseconds until the flow whose turn it is can be granted its
+ * slice (0 if no flow is held up).
+ *
+ * Whichever waiting process holds the lock runs the round on behalf of all,
+ * starting at the flow whose turn it is and stopping at the first flow whose
+ * slice the available bandwidth does not cover, so that flow goes first once
+ * tokens accumulate.  Processes waiting for a grant are woken if any slice was
+ * granted.
+ **/
+static long transmit_schedule(uint64_t now) {
+    Transmit *t = Scheduler;
+
+    t->tokens  += (now - t->refilled) * Bandwidth / 1000.0;
+    t->refilled = now;
+    if (t->tokens > SendQuantum) {
+        t->tokens = SendQuantum;
+    }
+
+    long msecs   = 0;
+    bool granted = false;
+    for (size_t n = 0; n < TRANSMIT_FLOWS && !msecs; n++) {
+        TransmitFlow *f = &t->flows[t->cursor];
+        if (f->pid && f->waiting && !f->granted) {
+            if (!f->visited) {
+                f->deficit += SendQuantum;
+                f->visited  = true;
+            }
+
+            size_t slice = f->want < (size_t)f->deficit ? f->want : (size_t)f->deficit;
+            if (t->tokens < slice) {
+                msecs = (long)((slice - t->tokens) * 1000 / Bandwidth) + 1;
+                break;
+            }
+
+            t->tokens  -= slice;
+            f->deficit -= slice;
+            f->granted  = slice;
+            f->waiting  = false;
+            granted     = true;
+        }
+
+        /* Next flow's turn (a flow that is not waiting forfeits its deficit) */
+        if (!f->waiting && !f->granted) {
+            f->deficit = 0;
+        }
+        f->visited = false;
+        t->cursor  = (t->cursor + 1) % TRANSMIT_FLOWS;
+    }
+
+    if (granted) {
+        pthread_cond_broadcast(&t->changed);
+    }
+    return msecs;
+}
+
+/**
+ * Take slice from client's token bucket.
+ *
+ * @param   r           Request structure.
+ * @param   want        Bytes of slice.
+ * @param   now         Monotonic milliseconds.
+ * @return  0 if the slice was taken, otherwise milliseconds until it can be.
+ *
+ * Clients are looked up by address in a small open addressing table, taking
+ * over slots of clients idle for TRANSMIT_IDLE.  If the window is full the
+ * client shares the first slot's bucket.
+ **/
+static long transmit_client(Request *r, size_t want, uint64_t now) {
+    if (ClientBandwidth <= 0) {
+        return 0;
+    }
+
+    uint32_t hash = 2166136261u;
+    for (const char *c = r->host; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+
+    transmit_lock();
+    TransmitClient *client = NULL;
+    for (size_t i = 0; i < TRANSMIT_PROBES && !client; i++) {
+        TransmitClient *slot = &Scheduler->clients[(hash + i) & (TRANSMIT_CLIENTS - 1)];
+        if (streq(slot->host, r->host)) {
+            client = slot;
+        } else if (!slot->host[0] || now - slot->refilled > TRANSMIT_IDLE) {
+            snprintf(slot->host, sizeof(slot->host), "%s", r->host);
+            slot->tokens   = SendQuantum;
+            slot->refilled = now;
+            client = slot;
+        }
+    }
+    if (!client) {
+        client = &Scheduler->clients[hash & (TRANSMIT_CLIENTS - 1)];
+    }
+
+    client->tokens  += (now - client->refilled) * ClientBandwidth / 1000.0;
+    client->refilled = now;
+    if (client->tokens > SendQuantum) {
+        client->tokens = SendQuantum;
+    }
+
+    long msecs = 0;
+    if (client->tokens >= want) {
+        client->tokens -= want;
+    } else {
+        msecs = (long)((want - client->tokens) * 1000 / ClientBandwidth) + 1;
+    }
+    pthread_mutex_unlock(&Scheduler->lock);
+    return msecs;
+}
+
+/**
+ * Sleep while waiting to send, unless a request deadline expires first.
+ *
+ * @return  Whether or not the request may keep waiting.
+ **/
+static bool transmit_sleep(Request *r, long msecs) {
+    long expiry = timer_remaining(&r->expiry);
+    if (expiry > 0 && expiry < msecs) {
+        msecs = expiry;
+    }
+
+    struct timespec ts = {.tv_sec = msecs / 1000, .tv_nsec = (msecs % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+
+    timer_advance(&Timers);
+    if (r->timeout != TIMEOUT_NONE) {
+        debug("Request from %s:%s timed out waiting to send", r->host, r->port);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Wait for scheduler to change (scheduler locked), unless a request deadline
+ * expires first.
+ *
+ * @param   msecs       Longest wait in milliseconds (0 waits until signaled).
+ * @return  Whether or not the request may keep waiting.
+ **/
+static bool transmit_wait(Request *r, long msecs) {
+    long expiry = timer_remaining(&r->expiry);
+    if (expiry > 0 && (msecs == 0 || expiry < msecs)) {
+        msecs = expiry;
+    }
+
+    int result;
+    if (msecs > 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec  += msecs / 1000;
+        ts.tv_nsec += (msecs % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        result = pthread_cond_timedwait(&Scheduler->changed, &Scheduler->lock, &ts);
+    } else {
+        result = pthread_cond_wait(&Scheduler->changed, &Scheduler->lock);
+    }
+    if (result == EOWNERDEAD) {
+        pthread_mutex_consistent(&Scheduler->lock);
+    }
+
+    timer_advance(&Timers);
+    if (r->timeout != TIMEOUT_NONE) {
+        debug("Request from %s:%s timed out waiting to send", r->host, r->port);
+        return false;
+    }
+    return true;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
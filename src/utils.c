@@ -114,10 +114,13 @@ const char * http_status_string(Status status) {
         "200 OK",
         "400 Bad Request",
         "404 Not Found",
+        "408 Request Timeout",
+        "413 Payload Too Large",
         "500 Internal Server Error",
+        "503 Service Unavailable",
         "418 I'm A Teapot",
     };
-    if (status > 5)
+    if (status >= sizeof(StatusStrings) / sizeof(StatusStrings[0]))
         return NULL;
 
     return StatusStrings[status];
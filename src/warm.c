@@ -0,0 +1,290 @@
+/* warm.c: Startup Cache Warming */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Profile entry */
+typedef struct {
+    char   *uri;                        /* Request URI (without query) */
+    size_t  count;                      /* Number of requests in profile */
+} WarmUri;
+
+/* Profile */
+typedef struct {
+    WarmUri *uris;                      /* URIs in profile */
+    size_t   nuris;                     /* Number of URIs */
+    size_t   capacity;                  /* Allocated capacity of uris */
+} WarmProfile;
+
+/* Warm-up totals */
+typedef struct {
+    size_t warmed;                      /* URIs resolved to an existing path */
+    size_t pages;                       /* Pages of file contents prefetched */
+    size_t pinned;                      /* Bytes of small files locked in memory */
+    size_t cached;                      /* Entries stored in the shared cache */
+    size_t inlined;                     /* Complete responses stored in the inline store */
+} WarmTotals;
+
+/* Internal Declarations */
+static bool warm_add(WarmProfile *p, const char *uri, size_t length);
+static void warm_load_capture(WarmProfile *p, FILE *stream);
+static void warm_load_list(WarmProfile *p, FILE *stream);
+static int  warm_compare_uri(const void *a, const void *b);
+static int  warm_compare_count(const void *a, const void *b);
+static void warm_uri(const char *uri, WarmTotals *totals);
+
+/**
+ * Warm page cache, shared cache, and mime lookup from an access profile.
+ *
+ * @param   path        Access profile: a capture log of a previous run (see
+ * -C) or a list of URIs, one per line.
+ *
+ * The WarmLimit most requested URIs of the profile are resolved with
+ * determine_request_path and stat, and the contents of their files are
+ * prefetched with readahead.  Files small enough for the shared cache are
+ * also mapped and locked in memory for the lifetime of the server and stored
+ * in the shared cache along with their mimetype, and files of up to
+ * InlineLimit bytes have their complete response stored as well.  Warmed
+ * cache entries only start their CacheTTL when first requested, so a slow
+ * start of traffic does not expire them, and that first request compares the
+ * entry with its file, so a file changed or removed since startup is never
+ * served from the snapshot.  This runs before the server accepts any
+ * connection.
+ **/
+void warm_start(const char *path) {
+    FILE *stream = fopen(path, "r");
+    if (!stream) {
+        log("Unable to open access profile %s: %s", path, strerror(errno));
+        return;
+    }
+
+    /* Load profile */
+    uint64_t    started = timer_now();
+    WarmProfile profile = {0};
+    char        magic[sizeof(CAPTURE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), stream) == sizeof(magic) && memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0) {
+        warm_load_capture(&profile, stream);
+    } else {
+        rewind(stream);
+        warm_load_list(&profile, stream);
+    }
+    fclose(stream);
+
+    /* Merge duplicates and order by number of requests */
+    qsort(profile.uris, profile.nuris, sizeof(WarmUri), warm_compare_uri);
+    size_t nunique = 0;
+    for (size_t i = 0; i < profile.nuris; i++) {
+        if (nunique && streq(profile.uris[nunique - 1].uri, profile.uris[i].uri)) {
+            profile.uris[nunique - 1].count += profile.uris[i].count;
+            free(profile.uris[i].uri);
+        } else {
+            profile.uris[nunique++] = profile.uris[i];
+        }
+    }
+    qsort(profile.uris, nunique, sizeof(WarmUri), warm_compare_count);
+
+    /* Warm most requested URIs */
+    WarmTotals totals = {0};
+    size_t     nwarm  = nunique < (size_t)WarmLimit ? nunique : (size_t)WarmLimit;
+    for (size_t i = 0; i < nwarm; i++) {
+        warm_uri(profile.uris[i].uri, &totals);
+    }
+
+    for (size_t i = 0; i < nunique; i++) {
+        free(profile.uris[i].uri);
+    }
+    free(profile.uris);
+
+    log("Warmed %zu of %zu URIs in %lu ms: %zu pages prefetched, %zu bytes pinned, %zu cache entries, %zu inline responses",
+        totals.warmed, nwarm, (unsigned long)(timer_now() - started), totals.pages, totals.pinned, totals.cached, totals.inlined);
+}
+
+/**
+ * Add URI to profile (query removed).
+ *
+ * @return  Whether or not the URI was added.
+ **/
+static bool warm_add(WarmProfile *p, const char *uri, size_t length) {
+    const char *query = memchr(uri, '?', length);
+    if (query) {
+        length = query - uri;
+    }
+    if (length == 0 || uri[0] != '/') {
+        return false;
+    }
+
+    if (p->nuris == p->capacity) {
+        size_t   capacity = p->capacity ? 2 * p->capacity : 64;
+        WarmUri *uris     = realloc(p->uris, capacity * sizeof(WarmUri));
+        if (!uris) {
+            return false;
+        }
+        p->uris     = uris;
+        p->capacity = capacity;
+    }
+
+    char *copy = strndup(uri, length);
+    if (!copy) {
+        return false;
+    }
+    p->uris[p->nuris++] = (WarmUri){.uri = copy, .count = 1};
+    return true;
+}
+
+/**
+ * Load URIs of request lines in capture log (after its magic).
+ **/
+static void warm_load_capture(WarmProfile *p, FILE *stream) {
+    CaptureHeader header;
+    CaptureRecord record;
+    char          head[BUFSIZ];
+
+    if (fread((char *)&header + sizeof(header.magic), 1, sizeof(header) - sizeof(header.magic), stream) != sizeof(header) - sizeof(header.magic) ||
+        header.version != CAPTURE_VERSION) {
+        log("Access profile is not a version %d capture", CAPTURE_VERSION);
+        return;
+    }
+
+    while (fread(&record, sizeof(record), 1, stream) == 1) {
+        size_t length = record.length < sizeof(head) ? record.length : sizeof(head);
+        if (fread(head, 1, length, stream) != length) {
+            break;
+        }
+        if (record.length > length) {
+            fseek(stream, record.length - length, SEEK_CUR);
+        }
+
+        /* Request line is METHOD SP URI SP VERSION */
+        char *uri = memchr(head, ' ', length);
+        if (uri) {
+            uri++;
+            char *end = memchr(uri, ' ', head + length - uri);
+            if (end) {
+                warm_add(p, uri, end - uri);
+            }
+        }
+    }
+}
+
+/**
+ * Load URIs listed one per line (blank lines and # comments ignored).
+ **/
+static void warm_load_list(WarmProfile *p, FILE *stream) {
+    char line[BUFSIZ];
+
+    while (fgets(line, sizeof(line), stream)) {
+        char *uri = skip_whitespace(line);
+        if (*uri == '#') {
+            continue;
+        }
+        warm_add(p, uri, strcspn(uri, WHITESPACE "\r"));
+    }
+}
+
+/**
+ * Compare profile entries by URI.
+ **/
+static int warm_compare_uri(const void *a, const void *b) {
+    return strcmp(((const WarmUri *)a)->uri, ((const WarmUri *)b)->uri);
+}
+
+/**
+ * Compare profile entries by number of requests (most first).
+ **/
+static int warm_compare_count(const void *a, const void *b) {
+    size_t ca = ((const WarmUri *)a)->count;
+    size_t cb = ((const WarmUri *)b)->count;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/**
+ * Warm metadata and contents of one URI.
+ *
+ * @param   uri         Request URI.
+ * @param   totals      Warm-up totals to update.
+ *
+ * The cache entry is built the same way dispatch_request and
+ * handle_file_request build it, so the first request is a hit.
+ **/
+static void warm_uri(const char *uri, WarmTotals *totals) {
+    static long pagesize = 0;
+    if (!pagesize) {
+        pagesize = sysconf(_SC_PAGESIZE);
+    }
+
+    char *path = determine_request_path(uri);
+    struct stat s;
+    if (!path || stat(path, &s) < 0) {
+        debug("Unable to warm %s", uri);
+        free(path);
+        return;
+    }
+    totals->warmed++;
+
+    CacheEntry *entry = calloc(1, sizeof(CacheEntry));
+    if (!entry) {
+        free(path);
+        return;
+    }
+    snprintf(entry->key, sizeof(entry->key), "%s", uri);
+    snprintf(entry->path, sizeof(entry->path), "%s", path);
+    entry->length = -1;
+
+    if (S_ISDIR(s.st_mode)) {
+        entry->handler = HANDLER_BROWSE;
+    } else if (S_ISREG(s.st_mode) && access(path, R_OK) == 0) {
+        entry->handler = access(path, X_OK) != 0 ? HANDLER_FILE : plugin_path(path) ? HANDLER_PLUGIN : HANDLER_CGI;
+
+        /* Prefetch contents */
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            if (readahead(fd, 0, s.st_size) < 0) {
+                posix_fadvise(fd, 0, s.st_size, POSIX_FADV_WILLNEED);
+            }
+            totals->pages += (s.st_size + pagesize - 1) / pagesize;
+
+            /* Pin small files and keep their contents in the shared cache */
+            if (entry->handler == HANDLER_FILE && s.st_size > 0 && s.st_size <= CACHE_BODY) {
+                void *contents = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (contents != MAP_FAILED) {
+                    if (mlock(contents, s.st_size) == 0) {
+                        totals->pinned += s.st_size;
+                    }
+                    memcpy(entry->body, contents, s.st_size);
+                    entry->length = s.st_size;
+                }
+            }
+            close(fd);
+        }
+
+        /* Prime mime lookup */
+        if (entry->handler == HANDLER_FILE) {
+            char *mimetype = determine_mimetype(path);
+            snprintf(entry->mimetype, sizeof(entry->mimetype), "%s", mimetype ? mimetype : DefaultMimeType);
+            free(mimetype);
+        }
+    } else {
+        free(entry);
+        free(path);
+        return;
+    }
+
+    if (cache_store(entry, &s, true)) {
+        totals->cached++;
+    }
+    if (entry->handler == HANDLER_FILE && inline_store(entry, &s)) {
+        totals->inlined++;
+    }
+    free(entry);
+    free(path);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */